@@ -15,26 +15,108 @@
  *
  */
 
-#include "Memory_cell.h"
-
-Memory_cell::Memory_cell()         // undefined memory cell, types set to types_UNDEF
-{
-    set_undef();
-}
+#include <vector>
+#include <ostream>
+#include <cstddef>
 
-Memory_cell::Memory_cell(bool b) // boolean memory cell, types set to types_BOOLEAN
-{
-    set_boolean(b);
-}
+#include "Memory_cell.h"
 
-Memory_cell::Memory_cell(int i) // integer memory cell, types set to types_INT
-{
-    set_int(i);
+namespace {
+
+constexpr uint32_t no_string { UINT32_MAX };
+
+// Concatenations shorter than this are copied at once; longer ones become rope nodes.
+constexpr size_t flat_concatenation_limit { 64 };
+
+struct heap_string    // A string held by Memory_cells: either flat, or a rope node
+{
+    string characters;                // The characters of a flat string
+    size_t length { 0 };              // Length of the string
+    uint32_t references { 0 };        // Number of cells and rope nodes holding the string
+    uint32_t left { no_string };      // A rope node is the string left followed by the string right.
+    uint32_t right { no_string };     // Both are no_string for a flat string.
+};
+
+struct string_heap    // Strings held by Memory_cells, indexed by handle
+{
+    vector<heap_string> strings;
+    vector<uint32_t> free_handles;  // Handles of strings no longer held by any cell
+};
+
+string_heap &heap()
+// The heap is never destroyed, so that cells in static storage can still release their strings
+// when the program exits.
+{
+    static string_heap *strings = new string_heap;
+    return *strings;
+}
+
+uint32_t new_handle()
+// A handle for a new string, held once
+{
+    string_heap &h = heap();
+    uint32_t handle;
+    if (h.free_handles.empty()) {
+        handle = uint32_t(h.strings.size());
+        h.strings.emplace_back();
+    } else {
+        handle = h.free_handles.back();
+        h.free_handles.pop_back();
+    }
+    h.strings[handle].references = 1;
+    return handle;
+}
+
+void free_string(uint32_t handle)
+// The string is no longer held. Free it, and any parts of it that nothing else holds. Iterative,
+// as a string built by a loop is a rope as deep as the number of iterations.
+{
+    string_heap &h = heap();
+    vector<uint32_t> unheld { handle };
+    while (!unheld.empty()) {
+        heap_string &s = h.strings[unheld.back()];
+        h.free_handles.push_back(unheld.back());
+        unheld.pop_back();
+        for (uint32_t part : { s.left, s.right })
+            if ((part != no_string) and (--h.strings[part].references == 0))
+                unheld.push_back(part);
+        s.left = s.right = no_string;
+        s.characters.clear();    // Keeps its capacity for the next string given this handle
+    }
+}
+
+const string &flatten(uint32_t handle)
+// The characters of the string. A rope node is replaced by the flat string it stands for the first
+// time they are needed.
+{
+    string_heap &h = heap();
+    if (h.strings[handle].left == no_string)
+        return h.strings[handle].characters;
+
+    string characters;
+    characters.reserve(h.strings[handle].length);
+    vector<uint32_t> parts { handle };    // Still to be appended, the next on top
+    while (!parts.empty()) {
+        const heap_string &s = h.strings[parts.back()];
+        parts.pop_back();
+        if (s.left == no_string) {
+            characters += s.characters;
+        } else {
+            parts.push_back(s.right);
+            parts.push_back(s.left);
+        }
+    }
+    heap_string &s = h.strings[handle];
+    uint32_t left = s.left;
+    uint32_t right = s.right;
+    s.characters = move(characters);
+    s.left = s.right = no_string;
+    for (uint32_t part : { left, right })
+        if (--h.strings[part].references == 0)
+            free_string(part);
+    return h.strings[handle].characters;
 }
 
-Memory_cell::Memory_cell(float f) // real/float memory cell, types set to types_REAL
-{
-    set_real(f);
 }
 
 Memory_cell::Memory_cell(string s) // string memory cell, types set to types_STRING
@@ -42,99 +124,61 @@ Memory_cell::Memory_cell(string s) // string memory cell, types set to types_STR
     set_string(s);
 }
 
-bool Memory_cell::is_undef()            // Returns true if memory cell has type types_UNDEF
-{
-    return (this->type == types_UNDEF);
-}
-
-bool Memory_cell::is_boolean()        // Returns true if memory cell has type type_BOOLEAN
-{
-    return (this->type == types_BOOLEAN);
-}
-
-bool Memory_cell::is_int()            // Returns true if memory cell has type types_INT
-{
-    return (this->type == types_INT);
-}
-
-bool Memory_cell::is_real()            // Returns true if memory cell has type types_REAL
-{
-    return (this->type == types_REAL);
-}
-
-bool Memory_cell::is_string()        // Returns true if memory cell has type types_STRING
-{
-    return (this->type == types_STRING);
-}
-
-void Memory_cell::set_boolean(bool b) // boolean memory cell, types set to types_BOOLEAN
-{
-    this->type = types_BOOLEAN;
-    this->bvalue = b;
-}
-
-void Memory_cell::set_int(int i)        // integer memory cell, types set to types_INT
-{
-    this->type = types_INT;
-    this->ivalue = i;
-}
-
-void Memory_cell::set_real(float f)     // real/float memory cell, types set to types_REAL
-{
-    this->type = types_REAL;
-    this->rvalue = f;
-}
-
 void Memory_cell::set_string(string s) // string memory cell, types set to types_STRING
 {
-    this->type = types_STRING;
-    this->svalue = s;
+    uint32_t handle = new_handle();
+    heap_string &hs = heap().strings[handle];
+    hs.length = s.size();
+    hs.characters.swap(s);
+    set_type(types_STRING);
+    this->value.svalue = handle;
+}
+
+void Memory_cell::concatenate(Memory_cell &cell)    // string memory cell holding this string
+                                                     // followed by that in cell
+{
+    if ((this->type != types_STRING) or (cell.type != types_STRING))
+        illegal_access();
+    string_heap &h = heap();
+    uint32_t left = this->value.svalue;
+    uint32_t right = cell.value.svalue;
+    size_t length = h.strings[left].length + h.strings[right].length;
+    if (length < flat_concatenation_limit) {
+        set_string(flatten(left) + flatten(right));
+        return;
+    }
+    uint32_t handle = new_handle();    // Takes over this cell's hold on left
+    heap_string &node = h.strings[handle];
+    node.length = length;
+    node.left = left;
+    node.right = right;
+    h.strings[right].references++;
+    this->value.svalue = handle;
 }
 
-void Memory_cell::set_undef()            // sets the memory cell to be undefined.
-{
-    this->type = types_UNDEF;
-}
-
-Memory_cell::types Memory_cell::get_type()    // returns the type of memory cell
-{
-    return this->type;
-}
-
-bool Memory_cell::get_boolean()    // returns boolean value in cell if types is types_BOOLEAN, otherwise
-                                // throws an exception.
+string Memory_cell::get_string()    // returns string value in cell if types is types_STRING, otherwise
+                                    // throws an exception.
 {
-    if (this->type == types_BOOLEAN)
-        return this->bvalue;
+    if (this->type == types_STRING)
+        return flatten(this->value.svalue);
     else
         throw "Illegal access of value in memory cell";
 }
 
-int Memory_cell::get_int()        // returns integer value in cell if types is types_INTEGER, otherwise
-                                // throws an exception.
+void Memory_cell::retain(uint32_t handle)
 {
-    if (this->type == types_INT)
-        return this->ivalue;
-    else
-        throw "Illegal access of value in memory cell";
+    heap().strings[handle].references++;
 }
 
-float Memory_cell::get_real()    // returns real/float value in cell if types is types_REAL, otherwise
-                                // throws an exception.
+void Memory_cell::release(uint32_t handle)
 {
-    if (this->type == types_REAL)
-        return this->rvalue;
-    else
-        throw "Illegal access of value in memory cell";
+    if (--heap().strings[handle].references == 0)
+        free_string(handle);
 }
 
-string Memory_cell::get_string()    // returns string value in cell if types is types_STRING, otherwise
-                                    // throws an exception.
+void Memory_cell::illegal_access()
 {
-    if (this->type == types_STRING)
-        return this->svalue;
-    else
-        throw "Illegal access of value in memory cell";
+    throw "Illegal access of value in memory cell";
 }
 
 string Memory_cell::to_string()        // Return string representing the memory cell
@@ -154,4 +198,57 @@ string Memory_cell::to_string()        // Return string representing the memory
     return s;
 }
 
-
+namespace {
+
+struct saved_cell    // A Memory_cell as a snapshot holds it
+{
+    Memory_cell::types type;
+    uint8_t unused[3] { };
+    uint32_t value;    // A string's index in the snapshot's table of strings
+};
+
+}
+
+void Memory_cell::save_cells(ostream &out, Memory_cell *cells, size_t count, vector<string> &strings)
+{
+    static_assert((sizeof(saved_cell) == sizeof(Memory_cell)) and (offsetof(Memory_cell, value) == offsetof(saved_cell, value)),
+            "a saved cell must be laid out as a Memory_cell is");
+    static_assert((offsetof(Memory_cell, type) == type_offset) and (offsetof(Memory_cell, value) == value_offset),
+            "type_offset and value_offset must give the layout of a Memory_cell");
+    vector<uint32_t> index(heap().strings.size(), no_string);    // Of each handle in strings
+    for (size_t i = 0; i < count; i++) {
+        Memory_cell &cell = cells[i];
+        saved_cell saved { cell.type };
+        saved.value = cell.value.svalue;
+        if (cell.type == types_STRING) {
+            uint32_t &handle_index = index[cell.value.svalue];
+            if (handle_index == no_string) {
+                handle_index = uint32_t(strings.size());
+                strings.push_back(cell.get_string());
+            }
+            saved.value = handle_index;
+        }
+        out.write(reinterpret_cast<const char *>(&saved), sizeof(saved));
+    }
+}
+
+void Memory_cell::restore_strings(Memory_cell *cells, size_t count, const vector<string> &strings)
+{
+    string_heap &h = heap();
+    if (!h.strings.empty())
+        throw string("Strings cannot be restored once the heap is in use.");
+    h.strings.resize(strings.size());
+    for (size_t i = 0; i < count; i++) {
+        if (cells[i].type == types_STRING) {
+            if (cells[i].value.svalue >= strings.size())
+                throw "Cell " + std::to_string(i) + " holds an unknown string.";
+            h.strings[cells[i].value.svalue].references++;
+        }
+    }
+    for (uint32_t handle = 0; handle < strings.size(); handle++) {
+        h.strings[handle].characters = strings[handle];
+        h.strings[handle].length = strings[handle].size();
+        if (h.strings[handle].references == 0)
+            h.free_handles.push_back(handle);
+    }
+}
@@ -19,6 +19,9 @@
 #define MEMORY_CELL_H_
 
 #include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
 
 using namespace std;
 
@@ -30,10 +33,16 @@ class Memory_cell {
     // if you choose to simply store a bit pattern in each memory cell and want to be able to
     // do things such as write a floating point number to a cell and then interpret it as an
     // integer.
+    //
+    // A cell is 8 bytes: the type and a union of the values. A string is kept in the string heap
+    // (see Memory_cell.cpp) and the cell holds its handle. Copies of a cell share the string, which
+    // is freed when the last of them is changed or destroyed. The accessors are inline and only
+    // leave the fast path to report an access of the wrong type. A long concatenation is kept as a
+    // rope node that refers to its two parts, and is only flattened when get_string() needs it.
 
 public:
 
-    enum types            // Types known to the PAL machine
+    enum types : uint8_t    // Types known to the PAL machine
     {
         types_UNDEF,    // Undefined
         types_BOOLEAN,    // Boolean
@@ -43,60 +52,146 @@ public:
     };
 
     // Constructors. There is one for each type of tagged storage.
-    Memory_cell();            // undefined memory cell, types set to types_UNDEF
+    Memory_cell() { }        // undefined memory cell, types set to types_UNDEF
 
-    Memory_cell(bool b);    // boolean memory cell, types set to types_BOOLEAN
+    Memory_cell(bool b) { set_boolean(b); }    // boolean memory cell, types set to types_BOOLEAN
 
-    Memory_cell(int i);        // integer memory cell, types set to types_INT
+    Memory_cell(int i) { set_int(i); }        // integer memory cell, types set to types_INT
 
-    Memory_cell(float f);    // real/float memory cell, types set to types_REAL
+    Memory_cell(float f) { set_real(f); }    // real/float memory cell, types set to types_REAL
 
     Memory_cell(string s);    // string memory cell, types set to types_STRING
 
-    bool is_undef();        // Returns true if memory cell has type types_UNDEF
-
-    bool is_boolean();        // Returns true if memory cell has type type_BOOLEAN
-
-    bool is_int();            // Returns true if memory cell has type types_INT
-
-    bool is_real();            // Returns true if memory cell has type types_REAL
-
-    bool is_string();        // Returns true if memory cell has type types_STRING
-
-    void set_boolean(bool b);    // boolean memory cell, types set to types_BOOLEAN
-
-    void set_int(int i);    // integer memory cell, types set to types_INT
-
-    void set_real(float f); // real/float memory cell, types set to types_REAL
+    Memory_cell(const Memory_cell &cell) : type { cell.type }, value { cell.value } {
+        if (type == types_STRING)
+            retain(value.svalue);
+    }
+
+    Memory_cell(Memory_cell &&cell) : type { cell.type }, value { cell.value } {
+        cell.type = types_UNDEF;
+    }
+
+    Memory_cell &operator=(const Memory_cell &cell) {
+        if (cell.type == types_STRING)    // before the release, in case cell is this cell
+            retain(cell.value.svalue);
+        if (type == types_STRING)
+            release(value.svalue);
+        type = cell.type;
+        value = cell.value;
+        return *this;
+    }
+
+    Memory_cell &operator=(Memory_cell &&cell) {
+        if (this != &cell) {
+            if (type == types_STRING)
+                release(value.svalue);
+            type = cell.type;
+            value = cell.value;
+            cell.type = types_UNDEF;
+        }
+        return *this;
+    }
+
+    ~Memory_cell() {
+        if (type == types_STRING)
+            release(value.svalue);
+    }
+
+    bool is_undef() { return type == types_UNDEF; }        // Returns true if memory cell has type types_UNDEF
+
+    bool is_boolean() { return type == types_BOOLEAN; }    // Returns true if memory cell has type type_BOOLEAN
+
+    bool is_int() { return type == types_INT; }            // Returns true if memory cell has type types_INT
+
+    bool is_real() { return type == types_REAL; }          // Returns true if memory cell has type types_REAL
+
+    bool is_string() { return type == types_STRING; }      // Returns true if memory cell has type types_STRING
+
+    void set_boolean(bool b) {    // boolean memory cell, types set to types_BOOLEAN
+        set_type(types_BOOLEAN);
+        value.bvalue = b;
+    }
+
+    void set_int(int i) {    // integer memory cell, types set to types_INT
+        set_type(types_INT);
+        value.ivalue = i;
+    }
+
+    void set_real(float f) { // real/float memory cell, types set to types_REAL
+        set_type(types_REAL);
+        value.rvalue = f;
+    }
 
     void set_string(string s);    // string memory cell, types set to types_STRING
 
-    void set_undef();        // sets the memory cell to be undefined.
+    void concatenate(Memory_cell &cell);    // string memory cell holding this string followed by
+                                            // that in cell. Both must be strings.
 
-    types get_type();        // returns the type of memory cell
+    void set_undef() { set_type(types_UNDEF); }        // sets the memory cell to be undefined.
 
-    bool get_boolean();        // returns boolean value in cell if types is types_BOOLEAN, otherwise
-                            // throws an exception.
+    types get_type() { return type; }        // returns the type of memory cell
+
+    bool get_boolean() {        // returns boolean value in cell if types is types_BOOLEAN, otherwise
+                                // throws an exception.
+        if (type != types_BOOLEAN)
+            illegal_access();
+        return value.bvalue;
+    }
 
-    int get_int();            // returns integer value in cell if types is types_INTEGER, otherwise
+    int get_int() {            // returns integer value in cell if types is types_INTEGER, otherwise
                                 // throws an exception.
+        if (type != types_INT)
+            illegal_access();
+        return value.ivalue;
+    }
 
-    float get_real();        // returns real/float value in cell if types is types_REAL, otherwise
+    float get_real() {        // returns real/float value in cell if types is types_REAL, otherwise
                              // throws an exception.
+        if (type != types_REAL)
+            illegal_access();
+        return value.rvalue;
+    }
 
     string get_string();    // returns string value in cell if types is types_STRING, otherwise
                             // throws an exception.
 
     string to_string();        // Return string representing the memory cell
 
+    // Where the type and the value lie within a cell, for code generated by the JIT, which tests
+    // and copies cells itself.
+    static constexpr int type_offset { 0 };
+    static constexpr int value_offset { 4 };
+
+    // Snapshots of the PAL machine (see pal_snapshot.h) hold cells as they are laid out here, except
+    // that a string is replaced by its index in a table of the strings saved.
+    static void save_cells(ostream &out, Memory_cell *cells, size_t count, vector<string> &strings);
+                                // Write the cells, adding their strings to strings
+    static void restore_strings(Memory_cell *cells, size_t count, const vector<string> &strings);
+                                // The cells were saved so and are back in place: make the strings
+                                // theirs. The heap must not yet hold any string.
+
 private:
     // type will record the the type of value stored in the memory cell
     // Based on this value, only one of the resulting values will be accessible.
     types type { types_UNDEF };    // Type of value stored in the memory cell
-    bool bvalue { false };        // Boolean value in cell if type == types_BOOLELAN
-    int ivalue { 0 };            // Integer value in cell is type == types_INT
-    float rvalue { 0.0 };          // Real (float) value in cell if type == types_REAL
-    string svalue { "" };          // String value in cell if type == types_STRING
+    union {
+        bool bvalue;        // Boolean value in cell if type == types_BOOLELAN
+        int ivalue;         // Integer value in cell is type == types_INT
+        float rvalue;       // Real (float) value in cell if type == types_REAL
+        uint32_t svalue;    // Handle of the string in the string heap if type == types_STRING
+    } value { .ivalue = 0 };
+
+    void set_type(types t) {    // Change the type, releasing any string held
+        if (type == types_STRING)
+            release(value.svalue);
+        type = t;
+    }
+
+    static void retain(uint32_t handle);     // One more cell holds the string
+    static void release(uint32_t handle);    // One cell fewer holds the string
+    [[noreturn]] static void illegal_access();
 };
 
+static_assert(sizeof(Memory_cell) == 8, "Memory_cell should be an 8 byte tag and value");
+
 #endif /* MEMORY_CELL_H_ */
@@ -16,14 +16,41 @@
  * Open Source - free to distribute and modify. May not be used for profit.
  *
  * Written using C++20.
- *         g++ -std=c++2a -o pal pal.ccp
+ *         g++ -std=c++2a -o pal pal.ccp pal_machine.cpp Memory_cell.cpp
+ *
+ * The state of the machine, the loader and the reference implementation of each instruction are in
+ * pal_machine.cpp, which is shared with the C++ programs that pal2cpp translates PAL code into.
+ * This file holds the execution engines and the command line handling.
  *
  *
  * Usage
- *        pal [filename]
+ *        pal [flags] [filename]
  * where filename contains the instruction code to be executed. If no filename is provided, then the
  * default file named "CODE" is used. If that is also not present, then an error is generated.
  *
+ * Two execution engines are provided. The switch engine (execute_code) decodes every instruction
+ * through a switch statement and is the reference implementation. The threaded engine
+ * (execute_threaded) translates the code store once so that every instruction carries the address
+ * of the code that implements it, and then dispatches with computed gotos. It is selected with
+ * --engine=threaded. Every engine must produce the same output. The threaded engine also executes
+ * common instruction sequences (loop tests, increments) as single superinstructions, and rewrites
+ * each arithmetic or comparison operation the first time it executes into a version specialised for
+ * the operand types it found ("quickening"). --no-fuse and --no-quicken turn these off.
+ *
+ * The register engine (execute_registers, --engine=register) translates each run of loads,
+ * arithmetic and comparisons that ends in a store or a conditional jump into three-address
+ * instructions that operate directly on the variables in the frame, so that "LDV; LCI; OPR 3; STO"
+ * is dispatched as the one instruction "x := x + 1". Everything else is executed as it stands.
+ *
+ * With --jit, each procedure is compiled into x86-64 code once it has run for a while (see
+ * execute_jit). The compiled code keeps the tagged memory cells: it checks their tags inline, and
+ * leaves strings, reals, calls and anything else it does not compile to the interpreter. On other
+ * machines --jit simply interprets the code.
+ *
+ * --trace-jit is a separate tier: the switch engine runs the program, and each loop that becomes hot
+ * is recorded for one iteration and, if it only computes with integers, compiled into a native loop
+ * with side exits back to the interpreter (see execute_trace_jit).
+ *
  *
  * The PAL Machine
  *
@@ -446,8 +473,17 @@
 #include <map>
 #include <vector>
 #include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <bit>
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 #include "Memory_cell.h"
+#include "pal_machine.h"
+#include "pal_profile.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -455,980 +491,2055 @@ using namespace std::chrono;
 // Global variables follow.
 
 // flags
-bool debugging_pal_code { false };
+enum engine_kind    // Execution engines available in the PAL machine
+{
+    engine_switch,      // Switch based dispatch (reference engine)
+    engine_threaded,    // Direct-threaded dispatch using computed gotos
+    engine_register,    // Stack code translated into three-address register instructions
+    engine_jit,         // Procedures compiled to x86-64 code (baseline JIT)
+    engine_trace        // Interpreter with hot loops compiled to x86-64 code (tracing JIT)
+};
 
-// constexpr int data_alloc_index { 3 };     // Space for return links etc on the stack
-// constexpr int lev_max { 5 };             // Maximum depth of block nesting
-constexpr int code_size { 10000 };            // Size of instruction store
-constexpr int store_size { 10000 };         // Size of data store
+engine_kind pal_engine { engine_switch };  // Engine used to execute the code store
+int benchmark_runs { 0 };                  // Number of benchmark runs requested (0 = no benchmark)
+bool fusing_instructions { true };         // Fuse common sequences into superinstructions
+bool quickening_instructions { true };     // Specialise OPR 3-15 to the operand types seen
 
-enum fun_code    // Function codes in the PAL instruction set
+long long instructions_dispatched { 0 };   // Instructions dispatched by the most recent run
+
+string default_code_file_name { "CODE" };    // Name of default code file.
+bool loading_object { false };               // Is the code file a PAL object file?
+
+bool compiling_object { false };             // Write the code as an object file instead of executing it
+string object_file_name;                     // Name of that file, if not derived from the code file
+string loaded_file_name;                     // Name of the code file loaded
+bool verifying_code { false };               // Report on the verification of the code instead of executing it
+
+bool profiling { false };                    // Report a profile of the run
+bool profiling_time { false };               // Sample the time spent at each address while profiling
+string profile_file_name;                    // File for the profile report; standard output if empty
+string callgrind_file_name;                  // File for the call graph profile, if one is wanted
+bool timing_calls { false };                 // Time the calls in it
+string trace_file_name;                      // File for the binary trace, if one is wanted
+uint32_t trace_capacity { 1 << 20 };         // Events it keeps, a power of 2
+string restore_file_name;                    // Snapshot to resume instead of loading a code file
+
+struct threaded_instruction               // An instruction prepared for the threaded engine
 {
-    fun_MST,    // Mark the stack
-    fun_CAL,    // Procedure call
-    fun_INC,    // Increoment top-of-stack pointer
-    fun_JIF,    // Jump if false
-    fun_JMP,    // Inconditinoal jump
-    fun_LCI,    // Load integer constant onto stack
-    fun_LCR,    // Load real constant onto stack
-    fun_LCS,    // Load string literal onto stack
-    fun_LDA,    // Load the absolute address of a variable onto the stack
-    fun_LDI,    // Load the value stored at specifed address onto the stack
-    fun_LDV,    // Load the value of a variable onto the stack
-    fun_LDU,    // Load an undefined or void value
-    fun_OPR,    // Execute operation - there are 32 of them
-    fun_RDI,    // Read a value into an integer variable
-    fun_RDR,    // Read a value into a real variable
-    fun_STI,    // Load top-of-stack - 1 into a variable at address top-of-stack
-    fun_STO,    // Store into a variable
-    fun_SIG,    // Raise signal
-    fun_REH,    // Register exception handler
-    fun_DBG     // Turn debugging status on/off
+    const void *handler { nullptr };      // Address of the code that implements the instruction
+    int32_t l { 0 };                      // Level difference, copied from the code store
+    int32_t a { 0 };                      // Operand, copied from the code store
 };
 
-// set up mapping from string to function codes;
-map<string, fun_code> fun_code_map;
-
-Memory_cell data_store[store_size] { Memory_cell() }; // Define data memory (RAM)
+vector<threaded_instruction> threaded_code;      // Code store translated for the threaded engine
+bool code_threaded { false };                    // Has code_store been translated yet?
 
-constexpr int instruction_size { 3 };     // Each instruction consists of 3 components.
+enum register_code : uint8_t    // Operations of the register form (see translate_to_registers)
+{
+    register_stack,     // Execute the stack instruction at address start
+    register_move,      // dst := src1
+    register_binary,    // dst := src1 <operation> src2
+    register_branch     // dst := src1 <operation> src2, push it and jump to target if it is false
+};
 
-struct instruction                        // Description of a single instruction
+enum operand_kind : uint8_t    // Where a register operand lives
 {
-    fun_code f { fun_MST };                // Function code
-    int l { 0 };                        // Level difference
-    Memory_cell a;    // Offset address or constant value
+    operand_variable,     // data_store[base(level) + value]
+    operand_constant,     // register_constants[value]
+    operand_temporary     // data_store[top_of_stack + value], the stack cell the stack code would use
 };
 
+struct register_operand
+{
+    operand_kind kind { operand_constant };
+    int16_t level { 0 };                  // Level difference of a variable
+    int32_t value { 0 };                  // Displacement, constant index or stack offset
+};
 
-instruction code_store[code_size];        // Instruction store
-// Note that the data store and instruction store are separated for convenience.
+struct register_instruction                // A three-address instruction of the register form
+{
+    register_code op { register_stack };
+    uint8_t operation { 0 };               // OPR operation number of register_binary and register_branch
+    bool last { true };                    // Last register instruction of its group
+    int32_t start { 0 };                   // Address of the first stack instruction of the group
+    int32_t length { 1 };                  // Number of stack instructions in the group
+    int32_t target { 0 };                  // Jump target of register_branch
+    register_operand dst, src1, src2;
+};
 
-// The PAL machine has a number of predefined exceptions
-constexpr int re_raise_exception { 0 };
-constexpr int program_abort_exception { 1 };
-constexpr int no_return_in_function_exception { 2 };    // Used in compiler
-constexpr int input_error_exception { 3 };
-constexpr int end_error_exception { 4 };
-constexpr int abort_program_exception { 5 };
-constexpr int other_exception { 6 };
+vector<register_instruction> register_code;   // Code store translated for the register engine
+vector<int> register_entry;                   // Register instruction starting at each address, or -1
+vector<Memory_cell> register_constants;       // Integer constants used by register instructions
+bool code_registered { false };               // Has code_store been translated yet?
+
+void fuse_instructions()
+// Find the instruction sequences that the compiler emits for loop tests, increments and loop
+// initialisation, and mark the first instruction of each as a superinstruction. The sequences were
+// chosen by counting n-grams with palngram. Only the threaded engine uses the marks. The
+// instructions themselves are left in place, so a jump that lands inside a fused sequence simply
+// executes the rest of it one instruction at a time, and no jump target needs adjusting.
+{
+    for (int i = 1; i <= last_instruction; i++) {
+        instruction *p = &code_store[i];
+        int remaining = last_instruction - i;   // instructions following p
+
+        p->fused = fused_none;
+        if ((remaining >= 3) and (p[0].f == fun_LDV) and (p[1].f == fun_LDV)
+                and (p[2].f == fun_OPR) and (p[2].a >= 10) and (p[2].a <= 15)
+                and (p[3].f == fun_JIF) and (p[3].a >= 0) and (p[3].a <= last_instruction)) {
+            p->fused = fused_code(fused_test_eq + p[2].a - 10);
+        } else if ((remaining >= 3) and (p[0].f == fun_LDV) and (p[1].f == fun_LCI)
+                and (p[2].f == fun_OPR) and ((p[2].a == 3) or (p[2].a == 4))
+                and (p[3].f == fun_STO)) {
+            p->fused = (p[2].a == 3) ? fused_increment : fused_decrement;
+        } else if ((remaining >= 2) and (p[0].f == fun_OPR) and (p[0].a == 23)
+                and (p[1].f == fun_STO) and (p[2].f == fun_STO)) {
+            p->fused = fused_duplicate_store;
+        }
+    }
+}
 
-int pal_exception { program_abort_exception };  // Name of the current exception
 
-int last_instruction { 0 };      // Index of last instruction loaded into code_store
+inline int frame_base(int l)
+// Base of the frame l levels down, or -1 if a static link on the way is not an integer. Used by
+// superinstructions, which leave any error to be reported by the individual instructions.
+{
+    if ((l > 0) and (l <= display_depth))
+        return display[display_depth - l];
+    int b1 { base_register };
+    while (l > 0) {
+        if (!data_store[b1 - 4].is_int())
+            return -1;
+        b1 = data_store[b1 - 4].get_int();
+        l--;
+    }
+    return b1;
+}
 
-ifstream code_file;                // Read-only file containing the PAL instructions
-// generated by the compiler.
 
-string default_code_file_name { "CODE" };    // Name of default code file.
+template<typename Op>
+inline int fused_test(const threaded_instruction *ip, Op op)
+// Comparison of the fused LDV; LDV; OPR; JIF loop test. ip[-1] and ip[0] are the two LDV
+// instructions. Returns the result of the comparison (0 or 1), or -1 without changing anything if
+// the operands are not both integers or both reals.
+{
+    int lhs_base = frame_base(ip[-1].l);
+    int rhs_base = frame_base(ip[0].l);
+    if ((lhs_base < 0) or (rhs_base < 0))
+        return -1;
+
+    Memory_cell &lhs = data_store[lhs_base + ip[-1].a];
+    Memory_cell &rhs = data_store[rhs_base + ip[0].a];
+    if (lhs.is_int() and rhs.is_int())
+        return op(lhs.get_int(), rhs.get_int());
+    if (lhs.is_real() and rhs.is_real())
+        return op(lhs.get_real(), rhs.get_real());
+    return -1;
+}
 
-// registers
-int program_counter { 0 };
-int base_register { 0 };
-int top_of_stack { 0 };
-instruction *instruction_register;
 
-void establish_function_mapping()
+template<typename Op>
+inline void threaded_arithmetic(Op op)
+// Addition, subtraction and multiplication for the threaded engine. Same semantics as OPR 3-5 in
+// execute_code().
 {
-    // Set up mapping of strings onto function codes.
-    // insert elements into the map
-    fun_code_map.insert(pair<string, fun_code>("MST", fun_MST)); // Mark the stack
-    fun_code_map.insert(pair<string, fun_code>("CAL", fun_CAL)); // Procedure call
-    fun_code_map.insert(pair<string, fun_code>("INC", fun_INC)); // Increment top-of-stack pointer
-    fun_code_map.insert(pair<string, fun_code>("JIF", fun_JIF)); // Jump if false
-    fun_code_map.insert(pair<string, fun_code>("JMP", fun_JMP)); // Unconditional jump
-    fun_code_map.insert(pair<string, fun_code>("LCI", fun_LCI)); // Load integer constant onto stack
-    fun_code_map.insert(pair<string, fun_code>("LCR", fun_LCR)); // Load real constant onto stack
-    fun_code_map.insert(pair<string, fun_code>("LCS", fun_LCS)); // Load string literal onto stack
-    fun_code_map.insert(pair<string, fun_code>("LDA", fun_LDA)); // Load the absolute address of a variable onto the stack
-    fun_code_map.insert(pair<string, fun_code>("LDI", fun_LDI)); // Load the value stored at specified address onto the stack
-    fun_code_map.insert(pair<string, fun_code>("LDV", fun_LDV)), // Load the value of a variable onto the stack
-    fun_code_map.insert(pair<string, fun_code>("LDU", fun_LDU)); // Load an undefined or void value
-    fun_code_map.insert(pair<string, fun_code>("OPR", fun_OPR)); // Execute operation - there are 32 of them
-    fun_code_map.insert(pair<string, fun_code>("RDI", fun_RDI)); // Read a value into an integer variable
-    fun_code_map.insert(pair<string, fun_code>("RDR", fun_RDR)); // Read a value into a real variable
-    fun_code_map.insert(pair<string, fun_code>("STI", fun_STI)); // Load top-of-stack - 1 into a variable at address top-of-stack
-    fun_code_map.insert(pair<string, fun_code>("STO", fun_STO)); // Store into a variable
-    fun_code_map.insert(pair<string, fun_code>("SIG", fun_SIG)); // Raise signal
-    fun_code_map.insert(pair<string, fun_code>("REH", fun_REH)); // Register exception handler
-    fun_code_map.insert(pair<string, fun_code>("DBG", fun_DBG)); // Turn debugging status on/off
+    top_of_stack--;
+    Memory_cell &lhs = data_store[top_of_stack];
+    Memory_cell &rhs = data_store[top_of_stack + 1];
+    if (lhs.get_type() != rhs.get_type()) {
+        error("Operands must be of the same type.");
+    } else {
+        switch (lhs.get_type()) {
+        case Memory_cell::types_INT:
+            lhs.set_int(op(lhs.get_int(), rhs.get_int()));
+            break;
+        case Memory_cell::types_REAL:
+            lhs.set_real(op(lhs.get_real(), rhs.get_real()));
+            break;
+        default:
+            error("Operands must be integer or real");
+            break;
+        }
+    }
 }
 
 
-fun_code strtofun(string s)
-// return the function code associated with string
+template<typename Op>
+inline void threaded_comparison(Op op)
+// Comparison operators for the threaded engine. Same semantics as OPR 10-15 in execute_code().
 {
-    return fun_code_map.find(s)->second;
+    top_of_stack--;
+    Memory_cell &lhs = data_store[top_of_stack];
+    Memory_cell &rhs = data_store[top_of_stack + 1];
+    if (lhs.get_type() != rhs.get_type()) {
+        error("operands must be of the same type.");
+    } else {
+        switch (lhs.get_type()) {
+        case Memory_cell::types_BOOLEAN:
+            lhs.set_boolean(op(lhs.get_boolean(), rhs.get_boolean()));
+            break;
+        case Memory_cell::types_INT:
+            lhs.set_boolean(op(lhs.get_int(), rhs.get_int()));
+            break;
+        case Memory_cell::types_REAL:
+            lhs.set_boolean(op(lhs.get_real(), rhs.get_real()));
+            break;
+        default:
+            error("Operands must in integer, floating point, or boolean.");
+            break;
+        }
+    }
 }
 
-string funtostr(fun_code f)
+
+void execute_threaded()
+// Direct-threaded engine. The code store is translated (once) into threaded_code, where every
+// instruction carries the address of its handler; OPR instructions are resolved to the handler of
+// the individual operation. Each handler finishes by jumping straight to the handler of the next
+// instruction, so there is no central switch. The semantics, including the listing produced with
+// -l, are those of execute_code().
 {
-    string key = "";
-    for (auto &i : fun_code_map) {
-        if (i.second == f) {
-            key = i.first;
-            break; // to stop searching
+    static const void *const fun_handlers[] = {    // Indexed by fun_code
+        &&do_MST, &&do_CAL, &&do_INC, &&do_JIF, &&do_JMP, &&do_LCI, &&do_LCR,
+        &&do_LCS, &&do_LDA, &&do_LDI, &&do_LDV, &&do_LDU, &&do_OPR, &&do_RDI,
+        &&do_RDR, &&do_STI, &&do_STO, &&do_SIG, &&do_REH, &&do_DBG
+    };
+    static const void *const opr_handlers[] = {    // Indexed by OPR operation number
+        &&opr_procedure_return, &&opr_function_return, &&opr_negate, &&opr_add,
+        &&opr_subtract, &&opr_multiply, &&opr_divide, &&opr_exponent, &&opr_concatenate,
+        &&opr_odd, &&opr_eq, &&opr_ne, &&opr_lt, &&opr_ge, &&opr_gt, &&opr_le, &&opr_not,
+        &&opr_true, &&opr_false, &&opr_eof, &&opr_write, &&opr_newline, &&opr_swap,
+        &&opr_duplicate, &&opr_drop, &&opr_int_to_real, &&opr_real_to_int,
+        &&opr_int_to_string, &&opr_real_to_string, &&opr_and, &&opr_or, &&opr_is
+    };
+    static const void *const fused_handlers[] = {    // Indexed by fused_code
+        nullptr, &&fused_test_eq, &&fused_test_ne, &&fused_test_lt, &&fused_test_ge,
+        &&fused_test_gt, &&fused_test_le, &&fused_increment, &&fused_decrement,
+        &&fused_duplicate_store
+    };
+    constexpr int opr_count = sizeof(opr_handlers) / sizeof(opr_handlers[0]);
+
+    // Handler of the instruction at address i when it is executed on its own.
+#define PLAIN_HANDLER(i)                                                      \
+    ((code_store[i].f != fun_OPR) ? fun_handlers[code_store[i].f]             \
+            : ((code_store[i].a >= 0) and (code_store[i].a < opr_count))      \
+                    ? opr_handlers[code_store[i].a] : &&opr_undefined)
+
+    if (!code_threaded) {
+        // Address 0 halts the machine, so "JMP 0 0" needs no special test. The code is translated up
+        // to the MST 0 0 that follows the last instruction; the address after that leads to
+        // outside_code. A jump or call whose address is in the code is given a handler that does
+        // not check it again.
+        threaded_code.assign(last_instruction + 3, threaded_instruction());
+        threaded_code[0].handler = &&halt;
+        threaded_code[last_instruction + 2].handler = &&beyond_code;
+        for (int i = 1; i <= last_instruction + 1; i++) {
+            threaded_code[i].l = code_store[i].l;
+            threaded_code[i].a = code_store[i].a;
+            if (code_store[i].fused != fused_none)
+                threaded_code[i].handler = fused_handlers[code_store[i].fused];
+            else if ((code_store[i].f == fun_CAL) and (code_store[i].a >= 1) and (code_store[i].a <= last_instruction))
+                threaded_code[i].handler = &&do_CAL_in_code;
+            else if ((code_store[i].f == fun_JIF) and (code_store[i].a >= 0) and (code_store[i].a <= last_instruction))
+                threaded_code[i].handler = &&do_JIF_in_code;
+            else if ((code_store[i].f == fun_JMP) and (code_store[i].a >= 0) and (code_store[i].a <= last_instruction))
+                threaded_code[i].handler = &&do_JMP_in_code;
+            else
+                threaded_code[i].handler = PLAIN_HANDLER(i);
         }
+        code_threaded = true;
     }
-    return key;
-}
 
+    // The instruction pointer is the threaded equivalent of program_counter. As in execute_code(),
+    // it is advanced before the instruction executes, so the operands of the current instruction are
+    // those of ip[-1]. program_counter and instruction_register are only brought up to date when
+    // code outside this function may look at them (error reporting and the listing).
+    threaded_instruction *ip;
+    long long executed { 0 };
+    Memory_cell temp;
 
-string insttostr(instruction i)
-// Convert an instruction to a string
+#define SYNC_PC()   (program_counter = int(ip - threaded_code.data()), \
+                     instruction_register = &code_store[program_counter - 1])
+#define JUMP_TO(a)  (ip = &threaded_code[(a)])
+// Is address a outside the translated code? CAL and the returns use this and continue at
+// outside_code; JMP and JIF check their targets as the switch engine does and then go there too, so
+// that ip is never built from an unchecked address.
+#define OUTSIDE(a)  (unsigned(a) > unsigned(last_instruction + 1))
+#define OPERAND_L   (ip[-1].l)
+#define OPERAND_A   (ip[-1].a)
+// The generic handlers of OPR 3-15 use QUICKEN to rewrite their own slot to the handler specialised
+// for the operand types found the first time they execute, and then continue there.
+#define QUICKEN(int_handler, real_handler)                                    \
+    if (quickening_instructions) {                                            \
+        if (data_store[top_of_stack - 1].is_int()                             \
+                and data_store[top_of_stack].is_int()) {                      \
+            ip[-1].handler = &&int_handler;                                   \
+            goto int_handler;                                                 \
+        }                                                                     \
+        if (data_store[top_of_stack - 1].is_real()                            \
+                and data_store[top_of_stack].is_real()) {                     \
+            ip[-1].handler = &&real_handler;                                  \
+            goto real_handler;                                                \
+        }                                                                     \
+    }
+// Every handler ends with DISPATCH, which counts the instruction just completed and jumps to the
+// handler of the next one. A superinstruction adds the rest of its instructions to the count itself.
+#define DISPATCH()                                                            \
+    do {                                                                      \
+        executed++;                                                           \
+        if (debugging_pal_code)                                               \
+            goto trace;                                                       \
+        goto *(ip++)->handler;                                                \
+    } while (0)
+
+    reset_machine();
+    JUMP_TO(program_counter);
+    if (debugging_pal_code)
+        goto trace_next;
+    goto *(ip++)->handler;
+
+trace:
+    // Listing requested: dump the stack after the instruction just executed and show the next one.
+    // instruction_register still refers to the instruction just executed: it was set either here or
+    // by the handler that turned the listing on. Superinstructions are not used while listing, so
+    // that every instruction is shown.
+    program_counter = int(ip - threaded_code.data());
+    trace_stack(program_counter, base_register, top_of_stack);
+    if (program_counter == 0)
+        goto halt;
+trace_next:
+    program_counter = int(ip - threaded_code.data());
+    if (OUTSIDE(program_counter))
+        goto run_outside;
+    trace_instruction(program_counter);
+    instruction_register = &code_store[program_counter];
+    ip++;
+    goto *PLAIN_HANDLER(program_counter);
+
+do_MST:    // Mark the stack
+    SYNC_PC();
+    data_store[top_of_stack + 1].set_int(base(OPERAND_L));
+    data_store[top_of_stack + 2].set_int(base_register);
+    data_store[top_of_stack + 3].set_int(0);
+    data_store[top_of_stack + 4].set_int(0);
+    top_of_stack = top_of_stack + 4;
+    DISPATCH();
+do_CAL:    // Procedure or function call
+    SYNC_PC();
+    if (tail_call(program_counter - 1)) {
+        if (OUTSIDE(OPERAND_A))
+            goto outside_code;
+        JUMP_TO(OPERAND_A);
+        DISPATCH();
+    }
+    base_register = top_of_stack - OPERAND_L + 1;
+    data_store[base_register - 2].set_int(program_counter);
+    display_call();
+    if (OUTSIDE(OPERAND_A)) {
+        program_counter = OPERAND_A;
+        goto outside_code;
+    }
+    JUMP_TO(OPERAND_A);
+    DISPATCH();
+do_CAL_in_code:    // CAL of an address in the code
+    SYNC_PC();
+    if (!tail_call(program_counter - 1)) {
+        base_register = top_of_stack - OPERAND_L + 1;
+        data_store[base_register - 2].set_int(program_counter);
+        display_call();
+    }
+    JUMP_TO(OPERAND_A);
+    DISPATCH();
+do_INC:    // Increment top-of-stack pointer
+    if (OPERAND_A > 0)
+        for (int i = top_of_stack + 1;
+                i <= top_of_stack + OPERAND_A; i++)
+            data_store[i].set_undef();
+    top_of_stack += OPERAND_A;
+    DISPATCH();
+do_JIF:    // Jump if false
+    if (data_store[top_of_stack].is_boolean()) {
+        if (!data_store[top_of_stack].get_boolean()) {
+            if ((OPERAND_A < 0) || (OPERAND_A > last_instruction)) {
+                SYNC_PC();
+                program_counter = OPERAND_A;
+                error("Attempt to jump outside code.");
+                goto outside_code;
+            }
+            JUMP_TO(OPERAND_A);
+        }
+    } else {
+        SYNC_PC();
+        error("JIF - top of stack not a boolean.");
+    }
+    DISPATCH();
+do_JMP:    // Unconditional jump
+    if ((OPERAND_A < 0) || (OPERAND_A > last_instruction)) {
+        SYNC_PC();
+        program_counter = OPERAND_A;
+        error("Attempt to jump outside code.");
+        goto outside_code;
+    }
+    JUMP_TO(OPERAND_A);
+    DISPATCH();
+do_JIF_in_code:    // JIF to an address in the code
+    if (data_store[top_of_stack].is_boolean()) {
+        if (!data_store[top_of_stack].get_boolean())
+            JUMP_TO(OPERAND_A);
+    } else {
+        SYNC_PC();
+        error("JIF - top of stack not a boolean.");
+    }
+    DISPATCH();
+do_JMP_in_code:    // JMP to an address in the code
+    JUMP_TO(OPERAND_A);
+    DISPATCH();
+do_LCI:    // Load integer constant onto stack
+    top_of_stack++;
+    data_store[top_of_stack].set_int(OPERAND_A);
+    DISPATCH();
+do_LCR:    // Load real constant onto stack
+    top_of_stack++;
+    data_store[top_of_stack].set_real(real_constants[OPERAND_A]);
+    DISPATCH();
+do_LCS:    // Load string literal onto stack
+    top_of_stack++;
+    data_store[top_of_stack].set_string(string_constants[OPERAND_A]);
+    DISPATCH();
+do_LDA:    // Load the absolute address of a variable onto the stack
+    SYNC_PC();
+    top_of_stack++;
+    data_store[top_of_stack].set_int(
+            base(OPERAND_L) + OPERAND_A);
+    DISPATCH();
+do_LDI:    // Load the value stored at specifed address onto the stack
+    data_store[top_of_stack] = data_store[data_store[top_of_stack].get_int()];
+    DISPATCH();
+do_LDV:    // Load the value of a variable onto the stack
+    SYNC_PC();
+    top_of_stack++;
+    data_store[top_of_stack] =
+            data_store[base(OPERAND_L) + OPERAND_A];
+    DISPATCH();
+do_LDU:    // Load an undefined or void value
+    top_of_stack++;
+    data_store[top_of_stack].set_undef();
+    DISPATCH();
+do_RDI:    // Read a value into an integer variable
 {
-    return funtostr(i.f) + " " + to_string(i.l) + " " + i.a.to_string();
+    int value = read_int();
+    SYNC_PC();
+    data_store[base(OPERAND_L) + OPERAND_A].set_int(value);
+}
+    DISPATCH();
+do_RDR:    // Read a value into a real variable
+{
+    float value = read_real();
+    SYNC_PC();
+    data_store[base(OPERAND_L) + OPERAND_A].set_real(value);
+}
+    DISPATCH();
+do_STI:    // Load top-of-stack - 1 into a variable at address top-of-stack
+    data_store[data_store[top_of_stack].get_int()] = data_store[top_of_stack - 1];
+    top_of_stack -= 2;
+    DISPATCH();
+do_STO:    // Store into a variable
+    SYNC_PC();
+    data_store[base(OPERAND_L) + OPERAND_A] =
+            data_store[top_of_stack];
+    top_of_stack--;
+    DISPATCH();
+do_SIG:    // Raise signal
+    if (OPERAND_A != 0)
+        pal_exception = OPERAND_A;
+    DISPATCH();
+do_REH:    // Register exeception handler
+    if (!handlers_tabled or debugging_pal_code)
+        data_store[base_register - 1].set_int(OPERAND_A);
+    DISPATCH();
+do_DBG:    // Turn debugging status on/off
+    SYNC_PC();
+    debugging_pal_code = (OPERAND_A == 1);
+    DISPATCH();
+do_OPR:    // Never reached: OPR instructions are threaded to the handler of their operation
+opr_undefined:
+    DISPATCH();
+
+opr_procedure_return:
+    SYNC_PC();
+    if (debugging_pal_code)
+        trace_stack(program_counter, base_register, top_of_stack);
+    top_of_stack = base_register - 5;
+    program_counter = data_store[top_of_stack + 3].get_int();
+    base_register = data_store[top_of_stack + 2].get_int();
+    display_return(top_of_stack + 5);
+    if (OUTSIDE(program_counter))
+        goto outside_code;
+    JUMP_TO(program_counter);
+    DISPATCH();
+opr_function_return:
+    SYNC_PC();
+    if (debugging_pal_code)
+        trace_stack(program_counter, base_register, top_of_stack);
+    temp = data_store[top_of_stack];
+    top_of_stack = base_register - 5;
+    program_counter = data_store[top_of_stack + 3].get_int();
+    base_register = data_store[top_of_stack + 2].get_int();
+    display_return(top_of_stack + 5);
+    data_store[++top_of_stack] = temp;
+    if (OUTSIDE(program_counter))
+        goto outside_code;
+    JUMP_TO(program_counter);
+    DISPATCH();
+opr_negate:
+    if (data_store[top_of_stack].is_real()) {
+        data_store[top_of_stack].set_real(-data_store[top_of_stack].get_real());
+    } else if (data_store[top_of_stack].is_int()) {
+        data_store[top_of_stack].set_int(-data_store[top_of_stack].get_int());
+    } else {
+        SYNC_PC();
+        error("Cannot negate boolean or string value.");
+    }
+    DISPATCH();
+opr_add:
+    QUICKEN(quick_add_int, quick_add_real);
+    SYNC_PC();
+    threaded_arithmetic(plus<>());
+    DISPATCH();
+opr_subtract:
+    QUICKEN(quick_subtract_int, quick_subtract_real);
+    SYNC_PC();
+    threaded_arithmetic(minus<>());
+    DISPATCH();
+opr_multiply:
+    QUICKEN(quick_multiply_int, quick_multiply_real);
+    SYNC_PC();
+    threaded_arithmetic(multiplies<>());
+    DISPATCH();
+opr_divide:
+    QUICKEN(quick_divide_int, quick_divide_real);
+divide_generic:
+    SYNC_PC();
+    top_of_stack--;
+    if (data_store[top_of_stack].get_type() != data_store[top_of_stack + 1].get_type()) {
+        error("Operands must be of the same type.");
+    } else {
+        switch (data_store[top_of_stack].get_type()) {
+        case Memory_cell::types_INT:
+            if (data_store[top_of_stack + 1].get_int() != 0) {
+                data_store[top_of_stack].set_int(
+                        data_store[top_of_stack].get_int()
+                                / data_store[top_of_stack + 1].get_int());
+            } else {
+                error("Divide by integer 0.");
+            }
+            break;
+        case Memory_cell::types_REAL:
+            if (data_store[top_of_stack + 1].get_real() != 0.0) {
+                data_store[top_of_stack].set_real(
+                        data_store[top_of_stack].get_real()
+                                / data_store[top_of_stack + 1].get_real());
+            } else {
+                error("Divide by floating point 0.0.");
+            }
+            break;
+        default:
+            error("Operands must be integer or real");
+            break;
+        }
+    }
+    DISPATCH();
+opr_exponent:
+    SYNC_PC();
+    top_of_stack--;
+    if (data_store[top_of_stack + 1].get_type() != Memory_cell::types_INT) {
+        error("Exponent must be an integer.");
+    } else {
+        switch (data_store[top_of_stack].get_type()) {
+        case Memory_cell::types_INT: {
+            int result = data_store[top_of_stack].get_int();
+            if (data_store[top_of_stack + 1].get_int() == 0) {
+                result = 1;
+            } else {
+                for (int j = 1; j <= data_store[top_of_stack + 1].get_int() - 1; j++)
+                    result *= data_store[top_of_stack].get_int();
+            }
+            data_store[top_of_stack].set_int(result);
+        }
+            break;
+        case Memory_cell::types_REAL: {
+            float result = data_store[top_of_stack].get_real();
+            if (data_store[top_of_stack + 1].get_int() == 0) {
+                result = 1;
+            } else {
+                for (int j = 1; j <= data_store[top_of_stack + 1].get_int() - 1; j++)
+                    result *= data_store[top_of_stack].get_real();
+            }
+            data_store[top_of_stack].set_real(result);
+        }
+            break;
+        default:
+            error("Operand must be an integer or a floating point");
+            break;
+        }
+    }
+    DISPATCH();
+opr_concatenate:
+    if (quickening_instructions and data_store[top_of_stack - 1].is_string()
+            and data_store[top_of_stack].is_string()) {
+        ip[-1].handler = &&quick_concatenate_string;
+        goto quick_concatenate_string;
+    }
+    SYNC_PC();
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_STRING) {
+        error("String concatenation requires String on top of stack.");
+    } else if (data_store[top_of_stack - 1].get_type() != Memory_cell::types_STRING) {
+        error("String concatenation requires String on top of stack - 1.");
+    } else {
+        data_store[top_of_stack - 1].concatenate(data_store[top_of_stack]);
+    }
+    top_of_stack--;
+    DISPATCH();
+opr_odd:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_INT) {
+        SYNC_PC();
+        error("Odd instruction expects integer value.");
+    } else {
+        data_store[top_of_stack].set_boolean(data_store[top_of_stack].get_int() % 2 == 1);
+    }
+    DISPATCH();
+opr_eq:
+    QUICKEN(quick_eq_int, quick_eq_real);
+    SYNC_PC();
+    threaded_comparison(equal_to<>());
+    DISPATCH();
+opr_ne:
+    QUICKEN(quick_ne_int, quick_ne_real);
+    SYNC_PC();
+    threaded_comparison(not_equal_to<>());
+    DISPATCH();
+opr_lt:
+    QUICKEN(quick_lt_int, quick_lt_real);
+    SYNC_PC();
+    threaded_comparison(less<>());
+    DISPATCH();
+opr_ge:
+    QUICKEN(quick_ge_int, quick_ge_real);
+    SYNC_PC();
+    threaded_comparison(greater_equal<>());
+    DISPATCH();
+opr_gt:
+    QUICKEN(quick_gt_int, quick_gt_real);
+    SYNC_PC();
+    threaded_comparison(greater<>());
+    DISPATCH();
+opr_le:
+    QUICKEN(quick_le_int, quick_le_real);
+    SYNC_PC();
+    threaded_comparison(less_equal<>());
+    DISPATCH();
+opr_not:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_BOOLEAN) {
+        SYNC_PC();
+        error("not operation expects boolean value on top of stack.");
+    } else {
+        data_store[top_of_stack].set_boolean(!data_store[top_of_stack].get_boolean());
+    }
+    DISPATCH();
+opr_true:
+    top_of_stack++;
+    data_store[top_of_stack].set_boolean(true);
+    DISPATCH();
+opr_false:
+    top_of_stack++;
+    data_store[top_of_stack].set_boolean(false);
+    DISPATCH();
+opr_eof:
+    top_of_stack++;
+    data_store[top_of_stack].set_boolean(input_ended());
+    DISPATCH();
+opr_write:
+    if (!write_value(data_store[top_of_stack])) {
+        SYNC_PC();
+        error("Can only write integer, floating point, and string values.");
+    }
+    top_of_stack--;
+    DISPATCH();
+opr_newline:
+    write_newline();
+    DISPATCH();
+opr_swap:
+    temp = data_store[top_of_stack];
+    data_store[top_of_stack] = data_store[top_of_stack - 1];
+    data_store[top_of_stack - 1] = temp;
+    DISPATCH();
+opr_duplicate:
+    top_of_stack++;
+    data_store[top_of_stack] = data_store[top_of_stack - 1];
+    DISPATCH();
+opr_drop:
+    top_of_stack--;
+    DISPATCH();
+opr_int_to_real:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_INT) {
+        SYNC_PC();
+        error("int-to-real conversion expects integer on top of stack.");
+    } else {
+        data_store[top_of_stack].set_real(float(data_store[top_of_stack].get_int()));
+    }
+    DISPATCH();
+opr_real_to_int:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_REAL) {
+        SYNC_PC();
+        error("real-to_int conversion expects real number on top of stack.");
+    } else {
+        data_store[top_of_stack].set_int(int(data_store[top_of_stack].get_real()));
+    }
+    DISPATCH();
+opr_int_to_string:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_INT) {
+        SYNC_PC();
+        error("int-to-string conversion expects integer on top of stack.");
+    } else {
+        data_store[top_of_stack].set_string(to_string(data_store[top_of_stack].get_int()));
+    }
+    DISPATCH();
+opr_real_to_string:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_REAL) {
+        SYNC_PC();
+        error("real-to-string conversion expects integer on top of stack.");
+    } else {
+        data_store[top_of_stack].set_string(to_string(data_store[top_of_stack].get_real()));
+    }
+    DISPATCH();
+opr_and:
+    if ((data_store[top_of_stack].get_type() != Memory_cell::types_BOOLEAN)
+            && data_store[top_of_stack - 1].get_type() != Memory_cell::types_BOOLEAN) {
+        SYNC_PC();
+        error("Logical and expects boolean values at top of stack, and top of stack-1");
+    } else {
+        data_store[top_of_stack - 1].set_boolean(
+                data_store[top_of_stack - 1].get_boolean()
+                        && data_store[top_of_stack].get_boolean());
+        top_of_stack--;
+    }
+    DISPATCH();
+opr_or:
+    if ((data_store[top_of_stack].get_type() != Memory_cell::types_BOOLEAN)
+            && data_store[top_of_stack - 1].get_type() != Memory_cell::types_BOOLEAN) {
+        SYNC_PC();
+        error("Logical or expects boolean values at top of stack, and top of stack-1");
+    } else {
+        data_store[top_of_stack - 1].set_boolean(
+                data_store[top_of_stack - 1].get_boolean()
+                        || data_store[top_of_stack].get_boolean());
+        top_of_stack--;
+    }
+    DISPATCH();
+opr_is:
+    if (data_store[top_of_stack].get_type() != Memory_cell::types_INT) {
+        SYNC_PC();
+        error("is operations expects an integer value on top of stack");
+    } else {
+        data_store[top_of_stack].set_boolean(data_store[top_of_stack].get_int() == pal_exception);
+    }
+    DISPATCH();
+
+    // Quickened operations, installed by QUICKEN. Each guards the operand types it was specialised
+    // for and otherwise falls back to the generic handler, which reports errors and may quicken the
+    // slot again for the new types. The results are exactly those of the generic handlers.
+#define QUICK_BINARY(type, get, set, op, generic)                             \
+    if (!(data_store[top_of_stack - 1].is_##type()                            \
+            and data_store[top_of_stack].is_##type()))                        \
+        goto generic;                                                         \
+    top_of_stack--;                                                           \
+    data_store[top_of_stack].set(data_store[top_of_stack].get()               \
+            op data_store[top_of_stack + 1].get());                           \
+    DISPATCH();
+
+quick_add_int:
+    QUICK_BINARY(int, get_int, set_int, +, opr_add);
+quick_add_real:
+    QUICK_BINARY(real, get_real, set_real, +, opr_add);
+quick_subtract_int:
+    QUICK_BINARY(int, get_int, set_int, -, opr_subtract);
+quick_subtract_real:
+    QUICK_BINARY(real, get_real, set_real, -, opr_subtract);
+quick_multiply_int:
+    QUICK_BINARY(int, get_int, set_int, *, opr_multiply);
+quick_multiply_real:
+    QUICK_BINARY(real, get_real, set_real, *, opr_multiply);
+quick_divide_int:
+    if (data_store[top_of_stack].is_int() and (data_store[top_of_stack].get_int() == 0))
+        goto divide_generic;    // reports the division by zero
+    QUICK_BINARY(int, get_int, set_int, /, opr_divide);
+quick_divide_real:
+    if (data_store[top_of_stack].is_real() and (data_store[top_of_stack].get_real() == 0.0))
+        goto divide_generic;    // reports the division by zero
+    QUICK_BINARY(real, get_real, set_real, /, opr_divide);
+quick_eq_int:
+    QUICK_BINARY(int, get_int, set_boolean, ==, opr_eq);
+quick_eq_real:
+    QUICK_BINARY(real, get_real, set_boolean, ==, opr_eq);
+quick_ne_int:
+    QUICK_BINARY(int, get_int, set_boolean, !=, opr_ne);
+quick_ne_real:
+    QUICK_BINARY(real, get_real, set_boolean, !=, opr_ne);
+quick_lt_int:
+    QUICK_BINARY(int, get_int, set_boolean, <, opr_lt);
+quick_lt_real:
+    QUICK_BINARY(real, get_real, set_boolean, <, opr_lt);
+quick_ge_int:
+    QUICK_BINARY(int, get_int, set_boolean, >=, opr_ge);
+quick_ge_real:
+    QUICK_BINARY(real, get_real, set_boolean, >=, opr_ge);
+quick_gt_int:
+    QUICK_BINARY(int, get_int, set_boolean, >, opr_gt);
+quick_gt_real:
+    QUICK_BINARY(real, get_real, set_boolean, >, opr_gt);
+quick_le_int:
+    QUICK_BINARY(int, get_int, set_boolean, <=, opr_le);
+quick_le_real:
+    QUICK_BINARY(real, get_real, set_boolean, <=, opr_le);
+quick_concatenate_string:
+    if (!(data_store[top_of_stack - 1].is_string() and data_store[top_of_stack].is_string()))
+        goto opr_concatenate;
+    top_of_stack--;
+    data_store[top_of_stack].concatenate(data_store[top_of_stack + 1]);
+    DISPATCH();
+#undef QUICK_BINARY
+
+    // Superinstructions. Each checks that its fast path applies before changing anything; if not, it
+    // carries on with the handler of its first instruction and the sequence is executed one
+    // instruction at a time, which also reports any error exactly as before.
+{
+    int condition;
+#define FUSED_TEST(op)                                                        \
+    condition = fused_test(ip, op);                                           \
+    if (condition < 0)                                                        \
+        goto do_LDV;                                                          \
+    top_of_stack++;                                                           \
+    data_store[top_of_stack].set_boolean(condition);                          \
+    executed += 3;                                                            \
+    if (condition)                                                            \
+        ip += 3;                                                              \
+    else                                                                      \
+        JUMP_TO(ip[2].a);                                                     \
+    DISPATCH();
+
+fused_test_eq:    // LDV; LDV; OPR 10; JIF
+    FUSED_TEST(equal_to<>());
+fused_test_ne:    // LDV; LDV; OPR 11; JIF
+    FUSED_TEST(not_equal_to<>());
+fused_test_lt:    // LDV; LDV; OPR 12; JIF
+    FUSED_TEST(less<>());
+fused_test_ge:    // LDV; LDV; OPR 13; JIF
+    FUSED_TEST(greater_equal<>());
+fused_test_gt:    // LDV; LDV; OPR 14; JIF
+    FUSED_TEST(greater<>());
+fused_test_le:    // LDV; LDV; OPR 15; JIF
+    FUSED_TEST(less_equal<>());
+#undef FUSED_TEST
 }
 
-void trace_stack(int p, int b, int t)
-// Trace the stack and create a stack dump
+fused_increment:    // LDV x; LCI c; OPR 3; STO y
+fused_decrement:    // LDV x; LCI c; OPR 4; STO y
 {
-    cout << endl << "*** Run-time stack:" << endl;
-    cout << "     Base of activation record: " << b << "." << endl;
-    cout << "     Current top of stack: " << t << "." << endl;
-    cout << "     Instruction register contains: '"
-            << insttostr(*instruction_register) << "'." << endl;
-    cout << endl;
-    cout << "Contents of stack:" << endl;
-    cout << "------------------" << endl << endl;
-    for (int i = 1; i <= t; i++) {
-        cout << "   " << i << ": '" << data_store[i].to_string() << "'."
-                << endl;
+    int source = frame_base(OPERAND_L);
+    int target = frame_base(ip[2].l);
+    if ((source < 0) or (target < 0) or !data_store[source + OPERAND_A].is_int())
+        goto do_LDV;
+    int value = data_store[source + OPERAND_A].get_int();
+    if (ip[1].a == 3)
+        value += ip[0].a;
+    else
+        value -= ip[0].a;
+    data_store[target + ip[2].a].set_int(value);
+    executed += 3;
+    ip += 3;
+}
+    DISPATCH();
+
+fused_duplicate_store:    // OPR 23; STO x; STO y
+{
+    int first = frame_base(ip[0].l);
+    int second = frame_base(ip[1].l);
+    if ((first < 0) or (second < 0))
+        goto opr_duplicate;
+    data_store[first + ip[0].a] = data_store[top_of_stack];
+    data_store[second + ip[1].a] = data_store[top_of_stack];
+    top_of_stack--;
+    executed += 2;
+    ip += 2;
+}
+    DISPATCH();
+
+beyond_code:
+    // Reached by running on past the MST 0 0 after the last instruction.
+    program_counter = int(ip - threaded_code.data()) - 1;
+    goto run_outside;
+outside_code:
+    // A CAL or return has sent control to program_counter, outside the translated code. Execute
+    // from there one instruction at a time, as the switch engine would, until control comes back.
+    executed++;
+    if (debugging_pal_code)
+        trace_stack(program_counter, base_register, top_of_stack);
+run_outside:
+    while ((program_counter != 0) and OUTSIDE(program_counter)) {
+        step_instruction();
+        executed++;
     }
-    cout << endl << endl;
+    if (program_counter == 0)
+        goto halt;
+    JUMP_TO(program_counter);
+    if (debugging_pal_code)
+        goto trace_next;
+    goto *(ip++)->handler;
+
+halt:
+    // "JMP 0 0", or any other transfer to address 0, terminates the program.
+    program_counter = 0;
+    instructions_executed = executed;
+
+#undef DISPATCH
+#undef QUICKEN
+#undef PLAIN_HANDLER
+#undef OPERAND_A
+#undef OPERAND_L
+#undef OUTSIDE
+#undef JUMP_TO
+#undef SYNC_PC
 }
 
 
-void unwind(int exc, int lp, int lb, int &lt);    // forward declaration
+bool translate_group(int start, const vector<bool> &leader)
+// Try to translate the stack instructions from start up to the next STO (or JIF) into register
+// instructions at the end of register_code. A group is a run of LDV, LCI and OPR 3-6 or 10-15
+// instructions within one basic block that is completed by a STO, or by a JIF testing the result of
+// a comparison. Values the stack code would push are tracked as operands, so a group such as
+// "LDV; LDV; OPR 3; STO" becomes the single instruction "z := x + y". Temporaries are kept in the
+// stack cells the stack code would have used. Returns false, leaving register_code and
+// register_constants unchanged, if the instructions at start do not form a group.
+{
+    vector<register_operand> stack;          // Operands the stack code would have pushed
+    const size_t first = register_code.size();
+    const size_t constant_count = register_constants.size();
+    int i { start };
+
+    for (bool complete = false; !complete; i++) {
+        if ((i > last_instruction) or ((i > start) and leader[i]))
+            break;
+        const instruction &ins = code_store[i];
+        register_instruction r;
+        if (ins.f == fun_LDV) {
+            stack.push_back({ operand_variable, ins.l, ins.a });
+        } else if (ins.f == fun_LCI) {
+            register_constants.emplace_back(int(ins.a));
+            stack.push_back({ operand_constant, 0, int32_t(register_constants.size() - 1) });
+        } else if ((ins.f == fun_OPR) and (stack.size() >= 2)
+                and (((ins.a >= 3) and (ins.a <= 6)) or ((ins.a >= 10) and (ins.a <= 15)))) {
+            r.op = register_binary;
+            r.operation = uint8_t(ins.a);
+            r.src2 = stack.back();
+            stack.pop_back();
+            r.src1 = stack.back();
+            stack.pop_back();
+            r.dst = { operand_temporary, 0, int32_t(stack.size() + 1) };
+            stack.push_back(r.dst);
+            register_code.push_back(r);
+        } else if ((ins.f == fun_STO) and (stack.size() == 1)) {
+            register_operand variable { operand_variable, ins.l, ins.a };
+            if (stack[0].kind == operand_temporary) {
+                // Only the last instruction can have computed the remaining temporary.
+                register_code.back().dst = variable;
+            } else {
+                r.op = register_move;
+                r.dst = variable;
+                r.src1 = stack[0];
+                register_code.push_back(r);
+            }
+            complete = true;
+        } else if ((ins.f == fun_JIF) and (stack.size() == 1) and (stack[0].kind == operand_temporary)
+                and (register_code.back().operation >= 10) and (ins.a >= 0)
+                and (ins.a <= last_instruction)) {
+            register_code.back().op = register_branch;
+            register_code.back().target = ins.a;
+            complete = true;
+        } else {
+            break;
+        }
+        if (complete) {
+            for (size_t k = first; k < register_code.size(); k++) {
+                register_code[k].last = false;
+                register_code[k].start = start;
+                register_code[k].length = i - start + 1;
+            }
+            register_code.back().last = true;
+            return true;
+        }
+    }
+    register_code.resize(first);
+    register_constants.resize(constant_count);
+    return false;
+}
 
 
-void error(string message, int exc = program_abort_exception)
-// Non-fatal error detected. Provide stack dump.
+void translate_to_registers()
+// Translate the code store into register form. The code is split into basic blocks; within a block
+// every group of stack instructions that translate_group() accepts is replaced by its register
+// instructions, and every other instruction is executed as it stands (register_stack).
 {
-    cerr << "*** Run-time error: " << message << endl;
-    cerr << "     At address: " << (program_counter - 1) << "." << endl;
-    trace_stack(base_register, program_counter, top_of_stack);
-    cerr << endl << endl;
-    unwind(exc, program_counter, base_register, top_of_stack);
-    ;
+    vector<bool> leader(last_instruction + 2, false);  // Addresses control can reach other than by falling through
+    leader[1] = true;
+    for (int i = 1; i <= last_instruction; i++) {
+        const instruction &ins = code_store[i];
+        bool transfers = (ins.f == fun_JMP) or (ins.f == fun_JIF) or (ins.f == fun_CAL)
+                or ((ins.f == fun_OPR) and ((ins.a == 0) or (ins.a == 1)));
+        if (((ins.f == fun_JMP) or (ins.f == fun_JIF) or (ins.f == fun_CAL) or (ins.f == fun_REH))
+                and (ins.a > 0) and (ins.a <= last_instruction))
+            leader[ins.a] = true;
+        if (transfers or (ins.f == fun_DBG))
+            leader[i + 1] = true;
+    }
+
+    register_code.clear();
+    register_constants.clear();
+    register_entry.assign(last_instruction + 1, -1);
+    for (int i = 1; i <= last_instruction;) {
+        register_entry[i] = int(register_code.size());
+        if (translate_group(i, leader)) {
+            i += register_code.back().length;
+        } else {
+            register_instruction r;
+            r.start = i;
+            register_code.push_back(r);
+            i++;
+        }
+    }
+    code_registered = true;
 }
 
 
-void fatal_error(string message)
-// Fatal run-time error detected
-        {
-    cerr << "*** FATAL Run-time error: " << message << endl;
-    cerr << "     At address: " << (program_counter - 1) << "." << endl;
-    trace_stack(base_register, program_counter, top_of_stack);
-    cerr << endl;
-    abort();
+inline Memory_cell *register_cell(const register_operand &operand)
+// The cell holding a register operand, or nullptr if a static link on the way to a variable is not
+// an integer.
+{
+    switch (operand.kind) {
+    case operand_variable: {
+        int b = (operand.level == 0) ? base_register : frame_base(operand.level);
+        return (b < 0) ? nullptr : &data_store[b + operand.value];
+    }
+    case operand_constant:
+        return &register_constants[operand.value];
+    default:
+        return &data_store[top_of_stack + operand.value];
+    }
 }
 
 
-int base(int l)
-// Find base l levels down
-        {
-    int lev { l };
-    int b1 = { base_register };
-    while (lev > 0) {
-        if (data_store[b1 - 4].is_int())
-            b1 = data_store[b1 - 4].get_int();
-        else
-            error("Static link is not an integer.");
-        lev--;
+template<typename T>
+inline bool register_arithmetic(int operation, T x, T y, T &result)
+// result := x operation y for OPR 3-6. Returns false on division by zero.
+{
+    switch (operation) {
+    case 3:
+        result = x + y;
+        return true;
+    case 4:
+        result = x - y;
+        return true;
+    case 5:
+        result = x * y;
+        return true;
+    default:
+        if (y == 0)
+            return false;
+        result = x / y;
+        return true;
     }
-    return b1;
 }
 
 
-void unwind(int exc, int lp, int lb, int &lt)
-// Exception exc has occurred. Look for an exception handler and discard stack frames
-// until one is found.
-// lp, lb, lt are the corresponding program counter, base and top of the target handler (if found).
-        {
-    bool exit_loop { false };
+template<typename T>
+inline bool register_comparison(int operation, T x, T y)
+// x operation y for OPR 10-15.
+{
+    switch (operation) {
+    case 10:
+        return x == y;
+    case 11:
+        return x != y;
+    case 12:
+        return x < y;
+    case 13:
+        return x >= y;
+    case 14:
+        return x > y;
+    default:
+        return x <= y;
+    }
+}
 
-    while (!exit_loop) {
-        if (debugging_pal_code) {
-            cout << "Unwinding" << endl;
-            trace_stack(lp, lb, lt);
-            cout << endl;
+
+inline bool execute_register_instruction(const register_instruction &r)
+// Execute a register_move, register_binary or register_branch instruction. Only integer and real
+// operands are handled. Returns false without changing any variable if the instruction needs
+// anything else (including an error), in which case the group has to be executed by the stack code.
+{
+    Memory_cell *dst = register_cell(r.dst);
+    Memory_cell *x = register_cell(r.src1);
+    if ((dst == nullptr) or (x == nullptr))
+        return false;
+    if (r.op == register_move) {
+        *dst = *x;
+        return true;
+    }
+    Memory_cell *y = register_cell(r.src2);
+    if (y == nullptr)
+        return false;
+
+    if (x->is_int() and y->is_int()) {
+        int a = x->get_int();
+        int b = y->get_int();
+        if (r.operation >= 10) {
+            dst->set_boolean(register_comparison(r.operation, a, b));
+        } else {
+            int result;
+            if (!register_arithmetic(r.operation, a, b, result))
+                return false;
+            dst->set_int(result);
         }
-        if (data_store[lb - 1].is_int()) {
-            // Might be a handler
-            if (data_store[lb - 1].get_int() != 0) {
-                // Looking hopeful.
-                if ((data_store[lb - 1].get_int() > 0)
-                        and (data_store[lb - 1].get_int() < last_instruction)) {
-                    // A valid handler has been found!
-                    if (debugging_pal_code)
-                        cout << "Exception handler found." << endl;
-                    lp = data_store[lb - 1].get_int();
-                    exit_loop = true;
-                } else {
-                    // Exception handler address is invalid.
-                    fatal_error("Exception handler address is invalid");
-                }
-            } else {
-                // No handler in this frame +> discard it.
-                if (debugging_pal_code)
-                    cout << "No handler in this frame." << endl;
-                lt = lb - 5;
-                lp = data_store[lt + 3].get_int();
-                lb = data_store[lt + 2].get_int();
-                if (lb == 0)
-                    fatal_error("Exception never handled.");
-            }
-        } else
-            fatal_error("Exception handler address has the wrong type!");
+    } else if (x->is_real() and y->is_real()) {
+        float a = x->get_real();
+        float b = y->get_real();
+        if (r.operation >= 10) {
+            dst->set_boolean(register_comparison(r.operation, a, b));
+        } else {
+            float result;
+            if (!register_arithmetic(r.operation, a, b, result))
+                return false;
+            dst->set_real(result);
+        }
+    } else {
+        return false;
     }
-    top_of_stack = lt;
-    if (debugging_pal_code) {
-        cout << "Unwinding" << endl;
-        trace_stack(lp, lb, lt);
+
+    if (r.op == register_branch) {
+        // JIF leaves the condition on the stack.
+        top_of_stack++;
+        if (!data_store[top_of_stack].get_boolean())
+            program_counter = r.target;
     }
+    return true;
 }
 
 
-void execute_code() {
-    // initialize registers
-    top_of_stack = 4;
-    base_register = 5;
-    program_counter = 1;
-    Memory_cell temp;
-    
-    // set up the main program activation record
-    for (int i = 1; i <= 4; i++) {
-        data_store[i] = Memory_cell(0);
-    }
-
-    do    // ready to start executing the PAL code
-    {
-        if (debugging_pal_code) {
-            // Some useful debugging code...
-            cout << endl << "Instruction at " << program_counter << ": "
-                    << funtostr(code_store[program_counter].f) << " "
-                    << code_store[program_counter].l << " ";
-            switch (code_store[program_counter].a.get_type()) {
-            case Memory_cell::types_UNDEF:
-                cout << "UNDEFINED" << endl;
-                break;
-            case Memory_cell::types_BOOLEAN:
-                cout << code_store[program_counter].a.get_boolean() << endl;
-                break;
-            case Memory_cell::types_INT:
-                cout << code_store[program_counter].a.get_int() << endl;
-                break;
-            case Memory_cell::types_REAL:
-                cout << code_store[program_counter].a.get_real() << endl;
+void execute_registers()
+// Register engine. The code store is translated (once) into register form, in which each group of
+// LDV, LCI, arithmetic, comparison and STO or JIF instructions becomes a few three-address
+// instructions that work directly on the variables in the frame (see translate_group). All other
+// instructions, and any group whose operands turn out not to be integers or reals, are executed by
+// execute_instruction(), so the semantics are those of execute_code(). With -l every instruction is
+// executed by execute_instruction() so that the listing is the same as well.
+{
+    if (!code_registered)
+        translate_to_registers();
+
+    reset_machine();
+    instructions_dispatched = 0;
+    do {
+        int r = (unsigned(program_counter) <= unsigned(last_instruction))
+                ? register_entry[program_counter] : -1;
+        if ((r < 0) or debugging_pal_code) {
+            // Not the start of a group (or a listing is required): one stack instruction.
+            instructions_dispatched++;
+            step_instruction();
+            continue;
+        }
+        for (const register_instruction *ri = &register_code[r];; ri++) {
+            instructions_dispatched++;
+            if (ri->op == register_stack) {
+                step_instruction();
                 break;
-            case Memory_cell::types_STRING:
-                cout << code_store[program_counter].a.get_string() << endl;
+            }
+            if (ri->last)
+                program_counter = ri->start + ri->length;    // may be changed by a branch
+            if (!execute_register_instruction(*ri)) {
+                // Execute the whole group again with the stack code.
+                program_counter = ri->start;
+                for (int i = 0; i < ri->length; i++)
+                    step_instruction();
                 break;
-            default:   // should never arise since all cases are addressed above
+            }
+            if (ri->last) {
+                instructions_executed += ri->length;
                 break;
             }
-            // end of useful debugging code
         }
+    } while (program_counter != 0);
+}
 
-        instruction_register = &code_store[program_counter]; // note the instruction we are about to execute
-        program_counter++;
 
-        // large switch statement (ugly) to go through each instruction....
-        switch (instruction_register->f) {
-        case fun_MST:    // Mark the stack
-            data_store[top_of_stack + 1].set_int(base(instruction_register->l));
-            data_store[top_of_stack + 2].set_int(base_register);
-            data_store[top_of_stack + 3].set_int(0);
-            data_store[top_of_stack + 4].set_int(0);
-            top_of_stack = top_of_stack + 4;
+// Baseline JIT (--jit). Each procedure, the range of addresses from one CAL target (or address 1)
+// up to the next, is compiled into x86-64 code once it has been interpreted for a while. Control flow
+// within the procedure (falling through, JMP and JIF) is compiled into native jumps. LDV, STO, LCI,
+// JIF and integer OPR 3-6 and 10-15 are compiled inline: they check the tags of the cells they use
+// and work on data_store directly, reaching the frames of enclosing procedures through the display.
+// An instruction whose check fails, and every other instruction, is executed by jit_step(), so the
+// semantics are those of execute_code(). Native code returns the address at which to continue to
+// execute_jit() whenever control leaves the procedure, after CAL and returns, and at SIG, REH and
+// DBG, which are always left to the interpreter.
 
+int jit_step(int p)
+// Execute the instruction at address p with the interpreter and return the address of the next one.
+{
+    program_counter = p;
+    execute_instruction();
+    return program_counter;
+}
+
+
+// Tracing tier (--trace-jit). Backward jumps are counted, and when a loop header has been jumped to
+// trace_threshold times the instructions of its next iteration are recorded as the interpreter
+// executes them. If the iteration only loads, stores and computes with integers, it is compiled
+// into a native loop that keeps the variables it uses unboxed in a frame of slots: their tags are
+// checked once when the trace is entered instead of at every load, and values move between slots
+// rather than through the stack. Each JIF becomes a guard that leaves the trace, through a side
+// exit, if the loop goes another way than when it was recorded. At an exit the variables are
+// written back, any values the stack code would have had on the stack are pushed, and the
+// interpreter resumes at the instruction the trace could not execute.
+
+constexpr int trace_threshold { 50 };        // Backward jumps to a loop header before it is recorded
+constexpr int trace_max_length { 500 };      // Longest iteration recorded
+constexpr int trace_max_failures { 50 };     // Entries that exit during the first iteration before a trace is dropped
+
+enum trace_value_kind : uint8_t    // Where a value on the stack of a trace being compiled is
+{
+    value_constant,     // It is the constant value
+    value_slot          // It is held in slot value
+};
+
+struct trace_value                  // A value on the stack of a trace being compiled
+{
+    trace_value_kind kind { value_constant };
+    bool boolean { false };         // A comparison result rather than an integer
+    int value { 0 };                // Constant, or slot holding the value
+};
+
+struct trace_exit                   // Where and how the interpreter resumes when a trace is left
+{
+    int address { 0 };              // Instruction the interpreter executes next
+    int executed { 0 };             // Instructions of the current iteration executed before the exit
+    vector<trace_value> stack;      // Values to push onto the stack first
+    vector<bool> written;           // Variables stored earlier in the iteration
+};
+
+struct loop_trace                   // A compiled loop
+{
+    int length { 0 };                          // Instructions executed per iteration
+    vector<pair<int, int>> variables;          // Level difference and displacement of each variable
+    vector<bool> guarded;                      // Variable is read before it is stored, so must be an integer
+    vector<bool> written;                      // Variable is stored by the loop
+    int slots { 0 };                           // Variable and temporary slots used
+    vector<trace_exit> exits;
+    int (*code)(int64_t *) { nullptr };        // Native loop; returns the number of the exit taken
+    int failures { 0 };                        // Entries that exited before completing an iteration
+};
+
+vector<loop_trace> traces;                 // Compiled loops
+vector<int> trace_at;                      // Trace of the loop at each address, -1 if none, -2 if untraceable
+vector<int> loop_count;                    // Backward jumps to each address
+int trace_header { 0 };                    // Loop header being recorded, 0 if none
+vector<pair<int, bool>> trace_record;      // Address of each instruction recorded and whether it jumped
+vector<int64_t> trace_frame;               // Iteration count followed by the slots of the running trace
+
+
+void trace_push(int value, int boolean)
+// Push a value the stack code leaves on the stack at the end of an iteration, typically the
+// condition tested by a JIF, which JIF does not pop.
+{
+    top_of_stack++;
+    if (boolean)
+        data_store[top_of_stack].set_boolean(value != 0);
+    else
+        data_store[top_of_stack].set_int(value);
+}
+
+
+#if defined(__x86_64__) && defined(__linux__)
+
+class native_code
+// x86-64 machine code for one procedure under construction.
+{
+public:
+    vector<uint8_t> bytes;
+
+    void byte(uint8_t b) { bytes.push_back(b); }
+    void int32(int32_t v) { for (int i = 0; i < 4; i++) byte(uint8_t(v >> (8 * i))); }
+    void int64(uint64_t v) { for (int i = 0; i < 8; i++) byte(uint8_t(v >> (8 * i))); }
+
+    enum : uint8_t { rax = 0, rcx = 1, rdx = 2, rbx = 3, r12 = 12, r13 = 13, r14 = 14 };
+
+    void address(uint8_t reg, const void *p) { byte(0x48); byte(0xb8 + reg); int64(uint64_t(p)); }  // mov reg, p
+    void cell(initializer_list<uint8_t> opcode, bool wide, uint8_t reg, uint8_t index, int32_t displacement)
+    // opcode with reg and the operand [rbx + 8 * index + displacement]. While rbx holds data_store,
+    // that is a byte of data_store[index].
+    {
+        if (wide or (reg >= 8) or (index >= 8))
+            byte(0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2));
+        for (uint8_t b : opcode)
+            byte(b);
+        byte(0x84 | ((reg & 7) << 3));
+        byte(0xc0 | ((index & 7) << 3) | rbx);
+        int32(displacement);
+    }
+    size_t jump_if(uint8_t condition) { byte(0x0f); byte(condition); int32(0); return bytes.size() - 4; }
+    size_t jump() { byte(0xe9); int32(0); return bytes.size() - 4; }
+    void patch(size_t at, size_t target) { int32_t rel = int32_t(target - (at + 4)); memcpy(&bytes[at], &rel, 4); }
+
+    const uint8_t *executable() const
+    // Copy the code into a buffer of its own and make that executable (and no longer writable).
+    {
+        void *buffer = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            fatal_error("Unable to allocate memory for compiled code.");
+        memcpy(buffer, bytes.data(), bytes.size());
+        if (mprotect(buffer, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+            fatal_error("Unable to make compiled code executable.");
+        return static_cast<const uint8_t *>(buffer);
+    }
+};
+
+typedef int (*native_entry)(const void *);    // Run native code from the given address
+
+vector<int> jit_procedure;                   // Entry address of the procedure containing each address
+vector<const uint8_t *> jit_native;          // Native code of each address, if compiled
+vector<const uint8_t *> jit_start;           // Code called to run the procedure starting at each address
+vector<int> jit_warmth;                      // Instructions interpreted in the procedure starting at each address
+constexpr int jit_threshold { 1000 };        // Instructions interpreted in a procedure before it is compiled
+
+
+void jit_compile(int entry)
+// Compile the procedure starting at address entry. While the code runs, rbx holds data_store, r12
+// top_of_stack, r13 base_register and r14 the instructions executed since instructions_executed was
+// last brought up to date. Each call of jit_step() stores them first and reloads them after.
+{
+    int end = entry;
+    while ((end < last_instruction) and (jit_procedure[end + 1] == entry))
+        end++;
+
+    constexpr uint8_t je { 0x84 }, jne { 0x85 }, jl { 0x8c };    // Conditions of jump_if()
+    constexpr int cell_size { int(sizeof(Memory_cell)) };
+    constexpr int type { Memory_cell::type_offset }, value { Memory_cell::value_offset };
+    const int r12 { native_code::r12 }, r13 { native_code::r13 };
+    const int rax { native_code::rax }, rcx { native_code::rcx }, rdx { native_code::rdx };
+
+    native_code code;
+    vector<size_t> offset(end - entry + 2);              // Native offset of each address
+    vector<pair<size_t, int>> fixups;                    // Jumps to addresses in the procedure
+    vector<pair<size_t, int>> slow_jumps;                // Jumps to the slow path of an address
+    vector<size_t> exits;                                // Jumps to the code that returns eax
+
+    auto in_procedure = [&](int a) { return (a >= entry) and (a <= end); };
+    auto save_registers = [&]() {
+        code.address(rcx, &top_of_stack);
+        code.byte(0x44); code.byte(0x89); code.byte(0x21);          // mov [rcx], r12d
+        code.address(rcx, &base_register);
+        code.byte(0x44); code.byte(0x89); code.byte(0x29);          // mov [rcx], r13d
+        code.address(rcx, &instructions_executed);
+        code.byte(0x4c); code.byte(0x01); code.byte(0x31);          // add [rcx], r14
+        code.byte(0x45); code.byte(0x31); code.byte(0xf6);          // xor r14d, r14d
+    };
+    auto load_registers = [&]() {
+        code.address(rcx, &top_of_stack);
+        code.byte(0x4c); code.byte(0x63); code.byte(0x21);          // movsxd r12, [rcx]
+        code.address(rcx, &base_register);
+        code.byte(0x4c); code.byte(0x63); code.byte(0x29);          // movsxd r13, [rcx]
+    };
+    auto step = [&](int p) {    // eax := jit_step(p)
+        save_registers();
+        code.byte(0xbf); code.int32(p);                             // mov edi, p
+        code.address(rax, (const void *) &jit_step);
+        code.byte(0xff); code.byte(0xd0);                           // call rax
+        load_registers();
+    };
+    auto count = [&]() { code.byte(0x49); code.byte(0xff); code.byte(0xc6); };    // inc r14
+    auto leave_at = [&](int a) {
+        code.byte(0xb8); code.int32(a);                             // mov eax, a
+        exits.push_back(code.jump());
+    };
+    auto check_type = [&](int p, int index, int displacement, uint8_t condition, Memory_cell::types t) {
+        code.cell({ 0x80 }, false, 7, index, displacement + type); code.byte(t);    // cmp byte [tag], t
+        slow_jumps.emplace_back(code.jump_if(condition), p);
+    };
+    auto frame = [&](int p, int l) -> int {    // Register holding the base of the frame l levels out
+        if (l <= 0)
+            return r13;
+        code.address(rcx, &display_depth);
+        code.byte(0x8b); code.byte(0x01);                           // mov eax, [rcx]
+        code.byte(0x3d); code.int32(l);                             // cmp eax, l
+        slow_jumps.emplace_back(code.jump_if(jl), p);               // not in the display
+        code.address(rcx, display);
+        code.byte(0x48); code.byte(0x63); code.byte(0x84); code.byte(0x81);
+        code.int32(-4 * l);                                         // movsxd rax, [rcx + 4 * rax - 4 * l]
+        return rax;
+    };
+
+    // The buffer starts with the code that is called: save the registers used, keeping the stack 16
+    // byte aligned for jit_step(), load them and jump to the address given.
+    code.byte(0x53);                                                // push rbx
+    code.byte(0x41); code.byte(0x54);                               // push r12
+    code.byte(0x41); code.byte(0x55);                               // push r13
+    code.byte(0x41); code.byte(0x56);                               // push r14
+    code.byte(0x48); code.byte(0x83); code.byte(0xec); code.byte(0x08);    // sub rsp, 8
+    code.address(rax, &data_store);
+    code.byte(0x48); code.byte(0x8b); code.byte(0x18);              // mov rbx, [rax]
+    load_registers();
+    code.byte(0x45); code.byte(0x31); code.byte(0xf6);              // xor r14d, r14d
+    code.byte(0xff); code.byte(0xe7);                               // jmp rdi
+
+    for (int p = entry; p <= end; p++) {
+        offset[p - entry] = code.bytes.size();
+        const instruction &ins = code_store[p];
+        switch (ins.f) {
+        case fun_LDV: {    // data_store[top + 1] := variable, unless either holds a string
+            int b = frame(p, ins.l);
+            check_type(p, b, cell_size * ins.a, je, Memory_cell::types_STRING);
+            check_type(p, r12, cell_size, je, Memory_cell::types_STRING);
+            code.cell({ 0x8b }, true, rdx, b, cell_size * ins.a);      // mov rdx, [variable]
+            code.cell({ 0x89 }, true, rdx, r12, cell_size);            // mov [top + 1], rdx
+            code.byte(0x49); code.byte(0xff); code.byte(0xc4);         // inc r12
+            count();
             break;
-        case fun_CAL:    // Procedure or function call
-            base_register = top_of_stack - instruction_register->l + 1;
-            data_store[base_register - 2].set_int(program_counter);
-            program_counter = instruction_register->a.get_int();
-            break;
-        case fun_INC:    // Increment top-of-stack pointer
-            if (instruction_register->a.get_int() > 0)
-                for (int i = top_of_stack + 1;
-                        i <= top_of_stack + instruction_register->a.get_int();
-                        i++)
-                    data_store[i].set_undef();
-            top_of_stack += instruction_register->a.get_int();
-            break;
-        case fun_JIF:    // Jump if false
-            if (data_store[top_of_stack].is_boolean()) {
-                if (!data_store[top_of_stack].get_boolean()) {
-                    program_counter = instruction_register->a.get_int();
-                    if ((program_counter < 0)
-                            || (program_counter > last_instruction))
-                        error("Attempt to jump outside code.");
-                }
-                // else nothing to do
-            } else
-                error("JIF - top of stack not a boolean.");
-            break;
-        case fun_JMP:    // Inconditinoal jump
-            program_counter = instruction_register->a.get_int();
-            if ((program_counter < 0) || (program_counter > last_instruction))
-                error("Attempt to jump outside code.");
-            break;
-        case fun_LCI:    // Load integer constant onto stack
-            top_of_stack++;
-            data_store[top_of_stack].set_int(instruction_register->a.get_int());
-            break;
-        case fun_LCR:    // Load real constant onto stack
-            top_of_stack++;
-            data_store[top_of_stack].set_real(
-                    instruction_register->a.get_real());
-            break;
-        case fun_LCS:    // Load string literal onto stack
-            top_of_stack++;
-            data_store[top_of_stack].set_string(
-                    instruction_register->a.get_string());
-            break;
-        case fun_LDA:  // Load the absolute address of a variable onto the stack
-            top_of_stack++;
-            data_store[top_of_stack].set_int(
-                    base(instruction_register->l)
-                            + instruction_register->a.get_int());
-            break;
-        case fun_LDI: // Load the value stored at specifed address onto the stack
-            data_store[top_of_stack] =
-                    data_store[data_store[top_of_stack].get_int()];
-            break;
-        case fun_LDV:    // Load the value of a variable onto the stack
-            top_of_stack++;
-            data_store[top_of_stack] = data_store[base(instruction_register->l)
-                    + instruction_register->a.get_int()];
-            break;
-        case fun_LDU:    // Load an undefined or void value
-            top_of_stack++;
-            data_store[top_of_stack].set_undef();
-            break;
-        case fun_RDI:    // Read a value into an integer variable
-        {
-            int temp;
-            cin >> temp;
-            data_store[base(instruction_register->l)
-                    + instruction_register->a.get_int()].set_int(temp);
         }
+        case fun_STO: {    // variable := data_store[top], unless either holds a string
+            int b = frame(p, ins.l);
+            check_type(p, b, cell_size * ins.a, je, Memory_cell::types_STRING);
+            check_type(p, r12, 0, je, Memory_cell::types_STRING);
+            code.cell({ 0x8b }, true, rdx, r12, 0);                    // mov rdx, [top]
+            code.cell({ 0x89 }, true, rdx, b, cell_size * ins.a);      // mov [variable], rdx
+            code.byte(0x49); code.byte(0xff); code.byte(0xcc);         // dec r12
+            count();
             break;
-        case fun_RDR:    // Read a value into a real variable
-        {
-            float temp;
-            cin >> temp;
-            data_store[base(instruction_register->l)
-                    + instruction_register->a.get_int()].set_real(temp);
         }
+        case fun_LCI:    // data_store[top + 1] := a, unless it holds a string
+            check_type(p, r12, cell_size, je, Memory_cell::types_STRING);
+            code.byte(0x48); code.byte(0xba);                          // mov rdx, cell holding a
+            code.int64(uint64_t(Memory_cell::types_INT) << (8 * type) | uint64_t(uint32_t(ins.a)) << (8 * value));
+            code.cell({ 0x89 }, true, rdx, r12, cell_size);            // mov [top + 1], rdx
+            code.byte(0x49); code.byte(0xff); code.byte(0xc4);         // inc r12
+            count();
             break;
-        case fun_STI: // Load top-of-stack - 1 into a variable at address top-of-stack
-            data_store[data_store[top_of_stack].get_int()] =
-                    data_store[top_of_stack - 1];
-            top_of_stack -= 2;
-            break;
-        case fun_STO:    // Store into a variable
-            data_store[base(instruction_register->l)
-                    + instruction_register->a.get_int()] =
-                    data_store[top_of_stack];
-            top_of_stack--;
-            break;
-        case fun_SIG:    // Raise signal
-            if (instruction_register->a.get_int() != 0)
-                pal_exception = instruction_register->a.get_int();
-            break;
-        case fun_REH:    // Register exeception handler
-            data_store[base_register - 1].set_int(
-                    instruction_register->a.get_int());
-            break;
-        case fun_DBG:    // Turn debugging status on/off
-            debugging_pal_code = (instruction_register->a.get_int() == 1);
+        case fun_JMP:
+            if ((ins.a >= 0) and (ins.a <= last_instruction)) {
+                count();
+                if (in_procedure(ins.a))
+                    fixups.emplace_back(code.jump(), ins.a);
+                else
+                    leave_at(ins.a);
+            } else {
+                step(p);
+                exits.push_back(code.jump());
+            }
             break;
-        case fun_OPR:    // Execute operation - there are 32 of them
-            // There are 32 operations that need to be handled
-            switch (instruction_register->a.get_int()) {
-            case 0:    // procedure return
-                if (debugging_pal_code)
-                    trace_stack(program_counter, base_register, top_of_stack);
-                top_of_stack = base_register - 5;
-                program_counter = data_store[top_of_stack + 3].get_int();
-                base_register = data_store[top_of_stack + 2].get_int();
-                break;
-            case 1:     // function return
-                if (debugging_pal_code)
-                    trace_stack(program_counter, base_register, top_of_stack);
-                temp = data_store[top_of_stack];
-                top_of_stack = base_register - 5;
-                program_counter = data_store[top_of_stack + 3].get_int();
-                base_register = data_store[top_of_stack + 2].get_int();
-                data_store[++top_of_stack] = temp;
-                break;
-            case 2:    // negate
-                if (data_store[top_of_stack].is_real()) {
-                    data_store[top_of_stack].set_real(
-                            -data_store[top_of_stack].get_real());
-                } else if (data_store[top_of_stack].is_int()) {
-                    data_store[top_of_stack].set_int(
-                            -data_store[top_of_stack].get_int());
-                } else {
-                    error("Cannot negate boolean or string value.");
-                }
-                break;
-            case 3:    // addition
-            case 4:    // subtraction
-            case 5:    // multiplication
-            case 6:    // division
-                // deal with all the mathematical operators at once.
-                top_of_stack--;
-                if (data_store[top_of_stack].get_type()
-                        != data_store[top_of_stack + 1].get_type()) {
-                    error("Operands must be of the same type.");
-                } else {
-                    switch (data_store[top_of_stack].get_type()) {
-                    case Memory_cell::types_INT:
-                        switch (instruction_register->a.get_int()) {
-                        case 3:        // addition
-                            data_store[top_of_stack].set_int(
-                                    data_store[top_of_stack].get_int()
-                                            + data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 4:        // subtraction
-                            data_store[top_of_stack].set_int(
-                                    data_store[top_of_stack].get_int()
-                                            - data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 5:        // multiplication
-                            data_store[top_of_stack].set_int(
-                                    data_store[top_of_stack].get_int()
-                                            * data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 6:        // division
-                            if (data_store[top_of_stack + 1].get_int() != 0) {
-                                data_store[top_of_stack].set_int(
-                                        data_store[top_of_stack].get_int()
-                                                / data_store[top_of_stack + 1].get_int());
-                            } else {
-                                error("Divide by integer 0.");
-                            }
-                            break;
-                        default:    // should never be selected
-                            break;
-                        } // end switch
-                        break;
-                    case Memory_cell::types_REAL:
-                        switch (instruction_register->a.get_int()) {
-                        case 3:        // addition
-                            data_store[top_of_stack].set_real(
-                                    data_store[top_of_stack].get_real()
-                                            + data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 4:        // subtraction
-                            data_store[top_of_stack].set_real(
-                                    data_store[top_of_stack].get_real()
-                                            - data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 5:        // multiplication
-                            data_store[top_of_stack].set_real(
-                                    data_store[top_of_stack].get_real()
-                                            * data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 6:        // division
-                            if (data_store[top_of_stack + 1].get_real()
-                                    != 0.0) {
-                                data_store[top_of_stack].set_real(
-                                        data_store[top_of_stack].get_real()
-                                                / data_store[top_of_stack + 1].get_real());
-                            } else {
-                                error("Divide by floating point 0.0.");
-                            }
-                            break;
-                        default:    // should never be selected
-                            break;
-                        } // end switch
-                        break;
-                    default:
-                        error("Operands must be integer or real");
-                        break;
-                    } // end switch
-                } // end if
-                break;
-            case 7:    // exponentiation
-                top_of_stack--;
-                if (data_store[top_of_stack + 1].get_type()
-                        != Memory_cell::types_INT) {
-                    error("Exponent must be an integer.");
-                } else {
-                    switch (data_store[top_of_stack].get_type()) {
-                    case Memory_cell::types_INT: {
-                        int temp;
-
-                        temp = data_store[top_of_stack].get_int();
-                        if (data_store[top_of_stack + 1].get_int() == 0) {
-                            temp = 1;
-                        } else {
-                            for (int j = 1;
-                                    j
-                                            <= data_store[top_of_stack + 1].get_int()
-                                                    - 1; j++) {
-                                temp *= data_store[top_of_stack].get_int();
-                            }
-                        }
-                        data_store[top_of_stack].set_int(temp);
-                    }
-                        break;
-                    case Memory_cell::types_REAL: {
-                        float temp;
-
-                        temp = data_store[top_of_stack].get_real();
-                        if (data_store[top_of_stack + 1].get_int() == 0) {
-                            temp = 1;
-                        } else {
-                            for (int j = 1;
-                                    j
-                                            <= data_store[top_of_stack + 1].get_int()
-                                                    - 1; j++) {
-                                temp *= data_store[top_of_stack].get_real();
-                            }
-                        }
-                        data_store[top_of_stack].set_real(temp);
-                    }
-                        break;
-                    default:
-                        error("Operand must be an integer or a floating point");
-                        break;
-                    } // end switch
-                } // end if
-                break;
-            case 8:    // string concatenation
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_STRING) {
-                    error(
-                            "String concatenation requires String on top of stack.");
-                } else if (data_store[top_of_stack - 1].get_type()
-                        != Memory_cell::types_STRING) {
-                    error(
-                            "String concatenation requires String on top of stack - 1.");
-                } else {
-                    data_store[top_of_stack - 1].set_string(
-                            data_store[top_of_stack - 1].get_string()
-                                    + data_store[top_of_stack].get_string());
-                }
-                top_of_stack--;
-                break;
-            case 9:    // odd
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_INT) {
-                    error("Odd instruction expects integer value.");
-                } else {
-                    data_store[top_of_stack].set_boolean(
-                            data_store[top_of_stack].get_int() % 2 == 1);
-                }
-                break;
-            case 10:    // =
-            case 11:    // !=
-            case 12:    // <
-            case 13:    // >=
-            case 14:    // >
-            case 15:    // <=        Handle comparators together
-                top_of_stack--;
-                if (data_store[top_of_stack].get_type()
-                        != data_store[top_of_stack + 1].get_type()) {
-                    error("operands must be of the same type.");
-                } else {
-                    switch (data_store[top_of_stack].get_type()) {
-                    case Memory_cell::types_BOOLEAN:
-                        switch (instruction_register->a.get_int()) {
-                        case 10:      // =
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            == data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        case 11:    // !=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            != data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        case 12:    // <
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            < data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        case 13:    // >=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            >= data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        case 14:    // >
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            > data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        case 15:    // <=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_boolean()
-                                            <= data_store[top_of_stack + 1].get_boolean());
-                            break;
-                        default:    // Should never be invoked
-                            break;
-                        }
-                        break;
-                    case Memory_cell::types_INT:
-                        switch (instruction_register->a.get_int()) {
-                        case 10:      // =
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            == data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 11:    // !=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            != data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 12:    // <
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            < data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 13:    // >=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            >= data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 14:    // >
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            > data_store[top_of_stack + 1].get_int());
-                            break;
-                        case 15:    // <=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_int()
-                                            <= data_store[top_of_stack + 1].get_int());
-                            break;
-                        default:    // Should never be invoked
-                            break;
-                        }
-                        break;
-                    case Memory_cell::types_REAL:
-                        switch (instruction_register->a.get_int()) {
-                        case 10:      // =
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            == data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 11:    // !=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            != data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 12:    // <
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            < data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 13:    // >=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            >= data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 14:    // >
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            > data_store[top_of_stack + 1].get_real());
-                            break;
-                        case 15:    // <=
-                            data_store[top_of_stack].set_boolean(
-                                    data_store[top_of_stack].get_real()
-                                            <= data_store[top_of_stack + 1].get_real());
-                            break;
-                        default:    // Should never be invoked
-                            break;
-                        }
-                        break;
-                    default:
-                        error(
-                                "Operands must in integer, floating point, or boolean.");
-                        break;
-                    }
-                }
-                break;
-            case 16:     // logical complement (not)
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_BOOLEAN) {
-                    error(
-                            "not operation expects boolean value on top of stack.");
+        case fun_JIF:    // Does not pop the condition
+            check_type(p, r12, 0, jne, Memory_cell::types_BOOLEAN);
+            if ((ins.a >= 0) and (ins.a <= last_instruction)) {
+                count();
+                code.cell({ 0x80 }, false, 7, r12, value); code.byte(0);    // cmp byte [top + value], 0
+                if (in_procedure(ins.a)) {
+                    fixups.emplace_back(code.jump_if(je), ins.a);
                 } else {
-                    data_store[top_of_stack].set_boolean(
-                            !data_store[top_of_stack].get_boolean());
+                    size_t over = code.jump_if(jne);
+                    leave_at(ins.a);
+                    code.patch(over, code.bytes.size());
                 }
-                break;
-            case 17:    // true
-                top_of_stack++;
-                data_store[top_of_stack].set_boolean(true);
-                break;
-            case 18:    // false
-                top_of_stack++;
-                data_store[top_of_stack].set_boolean(false);
-                break;
-            case 19:    // eof
-                top_of_stack++;
-                data_store[top_of_stack].set_boolean(cin.eof());
-                break;
-            case 20: // write the integer ! float ! string of top of stack to output
-                switch (data_store[top_of_stack].get_type()) {
-                case Memory_cell::types_REAL:
-                    cout << data_store[top_of_stack].get_real();
+            } else {
+                code.cell({ 0x80 }, false, 7, r12, value); code.byte(0);    // cmp byte [top + value], 0
+                slow_jumps.emplace_back(code.jump_if(je), p);               // jump outside the code
+                count();
+            }
+            break;
+        case fun_SIG:
+        case fun_REH:
+        case fun_DBG:
+            leave_at(p);    // executed by the interpreter
+            break;
+        case fun_OPR:
+            if (((ins.a >= 3) and (ins.a <= 6)) or ((ins.a >= 10) and (ins.a <= 15))) {
+                // x := x operation y on the two integers on top of the stack
+                check_type(p, r12, -cell_size, jne, Memory_cell::types_INT);
+                check_type(p, r12, 0, jne, Memory_cell::types_INT);
+                code.cell({ 0x8b }, false, rax, r12, value - cell_size);   // mov eax, [x]
+                switch (ins.a) {
+                case 3:
+                    code.cell({ 0x03 }, false, rax, r12, value);           // add eax, [y]
+                    break;
+                case 4:
+                    code.cell({ 0x2b }, false, rax, r12, value);           // sub eax, [y]
                     break;
-                case Memory_cell::types_INT:
-                    cout << data_store[top_of_stack].get_int();
+                case 5:
+                    code.cell({ 0x0f, 0xaf }, false, rax, r12, value);     // imul eax, [y]
                     break;
-                case Memory_cell::types_STRING:
-                    cout << data_store[top_of_stack].get_string();
+                case 6:    // Division by zero, and the overflow of INT_MIN / -1, are left to jit_step()
+                    code.cell({ 0x8b }, false, rcx, r12, value);           // mov ecx, [y]
+                    code.byte(0x85); code.byte(0xc9);                      // test ecx, ecx
+                    slow_jumps.emplace_back(code.jump_if(je), p);
+                    code.byte(0x83); code.byte(0xf9); code.byte(0xff);     // cmp ecx, -1
+                    slow_jumps.emplace_back(code.jump_if(je), p);
+                    code.byte(0x99);                                       // cdq
+                    code.byte(0xf7); code.byte(0xf9);                      // idiv ecx
                     break;
-                default:
-                    error("Can only write integer, floating point, and string values.");
+                default: {
+                    static const uint8_t set[] = { 0x94, 0x95, 0x9c, 0x9d, 0x9f, 0x9e };    // sete .. setle
+                    code.cell({ 0x3b }, false, rax, r12, value);           // cmp eax, [y]
+                    code.byte(0x0f); code.byte(set[ins.a - 10]); code.byte(0xc0);    // setcc al
+                    code.byte(0x0f); code.byte(0xb6); code.byte(0xc0);     // movzx eax, al
+                    code.cell({ 0xc6 }, false, 0, r12, type - cell_size);  // mov byte [x tag], boolean
+                    code.byte(Memory_cell::types_BOOLEAN);
                     break;
                 }
-                top_of_stack--;
-                break;
-            case 21:    // terminate the current line of output
-                cout << endl;
+                }
+                code.cell({ 0x89 }, false, rax, r12, value - cell_size);   // mov [x], eax
+                code.byte(0x49); code.byte(0xff); code.byte(0xcc);         // dec r12
+                count();
                 break;
-            case 22:     // swap the top two elements on the stack
-            {
-                Memory_cell temp;
-                temp = data_store[top_of_stack];
-                data_store[top_of_stack] = data_store[top_of_stack - 1];
-                data_store[top_of_stack - 1] = temp;
             }
-                break;
-            case 23:    // duplicate the element on the top of the stack
-                top_of_stack++;
-                data_store[top_of_stack] = data_store[top_of_stack - 1];
-                break;
-            case 24:    // drop the element on th etop of the stack
-                top_of_stack--;
-                break;
-            case 25:    // integer-to-real conversion
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_INT) {
-                    error(
-                            "int-to-real conversion expects integer on top of stack.");
-                } else {
-                    data_store[top_of_stack].set_real(
-                            float(data_store[top_of_stack].get_int()));
+            step(p);
+            if ((ins.a == 0) or (ins.a == 1)) {
+                exits.push_back(code.jump());    // return to the caller
+            } else {
+                code.byte(0x3d); code.int32(p + 1);                        // cmp eax, p + 1
+                exits.push_back(code.jump_if(jne));
+            }
+            break;
+        default:
+            step(p);
+            if (ins.f == fun_CAL) {
+                exits.push_back(code.jump());    // enter the procedure called
+            } else {
+                code.byte(0x3d); code.int32(p + 1);                        // cmp eax, p + 1
+                exits.push_back(code.jump_if(jne));
+            }
+            break;
+        }
+    }
+    // Falling off the end of the procedure
+    offset[end - entry + 1] = code.bytes.size();
+    leave_at(end + 1);
+
+    // The slow path of each instruction compiled inline: have the interpreter execute it, and carry
+    // on wherever that leads.
+    map<int, size_t> slow_path;
+    for (auto &jump : slow_jumps) {
+        int p = jump.second;
+        if (slow_path.count(p) == 0) {
+            slow_path[p] = code.bytes.size();
+            step(p);
+            code.byte(0x3d); code.int32(p + 1);                            // cmp eax, p + 1
+            fixups.emplace_back(code.jump_if(je), p + 1);
+            int a = code_store[p].a;
+            if ((code_store[p].f == fun_JIF) and in_procedure(a)) {
+                code.byte(0x3d); code.int32(a);                            // cmp eax, a
+                fixups.emplace_back(code.jump_if(je), a);
+            }
+            exits.push_back(code.jump());
+        }
+        code.patch(jump.first, slow_path[p]);
+    }
+
+    // Return eax to execute_jit()
+    for (size_t jump : exits)
+        code.patch(jump, code.bytes.size());
+    save_registers();
+    code.byte(0x48); code.byte(0x83); code.byte(0xc4); code.byte(0x08);    // add rsp, 8
+    code.byte(0x41); code.byte(0x5e);                               // pop r14
+    code.byte(0x41); code.byte(0x5d);                               // pop r13
+    code.byte(0x41); code.byte(0x5c);                               // pop r12
+    code.byte(0x5b);                                                // pop rbx
+    code.byte(0xc3);                                                // ret
+
+    for (auto &fixup : fixups)
+        code.patch(fixup.first, offset[fixup.second - entry]);
+
+    const uint8_t *base = code.executable();
+    for (int p = entry; p <= end; p++) {
+        const instruction &ins = code_store[p];
+        if ((ins.f != fun_SIG) and (ins.f != fun_REH) and (ins.f != fun_DBG))
+            jit_native[p] = base + offset[p - entry];
+    }
+    jit_start[entry] = base;
+}
+
+
+void jit_prepare()
+// Find the procedures in the code store. Nothing is compiled until it has run for a while.
+{
+    vector<bool> entry(last_instruction + 1, false);
+    entry[1] = true;
+    for (int i = 1; i <= last_instruction; i++)
+        if ((code_store[i].f == fun_CAL) and (code_store[i].a >= 1) and (code_store[i].a <= last_instruction))
+            entry[code_store[i].a] = true;
+
+    jit_procedure.assign(last_instruction + 1, 0);
+    for (int i = 1, current = 1; i <= last_instruction; i++) {
+        if (entry[i])
+            current = i;
+        jit_procedure[i] = current;
+    }
+    jit_native.assign(last_instruction + 1, nullptr);
+    jit_start.assign(last_instruction + 1, nullptr);
+    jit_warmth.assign(last_instruction + 1, 0);
+}
+
+
+const uint8_t *jit_code_for(int p)
+// Native code for address p, or nullptr if it has none. A procedure is interpreted until it has
+// executed jit_threshold instructions, so that code that hardly runs is not worth compiling, and
+// then compiled.
+{
+    if ((p < 1) or (p > last_instruction))
+        return nullptr;
+    int entry = jit_procedure[p];
+    if (jit_start[entry] == nullptr) {
+        if (++jit_warmth[entry] < jit_threshold)
+            return nullptr;
+        jit_compile(entry);
+    }
+    return jit_native[p];
+}
+
+
+int jit_run(int p, const uint8_t *native)
+// Run the native code of address p until it returns the address at which to continue.
+{
+    return reinterpret_cast<native_entry>(jit_start[jit_procedure[p]])(native);
+}
+
+bool compile_trace(loop_trace &t)
+// Compile the iteration in trace_record into t. Returns false if it does anything the tier does
+// not handle.
+{
+    // Give every variable a slot, and note which ones are read before they are stored.
+    map<pair<int, int>, int> variable_slot;
+    for (auto &recorded : trace_record) {
+        const instruction &ins = code_store[recorded.first];
+        if ((ins.f != fun_LDV) and (ins.f != fun_STO))
+            continue;
+        auto found = variable_slot.emplace(make_pair(int(ins.l), int(ins.a)), int(t.variables.size()));
+        if (found.second) {
+            t.variables.emplace_back(ins.l, ins.a);
+            t.guarded.push_back(ins.f == fun_LDV);
+            t.written.push_back(false);
+        }
+        if (ins.f == fun_STO)
+            t.written[found.first->second] = true;
+    }
+    int slots = int(t.variables.size());
+
+    native_code code;
+    vector<trace_value> stack;
+    vector<bool> written(t.variables.size(), false);
+    vector<pair<size_t, int>> exit_jumps;    // Jumps to the code of each exit
+
+    auto operand = [&](uint8_t reg, int slot) {    // ModRM and displacement for reg, [rbx + slot]
+        code.byte(0x80 | (reg << 3) | 3);
+        code.int32(8 * (slot + 1));
+    };
+    auto load = [&](uint8_t reg, const trace_value &v) {    // mov reg, v
+        if (v.kind == value_constant) {
+            code.byte(0xb8 + reg);
+            code.int32(v.value);
+        } else {
+            code.byte(0x8b);
+            operand(reg, v.value);
+        }
+    };
+    auto side_exit = [&](size_t jump, int address, int executed) {
+        trace_exit e;
+        e.address = address;
+        e.executed = executed;
+        e.stack = stack;
+        e.written = written;
+        t.exits.push_back(e);
+        exit_jumps.emplace_back(jump, int(t.exits.size() - 1));
+    };
+
+    code.byte(0x53);                                    // push rbx
+    code.byte(0x48); code.byte(0x89); code.byte(0xfb);  // mov rbx, rdi
+    size_t loop = code.bytes.size();
+
+    for (int j = 0; j < int(trace_record.size()); j++) {
+        int p = trace_record[j].first;
+        const instruction &ins = code_store[p];
+        switch (ins.f) {
+        case fun_LDV:
+            stack.push_back({ value_slot, false, variable_slot[{ ins.l, ins.a }] });
+            break;
+        case fun_LCI:
+            stack.push_back({ value_constant, false, ins.a });
+            break;
+        case fun_JMP:
+            break;
+        case fun_STO: {
+            if (stack.empty() or stack.back().boolean)
+                return false;
+            int v = variable_slot[{ ins.l, ins.a }];
+            load(0, stack.back());
+            stack.pop_back();
+            // Values loaded from the variable earlier must keep the old value.
+            for (auto &s : stack) {
+                if ((s.kind == value_slot) and (s.value == v)) {
+                    code.byte(0x8b); operand(1, v);       // mov ecx, [variable]
+                    code.byte(0x89); operand(1, slots);   // mov [temporary], ecx
+                    s.value = slots++;
                 }
+            }
+            code.byte(0x89); operand(0, v);               // mov [variable], eax
+            written[v] = true;
+            break;
+        }
+        case fun_JIF: {
+            if (stack.empty() or (stack.back().kind != value_slot) or !stack.back().boolean)
+                return false;
+            bool jumped = trace_record[j].second;
+            code.byte(0x83); operand(7, stack.back().value); code.byte(0);   // cmp dword [condition], 0
+            code.byte(0x0f); code.byte(jumped ? 0x85 : 0x84); code.int32(0); // jne/je exit
+            side_exit(code.bytes.size() - 4, p, j);
+            // From here on the condition is known. It stays on the stack, but is only pushed if it
+            // is still there at the end of the iteration.
+            stack.back() = { value_constant, true, jumped ? 0 : 1 };
+            break;
+        }
+        case fun_OPR: {
+            // Stack shuffles only change which values the stack holds.
+            if ((ins.a == 24) and !stack.empty()) {    // drop
+                stack.pop_back();
                 break;
-            case 26:    // real-to-integer conversion
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_REAL) {
-                    error(
-                            "real-to_int conversion expects real number on top of stack.");
-                } else {
-                    data_store[top_of_stack].set_int(
-                            int(data_store[top_of_stack].get_real()));
-                }
+            }
+            if ((ins.a == 23) and !stack.empty()) {    // duplicate
+                stack.push_back(stack.back());
                 break;
-            case 27:    // integer-to-string conversion
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_INT) {
-                    error(
-                            "int-to-string conversion expects integer on top of stack.");
-                } else {
-                    data_store[top_of_stack].set_string(
-                            to_string(data_store[top_of_stack].get_int()));
-                }
+            }
+            if ((ins.a == 22) and (stack.size() >= 2)) {    // swap
+                swap(stack[stack.size() - 2], stack.back());
                 break;
-            case 28:    // real-to-string conversion
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_REAL) {
-                    error(
-                            "real-to-string conversion expects integer on top of stack.");
+            }
+            if ((stack.size() < 2) or !(((ins.a >= 3) and (ins.a <= 6)) or ((ins.a >= 10) and (ins.a <= 15))))
+                return false;
+            trace_value x = stack[stack.size() - 2];
+            trace_value y = stack.back();
+            if (x.boolean or y.boolean)
+                return false;
+            load(0, x);
+            switch (ins.a) {
+            case 3:    // add eax, y
+            case 4:    // sub eax, y
+                if (y.kind == value_constant) {
+                    code.byte(ins.a == 3 ? 0x05 : 0x2d);
+                    code.int32(y.value);
                 } else {
-                    data_store[top_of_stack].set_string(
-                            to_string(data_store[top_of_stack].get_real()));
+                    code.byte(ins.a == 3 ? 0x03 : 0x2b);
+                    operand(0, y.value);
                 }
                 break;
-            case 29:    // logical and
-                if ((data_store[top_of_stack].get_type()
-                        != Memory_cell::types_BOOLEAN)
-                        && data_store[top_of_stack - 1].get_type()
-                                != Memory_cell::types_BOOLEAN) {
-                    error(
-                            "Logical and expects boolean values at top of stack, and top of stack-1");
+            case 5:    // imul eax, y
+                if (y.kind == value_constant) {
+                    code.byte(0x69); code.byte(0xc0); code.int32(y.value);
                 } else {
-                    data_store[top_of_stack - 1].set_boolean(
-                            data_store[top_of_stack - 1].get_boolean()
-                                    && data_store[top_of_stack].get_boolean());
-                    top_of_stack--;
+                    code.byte(0x0f); code.byte(0xaf); operand(0, y.value);
                 }
                 break;
-            case 30:    // logical or
-                if ((data_store[top_of_stack].get_type()
-                        != Memory_cell::types_BOOLEAN)
-                        && data_store[top_of_stack - 1].get_type()
-                                != Memory_cell::types_BOOLEAN) {
-                    error(
-                            "Logical or expects boolean values at top of stack, and top of stack-1");
-                } else {
-                    data_store[top_of_stack - 1].set_boolean(
-                            data_store[top_of_stack - 1].get_boolean()
-                                    || data_store[top_of_stack].get_boolean());
-                    top_of_stack--;
-                }
+            case 6:    // eax := eax / y, leaving the trace on division by zero
+                load(1, y);
+                code.byte(0x85); code.byte(0xc9);                       // test ecx, ecx
+                code.byte(0x0f); code.byte(0x84); code.int32(0);        // je exit
+                side_exit(code.bytes.size() - 4, p, j);
+                code.byte(0x99);                                        // cdq
+                code.byte(0xf7); code.byte(0xf9);                       // idiv ecx
                 break;
-            case 31:    // is(exception)
-                if (data_store[top_of_stack].get_type()
-                        != Memory_cell::types_INT) {
-                    error(
-                            "is operations expects an integer value on top of stack");
+            default: {    // eax := eax <comparison> y
+                static const uint8_t set[] = { 0x94, 0x95, 0x9c, 0x9d, 0x9f, 0x9e };    // sete .. setle
+                if (y.kind == value_constant) {
+                    code.byte(0x3d); code.int32(y.value);
                 } else {
-                    data_store[top_of_stack].set_boolean(
-                            data_store[top_of_stack].get_int()
-                                    == pal_exception);
+                    code.byte(0x3b); operand(0, y.value);
                 }
-                break;
-            default: // should not be called since all cases have been enumerated
+                code.byte(0x0f); code.byte(set[ins.a - 10]); code.byte(0xc0);    // setcc al
+                code.byte(0x0f); code.byte(0xb6); code.byte(0xc0);               // movzx eax, al
                 break;
             }
-            break;
-        default:    // Should not occur. All possible cases are identified above
+            }
+            stack.pop_back();
+            stack.back() = { value_slot, ins.a >= 10, slots };
+            code.byte(0x89); operand(0, slots++);                        // mov [temporary], eax
             break;
         }
-        if (debugging_pal_code)
-            trace_stack(program_counter, base_register, top_of_stack);
-    } while (program_counter != 0);
+        default:
+            return false;
+        }
+    }
+    // Leave the stack as the stack code would at the end of the iteration.
+    for (auto &v : stack) {
+        if (v.kind == value_constant) {
+            code.byte(0xbf); code.int32(v.value);            // mov edi, value
+        } else {
+            code.byte(0x8b); operand(7, v.value);            // mov edi, [slot]
+        }
+        code.byte(0xbe); code.int32(v.boolean);              // mov esi, boolean
+        code.byte(0x48); code.byte(0xb8); code.int64(uint64_t(&trace_push));
+        code.byte(0xff); code.byte(0xd0);                    // call trace_push
+    }
+
+    code.byte(0x48); code.byte(0xff); code.byte(0x03);     // inc qword [rbx]    (iterations)
+    code.patch(code.jump(), loop);
+    for (auto &jump : exit_jumps) {
+        code.patch(jump.first, code.bytes.size());
+        code.byte(0xb8); code.int32(jump.second);           // mov eax, exit
+        code.byte(0x5b);                                    // pop rbx
+        code.byte(0xc3);                                    // ret
+    }
 
+    t.length = int(trace_record.size());
+    t.slots = slots;
+    t.code = reinterpret_cast<int (*)(int64_t *)>(code.executable());
+    return true;
 }
 
+#else
 
-vector<string> tokenize(const string &s) {
-    // identify each token in the string separated by white space.
-    auto end = s.cend();
-    auto start = end;
+void jit_prepare() {}
+const uint8_t *jit_code_for(int) { return nullptr; }
+int jit_run(int, const uint8_t *) { return 0; }
+bool compile_trace(loop_trace &) { return false; }
 
-    vector < string > v;
-    for (auto it = s.cbegin(); it != end; ++it) {
-        if (!isspace(*it)) {
-            if (start == end)
-                start = it;
-            continue;
-        }
-        if (start != end) {
-            v.emplace_back(start, it);
-            start = end;
-        }
+#endif
+
+
+void execute_jit()
+// JIT engine. Runs the compiled code of the current procedure until it hands control back, and
+// interprets the instructions that have no native code. Everything is interpreted while a listing
+// is being produced, and on machines other than x86-64 Linux.
+{
+    static bool prepared { false };
+    if (!prepared) {
+        jit_prepare();
+        prepared = true;
     }
-    if (start != end)
-        v.emplace_back(start, end);
-    return v;
-}
 
+    reset_machine();
+    do {
+        const uint8_t *native = debugging_pal_code ? nullptr : jit_code_for(program_counter);
+        if (native == nullptr)
+            step_instruction();
+        else
+            program_counter = jit_run(program_counter, native);
+    } while (program_counter != 0);
+}
 
-void load(ifstream &code_file) {
-    string line;    // read code_file in line by line.
 
-    vector < string > tokens;    // break each line into a vector of tokens
+bool run_trace(loop_trace &t)
+// Run the trace of the loop at program_counter until it exits. Returns false, having changed
+// nothing, if the trace cannot be entered because its variables are not all integers.
+{
+    static vector<int> address;    // Cell of each variable
+
+    address.resize(t.variables.size());
+    trace_frame.assign(t.slots + 1, 0);
+    for (size_t v = 0; v < t.variables.size(); v++) {
+        int b = frame_base(t.variables[v].first);
+        if (b < 0)
+            return false;
+        address[v] = b + t.variables[v].second;
+        for (size_t w = 0; w < v; w++)
+            if (address[w] == address[v])
+                return false;
+        if (t.guarded[v]) {
+            if (!data_store[address[v]].is_int())
+                return false;
+            trace_frame[v + 1] = data_store[address[v]].get_int();
+        }
+    }
 
-    // map<string, fun_code>::iterator it;
-    fun_code instr; // the instruction currently being uploaded into the code store.
+    const trace_exit &e = t.exits[t.code(trace_frame.data())];
+    long long iterations = trace_frame[0];
+    for (size_t v = 0; v < t.variables.size(); v++)
+        if (t.written[v] and (t.guarded[v] or e.written[v] or (iterations > 0)))
+            data_store[address[v]].set_int(int(trace_frame[v + 1]));
+    for (auto &value : e.stack) {
+        int x = (value.kind == value_constant) ? value.value : int(trace_frame[value.value + 1]);
+        top_of_stack++;
+        if (value.boolean)
+            data_store[top_of_stack].set_boolean(x != 0);
+        else
+            data_store[top_of_stack].set_int(x);
+    }
+    program_counter = e.address;
+    instructions_executed += iterations * t.length + e.executed;
+    if (iterations == 0)
+        t.failures++;
+    return true;
+}
 
-    int top { 0 };
-    int lev_diff { 0 };
-    int pos { 0 };
-    string str;
 
-    // We know the file is open and non-empty when we reach this point.
-    while (getline(code_file, line)) {
-        top++; // Increment top point. This is the cell in the code store we are populating.
+bool record_instruction(int p)
+// Check that the instruction at p, about to be executed while a loop is being recorded, can be
+// part of a trace, with the operand types the trace will assume.
+{
+    if ((int(trace_record.size()) >= trace_max_length) or (p < 1) or (p > last_instruction))
+        return false;
+    const instruction &ins = code_store[p];
+    switch (ins.f) {
+    case fun_LDV: {
+        int b = frame_base(ins.l);
+        if ((b < 0) or !data_store[b + ins.a].is_int())
+            return false;
+        break;
+    }
+    case fun_OPR:
+        if ((ins.a >= 22) and (ins.a <= 24))    // swap, duplicate, drop
+            break;
+        if (!(((ins.a >= 3) and (ins.a <= 6)) or ((ins.a >= 10) and (ins.a <= 15)))
+                or !data_store[top_of_stack - 1].is_int() or !data_store[top_of_stack].is_int())
+            return false;
+        break;
+    case fun_LCI:
+    case fun_STO:
+    case fun_JIF:
+    case fun_JMP:
+        break;
+    default:
+        return false;
+    }
+    trace_record.emplace_back(p, false);
+    return true;
+}
 
-        // line must adhere to a strict structure otherwise raise an exception and abort
-        try {
-            if (debugging_pal_code)
-                cout << top << ":    " << line << endl;
-            tokens = tokenize(line); // white space separates each token in the line.
 
-            // Every PAL instruction is on one line.
-            // Every PAL instruction has 3 fields followed by comments
-            // Comments are ignored, so only the first 3 tokens are useful.
+void execute_trace_jit()
+// Interpreter with the tracing tier. Loops that become hot are recorded and compiled (see
+// compile_trace), and their traces are run whenever the interpreter reaches their header. Nothing
+// is recorded or run while a listing is being produced.
+{
+    if (trace_at.empty()) {
+        trace_at.assign(last_instruction + 1, -1);
+        loop_count.assign(last_instruction + 1, 0);
+    }
 
-            if (tokens.size() < instruction_size) {
-                // There are 3 required components for every instruction.
-                throw("Instruction malformed: " + line);
-            } else {
-                // The first token is the instruction
-                // Convert first token to upper case so it can be used with map.
-                for (auto &c : tokens.at(0)) {
-                    c = toupper(c);
+    reset_machine();
+    trace_header = 0;
+    do {
+        int p = program_counter;
+        if ((p >= 1) and (p <= last_instruction) and !debugging_pal_code) {
+            if ((trace_header == 0) and (trace_at[p] >= 0)) {
+                loop_trace &t = traces[trace_at[p]];
+                if (run_trace(t)) {
+                    if (t.failures > trace_max_failures)
+                        trace_at[p] = -2;
+                    continue;
                 }
-                if (fun_code_map.find(tokens.at(0)) == fun_code_map.end()) {
-                    // Invalid instruction
-                    throw("Illegal instruction: " + tokens.at(0));
-                }
-                instr = strtofun(tokens.at(0));
-                // Second field is the level difference. it must be an integer.
-                lev_diff = stoi(tokens.at(1));
+            }
+            if ((trace_header != 0) and !record_instruction(p)) {
+                trace_at[trace_header] = -2;
+                trace_header = 0;
+            }
+        }
 
-                if (top >= code_size) {
-                    // Exceeded capacity of code store
-                    throw "Too many instructions. Code store full.";
-                }
-                code_store[top].f = instr;            // Set function code field
-                code_store[top].l = lev_diff;       // Set level difference field
-
-                // Third field is dependent on the instruction.
-                if (instr == fun_LCR) {
-                    code_store[top].a = Memory_cell(stof(tokens.at(2)));
-                } else if (instr == fun_LCS) {
-                    // Handle strings...
-                    str = "";    // initialize the string to empty
-
-                    // We know line contains at least 3 tokens and that they are
-                    // separated by whitespace.
-                    // Find the beginning of the third token.
-                    pos = 0; // The beginning of the line
-                    // deal with leading whitespace
-                    while (isspace(line.at(pos))) {
-                        pos++;
-                    }
-
-                    for (int i = 0; i < 2; i++) {
-                        // skip a token and trailing whitespace
-                        while (!isspace(line.at(pos)))    // handle token
-                            pos++;
-                        while (isspace(line.at(pos)))    // handle whitespace
-                            pos++;
-                    }
-                    // We are now at the beginning of the third token
-
-                    if (line.at(pos) != '\'') {
-                        // We should ge at the beginning of a string, but aren't.
-                        throw("Malformed string: " + line);
-                    } else {
-                        pos++;    // skip the opening single quote
-                    }
-                    // Everything now gets copied to str until we find the closing quote.
-                    // If we reach the end of the line then we have an error also.
-                    while ((pos < line.length()) and (line.at(pos) != '\'')) {
-                        str = str + line.at(pos++);
-                    }
-                    // If the string is zero length, or there was no closing
-                    // delimiter, then throw an exception.
-                    if (pos == line.length()    // no closing delimiter
-                            or (str.length() == 0))        // zero length string
-                        throw("Malformed string: " + line);
-                    code_store[top].a = Memory_cell(str);
+        step_instruction();
+
+        if (trace_header != 0) {
+            trace_record.back().second = (program_counter != p + 1);
+            if (program_counter == trace_header) {
+                loop_trace t;
+                if (compile_trace(t)) {
+                    trace_at[trace_header] = int(traces.size());
+                    traces.push_back(t);
                 } else {
-                    // Set address or integer constant field
-                    code_store[top].a = Memory_cell(stoi(tokens.at(2)));
+                    trace_at[trace_header] = -2;
                 }
+                trace_header = 0;
             }
-        } catch (string & msg) {
-            cerr << "EXCEPTION (instruction " << top << "): " << msg << endl;
-            abort();
+        } else if ((code_store[p].f == fun_JMP) and (program_counter == code_store[p].a)
+                and (program_counter >= 1) and (program_counter <= p) and !debugging_pal_code
+                and (trace_at[program_counter] == -1) and (++loop_count[program_counter] == trace_threshold)) {
+            trace_header = program_counter;
+            trace_record.clear();
         }
+    } while (program_counter != 0);
+}
+
+
+void execute(engine_kind engine)
+// Execute the loaded program with the given engine.
+{
+    switch (engine) {
+    case engine_threaded:
+        execute_threaded();
+        break;
+    case engine_register:
+        execute_registers();
+        break;
+    case engine_jit:
+        execute_jit();
+        break;
+    case engine_trace:
+        execute_trace_jit();
+        break;
+    default:
+        execute_code();
+        break;
+    }
+}
+
+
+class null_buffer : public streambuf
+// Stream buffer that discards everything written to it. Used to silence output while benchmarking.
+{
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+
+void run_benchmark(int runs)
+// Execute the loaded program runs times with each engine and report the instructions executed per
+// second, and for the register engine how many instructions it dispatched to do so. Standard input
+// is read once and replayed for every run; output is discarded.
+{
+    const string input { istreambuf_iterator<char>(cin), istreambuf_iterator<char>() };
+    const engine_kind engines[] { engine_switch, engine_threaded, engine_register, engine_jit, engine_trace };
+    const char *const engine_names[] { "switch  ", "threaded", "register", "jit     ", "trace   " };  // Indexed by engine_kind
+    null_buffer discard;
+
+    cout << "Benchmark: " << runs << " runs per engine" << endl;
+    for (engine_kind engine : engines) {
+        long long total_instructions { 0 };
+        long long total_dispatched { 0 };
+        streambuf *saved_cout = cout.rdbuf(&discard);
+
+        high_resolution_clock::time_point start = high_resolution_clock::now();
+        for (int run = 0; run < runs; run++) {
+            replay_input(input);
+            pal_exception = program_abort_exception;
+            execute(engine);
+            total_instructions += instructions_executed;
+            total_dispatched += instructions_dispatched;
+        }
+        high_resolution_clock::time_point stop = high_resolution_clock::now();
+
+        cout.rdbuf(saved_cout);
+
+        double seconds = duration<double>(stop - start).count();
+        cout << "    " << engine_names[engine] << " engine: "
+                << total_instructions << " instructions in " << seconds * 1000.0
+                << " milliseconds ("
+                << (long long) (seconds > 0.0 ? total_instructions / seconds : 0.0)
+                << " instructions/second)" << endl;
+        if (engine == engine_register)
+            cout << "             " << total_dispatched << " register instructions dispatched ("
+                    << (total_instructions > 0 ? 100 * total_dispatched / total_instructions : 0)
+                    << "% of the stack instructions)" << endl;
     }
-    last_instruction = top;
 }
 
 
@@ -1442,6 +2553,41 @@ void open_and_load(int argc, char *argv[]) {
     // Valid flags are:
     //        -h                    Help
     //        -l                    Generate Listing (to cout)
+    //        --engine=switch       Execute with the switch engine (default)
+    //        --engine=threaded     Execute with the direct-threaded engine
+    //        --engine=register     Execute with the stack code translated into register form
+    //        --jit                 Execute with the baseline JIT (also --engine=jit)
+    //        --trace-jit           Execute with the tracing JIT (also --engine=trace)
+    //        --no-fuse             Do not fuse instruction sequences into superinstructions
+    //        --no-quicken          Do not quicken OPR 3-15 into type-specialised operations
+    //        --no-tail-calls       Do not reuse the caller's frame for calls in tail position
+    //        --benchmark=N         Run the program N times with each engine and report the
+    //                              instructions executed per second
+    //        --max-instructions=N  Stop after N instructions (switch engine)
+    //        --check-bounds        Check the program counter and stack before each instruction
+    //                              (switch engine)
+    //        --compile-object[=F]  Write the code file as a PAL object file (F, or the code file
+    //                              name with the extension .palb) instead of executing it
+    //        --verify              Report whether the code passes verification, and the maximum
+    //                              stack depth of each procedure, instead of executing it
+    //        --flush=line          Write out program output at the end of each line (the default
+    //                              when standard output is a terminal)
+    //        --flush=full          Write out program output only when the buffer fills
+    //        --profile[=F]         Count the executions of each address (switch engine) and report
+    //                              the hottest instructions, blocks and procedures (to F)
+    //        --profile-time[=F]    The same, also sampling the time spent at each address
+    //        --callgrind=F         Follow the calls made (switch engine) and write a call graph
+    //                              profile to F in the callgrind format
+    //        --callgrind-time=F    The same, also timing each instruction
+    //        --trace=F             Record the last instructions executed (switch engine) in the
+    //                              binary trace file F, for paltrace
+    //        --trace-events=N      Keep the last N events (rounded up to a power of 2)
+    //        --snapshot-at=A       Write a snapshot of the machine when address A is first reached
+    //                              (switch engine)
+    //        --snapshot-at=signal  Write a snapshot whenever SIGUSR1 arrives (switch engine)
+    //        --snapshot-file=F     Write snapshots to F (default: the code file name with the
+    //                              extension .palsnap)
+    //        --restore=F           Resume the snapshot F instead of loading a code file
 
     string code_file_name { default_code_file_name };
     bool hflag = false;        // help flag set
@@ -1450,53 +2596,218 @@ void open_and_load(int argc, char *argv[]) {
     try        // Open code file.
     {
         cout << "Open files..." << endl;
-        if (argc > 3) {
-            // Error state. May not provide more than 2 arguments to the PAL machine.
-            throw "Too many command line arguments provided.";
-        } else
-            for (int i = 1; i < argc; i++)
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-h")
             {
-                string arg = argv[i];
-                if (arg == "-h")
+                // Help flag. Respond to display help information. Only do this once, even if flag is set multiple times
+                if (!hflag)
                 {
-                    // Help flag. Respond to display help information. Only do this once, even if flag is set multiple times
-                    if (!hflag)
-                    {
-                        hflag = true;    // Note that help has already been given. Once present it once
-                        cout << "Usage: " << argv[0] << " [flags] [filename]" << endl;
-                        cout << "    where filename is the name of the PAL file to be executed." << endl;
-                        cout << endl;
-                        cout << "    Valid flags are:" << endl;
-                        cout << "        -h              Print out this help message." << endl;
-                        cout << "        -l              Create a listing file  to standard output showing PAL code and" << endl;
-                        cout << "                        and memory stack contents during the execution process." << endl;
-                    }
+                    hflag = true;    // Note that help has already been given. Once present it once
+                    cout << "Usage: " << argv[0] << " [flags] [filename]" << endl;
+                    cout << "    where filename is the name of the PAL file to be executed." << endl;
+                    cout << endl;
+                    cout << "    Valid flags are:" << endl;
+                    cout << "        -h              Print out this help message." << endl;
+                    cout << "        -l              Create a listing file  to standard output showing PAL code and" << endl;
+                    cout << "                        and memory stack contents during the execution process." << endl;
+                    cout << "        --engine=switch      Execute using the switch engine (default)." << endl;
+                    cout << "        --engine=threaded    Execute using the direct-threaded engine." << endl;
+                    cout << "        --engine=register    Execute using the register engine." << endl;
+                    cout << "        --jit                Compile procedures to native code as they are first called." << endl;
+                    cout << "        --trace-jit          Compile hot loops to native code." << endl;
+                    cout << "        --no-fuse            Do not fuse common instruction sequences (threaded engine)." << endl;
+                    cout << "        --no-quicken         Do not specialise arithmetic and comparisons (threaded engine)." << endl;
+                    cout << "        --no-tail-calls      Give every call a new frame, even one followed by a return." << endl;
+                    cout << "        --benchmark=N        Run the program N times with each engine and report" << endl;
+                    cout << "                             instructions per second. Input is read once and replayed." << endl;
+                    cout << "        --max-instructions=N Stop after N instructions (switch engine)." << endl;
+                    cout << "        --check-bounds       Check the program counter and stack before each instruction" << endl;
+                    cout << "                             (switch engine)." << endl;
+                    cout << "        --compile-object[=file]  Write the code as a PAL object file (by default the" << endl;
+                    cout << "                             code file name with extension .palb) and stop." << endl;
+                    cout << "        --verify             Check the jump addresses and stack depths of the code, report" << endl;
+                    cout << "                             the maximum stack depth of each procedure, and stop." << endl;
+                    cout << "        --flush=line|full    Write program output at the end of each line, or only when" << endl;
+                    cout << "                             the output buffer fills (default: line on a terminal)." << endl;
+                    cout << "        --profile[=file]     Execute with the switch engine, counting executions of each" << endl;
+                    cout << "                             address, and report the hottest code (to file)." << endl;
+                    cout << "        --profile-time[=file]  The same, also sampling the time spent at each address." << endl;
+                    cout << "        --callgrind=file     Execute with the switch engine, following calls, and write a" << endl;
+                    cout << "                             call graph profile in the callgrind format to file." << endl;
+                    cout << "        --callgrind-time=file  The same, also timing each instruction." << endl;
+                    cout << "        --trace=file         Execute with the switch engine, recording the last instructions" << endl;
+                    cout << "                             executed in a binary trace file (see paltrace)." << endl;
+                    cout << "        --trace-events=N     Keep the last N instructions in the trace (default 1048576)." << endl;
+                    cout << "        --snapshot-at=address|signal  Execute with the switch engine, writing a snapshot of" << endl;
+                    cout << "                             the machine when address is first reached, or on SIGUSR1." << endl;
+                    cout << "        --snapshot-file=file Write snapshots to file (default: the code file name with" << endl;
+                    cout << "                             extension .palsnap)." << endl;
+                    cout << "        --restore=file       Resume the snapshot in file instead of loading a code file." << endl;
+                    cout << "    filename may be a text code file or a PAL object file." << endl;
                 }
-                else if (arg == "-l")
+            }
+            else if (arg == "-l")
+            {
+                // Generate a listing
+                debugging_pal_code = true;    // Set global flag to show that a listing is required.
+                // Name of listing file is based on the name of the source file. It is set up after the command line is processed.
+            }
+            else if (arg == "--engine=switch")
+            {
+                pal_engine = engine_switch;
+            }
+            else if (arg == "--engine=threaded")
+            {
+                pal_engine = engine_threaded;
+            }
+            else if (arg == "--engine=register")
+            {
+                pal_engine = engine_register;
+            }
+            else if ((arg == "--jit") or (arg == "--engine=jit"))
+            {
+                pal_engine = engine_jit;
+            }
+            else if ((arg == "--trace-jit") or (arg == "--engine=trace"))
+            {
+                pal_engine = engine_trace;
+            }
+            else if (arg.rfind("--engine=", 0) == 0)
+            {
+                throw ("Unknown execution engine: " + arg.substr(9));
+            }
+            else if (arg == "--no-fuse")
+            {
+                fusing_instructions = false;
+            }
+            else if (arg == "--no-quicken")
+            {
+                quickening_instructions = false;
+            }
+            else if (arg == "--no-tail-calls")
+            {
+                eliminating_tail_calls = false;
+            }
+            else if (arg.rfind("--benchmark=", 0) == 0)
+            {
+                benchmark_runs = stoi(arg.substr(12));
+                if (benchmark_runs <= 0)
+                    throw string("Number of benchmark runs must be positive.");
+            }
+            else if (arg.rfind("--max-instructions=", 0) == 0)
+            {
+                instruction_budget = stoll(arg.substr(19));
+                if (instruction_budget <= 0)
+                    throw string("Instruction budget must be positive.");
+            }
+            else if (arg == "--check-bounds")
+            {
+                checking_bounds = true;
+            }
+            else if (arg == "--flush=line")
+            {
+                output_flushing = flush_line;
+            }
+            else if (arg == "--flush=full")
+            {
+                output_flushing = flush_full;
+            }
+            else if (arg.rfind("--flush=", 0) == 0)
+            {
+                throw ("Unknown flush policy: " + arg.substr(8));
+            }
+            else if ((arg == "--profile") or (arg.rfind("--profile=", 0) == 0)
+                    or (arg == "--profile-time") or (arg.rfind("--profile-time=", 0) == 0))
+            {
+                profiling = true;
+                profiling_time = (arg.rfind("--profile-time", 0) == 0);
+                size_t equals = arg.find('=');
+                if (equals != string::npos)
+                    profile_file_name = arg.substr(equals + 1);
+            }
+            else if ((arg.rfind("--callgrind=", 0) == 0) or (arg.rfind("--callgrind-time=", 0) == 0))
+            {
+                timing_calls = (arg.rfind("--callgrind-time=", 0) == 0);
+                callgrind_file_name = arg.substr(arg.find('=') + 1);
+                if (callgrind_file_name.empty())
+                    throw string("No file named for the call graph profile.");
+            }
+            else if (arg.rfind("--trace=", 0) == 0)
+            {
+                trace_file_name = arg.substr(8);
+                if (trace_file_name.empty())
+                    throw string("No file named for the trace.");
+            }
+            else if (arg.rfind("--trace-events=", 0) == 0)
+            {
+                long long events = stoll(arg.substr(15));
+                if ((events <= 0) or (events > (1 << 28)))
+                    throw string("Number of trace events must be between 1 and 268435456.");
+                trace_capacity = bit_ceil(uint32_t(events));
+            }
+            else if (arg == "--snapshot-at=signal")
+            {
+                snapshot_on_signal();
+            }
+            else if (arg.rfind("--snapshot-at=", 0) == 0)
+            {
+                snapshot_address = stoi(arg.substr(14));
+                if ((snapshot_address <= 0) or (snapshot_address >= code_size))
+                    throw string("Snapshot address is outside the code store.");
+            }
+            else if (arg.rfind("--snapshot-file=", 0) == 0)
+            {
+                snapshot_file_name = arg.substr(16);
+                if (snapshot_file_name.empty())
+                    throw string("No file named for the snapshot.");
+            }
+            else if (arg.rfind("--restore=", 0) == 0)
+            {
+                restore_file_name = arg.substr(10);
+                if (restore_file_name.empty())
+                    throw string("No snapshot named to restore.");
+            }
+            else if (arg == "--verify")
+            {
+                verifying_code = true;
+            }
+            else if ((arg == "--compile-object") or (arg.rfind("--compile-object=", 0) == 0))
+            {
+                compiling_object = true;
+                if (arg.size() > 16)
+                    object_file_name = arg.substr(17);
+            }
+            else
+            {
+                // no flag, so this must be the name of the source file.
+                if (!sflag)
                 {
-                    // Generate a listing
-                    debugging_pal_code = true;    // Set global flag to show that a listing is required.
-                    // Name of listing file is based on the name of the source file. It is set up after the command line is processed.
+                    sflag = true;
+                    code_file_name = arg;
                 }
                 else
-                {
-                    // no flag, so this must be the name of the source file.
-                    if (!sflag)
-                    {
-                        sflag = true;
-                        code_file_name = arg;
-                    }
-                    else
-                        throw ("Multiple PAL source files provided");
-                }
+                    throw ("Multiple PAL source files provided");
             }
+        }
         // No code file name provided. Open default file "CODE". Throw exception if
         // file does not exist and abort program.
 
-        if (filesystem::exists(string(code_file_name)))         // Check file exists
-            code_file.open(code_file_name); // Open default file for reading.
-        else
+        if (!restore_file_name.empty()) {
+            // The snapshot holds the code, so no code file is loaded.
+            if (sflag)
+                throw string("A code file cannot be given with --restore.");
+            if (compiling_object)
+                throw string("A snapshot cannot be compiled to an object file.");
+            code_file_name = restore_file_name;
+        }
+        if (!filesystem::exists(string(code_file_name)))         // Check file exists
             throw("File named \"" + code_file_name + "\" does not exist.");
+        loading_object = restore_file_name.empty() and is_object_file(code_file_name);
+        loaded_file_name = code_file_name;
+        if (snapshot_file_name.empty())
+            snapshot_file_name = filesystem::path(code_file_name).replace_extension(".palsnap").string();
     } catch (const string & msg) {
         cerr << "EXCEPTION: " << msg << endl;
         cerr << "usage: pal [filename]" << endl;
@@ -1510,14 +2821,23 @@ void open_and_load(int argc, char *argv[]) {
     try // Load code file
     {
         cout << "Load code file..." << endl;
-        if (!code_file.is_open()) {
-            throw "Code file not open.";
+        if (!restore_file_name.empty()) {
+            restore_snapshot(restore_file_name);
+        } else if (loading_object) {
+            load_object(code_file_name);
+        } else {
+            load(code_file_name);     // read contents of code file into the code_store
         }
-        if (!code_file) {
-            throw "Empty code file. Execution aborts.";
+        if (compiling_object) {
+            if (object_file_name.empty())
+                object_file_name = filesystem::path(code_file_name).replace_extension(".palb").string();
+            write_object(object_file_name);
+            cout << "Object file written to " << object_file_name << "." << endl;
         }
-        load(code_file);     // read contents of code file into the code_store
-        code_file.close();
+        if (fusing_instructions)
+            fuse_instructions();
+        if (!trace_file_name.empty() and !compiling_object)
+            start_trace(trace_file_name, trace_capacity);
 
         // code_store should now be populated.
     } catch (const string & msg) {
@@ -1540,6 +2860,7 @@ int main(int argc, char *argv[]) {
 
     // Initialize the PAL machine
     start = high_resolution_clock::now();
+    buffer_output();
     // initialize mapping of strings onto function codes.
     establish_function_mapping(); // map strings onto appropriate function codes.
     // open and load code file
@@ -1548,6 +2869,12 @@ int main(int argc, char *argv[]) {
     time_span = duration_cast < milliseconds > (stop - start);
     cout << "Time to open and load code file: " << time_span.count()
             << " milliseconds." << endl;
+    if (compiling_object)
+        return 0;
+    if (verifying_code) {
+        write_verification(cout);
+        return verification.passed ? 0 : 1;
+    }
 
     // Now the code file is loaded, it's time to execute the code.
     start = high_resolution_clock::now();
@@ -1555,11 +2882,46 @@ int main(int argc, char *argv[]) {
     cout << "PAL-machine simulator" << endl;
     cout << "----------------------" << endl;
     cout << endl;
-    execute_code();
+    if (benchmark_runs > 0) {
+        run_benchmark(benchmark_runs);
+        return 0;
+    }
+    if (profiling or !callgrind_file_name.empty()) {
+        start_profile(profiling_time);
+        if (!callgrind_file_name.empty())
+            start_call_tracking(timing_calls);
+        execute(engine_switch);    // The only engine that counts executions
+        stop_profile();
+        finish_call_tracking();
+    } else {
+        // The only engine that records a trace or writes snapshots
+        bool switch_only = recording_trace or (snapshot_address != 0) or snapshotting_on_signal;
+        execute(switch_only ? engine_switch : pal_engine);
+    }
+    stop_trace();
     stop = high_resolution_clock::now();
     time_span = duration_cast < milliseconds > (stop - start);
 
     cout << "Execution completed in " << time_span.count() << " milliseconds."
             << endl;
+    if (profiling) {
+        if (profile_file_name.empty()) {
+            write_profile(cout, loaded_file_name);
+        } else {
+            ofstream profile(profile_file_name);
+            write_profile(profile, loaded_file_name);
+            cout << "Profile written to " << profile_file_name << "." << endl;
+        }
+    }
+    if (!callgrind_file_name.empty()) {
+        ofstream call_graph(callgrind_file_name);
+        write_callgrind(call_graph, loaded_file_name);
+        cout << "Call graph profile written to " << callgrind_file_name << "." << endl;
+    }
+    if (!trace_file_name.empty())
+        cout << "Trace written to " << trace_file_name << "." << endl;
+    if (snapshots_written > 0)
+        cout << snapshots_written << (snapshots_written == 1 ? " snapshot" : " snapshots")
+                << " written to " << snapshot_file_name << "." << endl;
     return 0;
 }
@@ -0,0 +1,245 @@
+/*
+ * pal2cpp.cpp
+ *
+ * Ahead-of-time translator from PAL code to C++.
+ *
+ * Usage
+ *        pal2cpp code_file [output_file]
+ *
+ * Reads a PAL code file (such as CODE or program1.pal) or PAL object file and writes a C++ program
+ * (to output_file, or standard output) that behaves as the PAL machine does when it executes that
+ * code file. Build the result together with the PAL machine's own instruction semantics:
+ *        g++ -std=c++2a -O2 -o program program.cpp pal_machine.cpp Memory_cell.cpp
+ * or let the makefile do it ("make program1.native" translates and builds program1.pal).
+ *
+ * Every PAL address becomes a label in main(), and the stack and base registers are kept in local
+ * variables. Loads and stores of local variables, integer constants, jumps and integer arithmetic
+ * and comparisons are translated into C++ directly. Every other instruction, and every case in which
+ * the operands are not integers, is executed by execute_instruction() from pal_machine.cpp, so the
+ * values held in Memory_cells, the output, and the run-time errors are exactly those of pal. The
+ * translated program prints only what the PAL program prints; it does not print the banner and
+ * timing lines that pal adds around the execution.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <filesystem>
+
+#include "pal_machine.h"
+
+using namespace std;
+
+string string_literal(const string &s)
+// s as a C++ string literal
+{
+    ostringstream literal;
+    literal << '"';
+    for (unsigned char c : s) {
+        if ((c == '"') or (c == '\\'))
+            literal << '\\' << c;
+        else if ((c >= ' ') and (c < 127))
+            literal << c;
+        else    // three digit octal escapes cannot run into the characters that follow
+            literal << '\\' << char('0' + (c >> 6)) << char('0' + ((c >> 3) & 7)) << char('0' + (c & 7));
+    }
+    literal << '"';
+    return literal.str();
+}
+
+
+string label(int a)
+// Label of the code for address a
+{
+    return (a == 0) ? "halt" : "L" + to_string(a);
+}
+
+
+void translate_instruction(ostream &out, int p)
+// Write the C++ for the instruction at address p.
+{
+    const instruction &ins = code_store[p];
+    const string step = "        STEP(" + to_string(p) + ");\n";
+
+    out << label(p) << ":    // " << insttostr(ins) << "\n";
+    switch (ins.f) {
+    case fun_LDV:
+        if (ins.l == 0)
+            out << "        data_store[++t] = data_store[b + " << ins.a << "];\n";
+        else
+            out << step;
+        break;
+    case fun_LCI:
+        out << "        data_store[++t].set_int(" << ins.a << ");\n";
+        break;
+    case fun_STO:
+        if (ins.l == 0)
+            out << "        data_store[b + " << ins.a << "] = data_store[t--];\n";
+        else
+            out << step;
+        break;
+    case fun_JMP:
+        if ((ins.a >= 0) and (ins.a <= last_instruction))
+            out << "        goto " << label(ins.a) << ";\n";
+        else
+            out << step << "        goto dispatch;\n";
+        break;
+    case fun_JIF:
+        if ((ins.a >= 0) and (ins.a <= last_instruction)) {
+            out << "        if (!data_store[t].is_boolean()) {\n"
+                << "    " << step
+                << "        } else if (!data_store[t].get_boolean())\n"
+                << "            goto " << label(ins.a) << ";\n";
+        } else {
+            out << step << "        goto dispatch;\n";
+        }
+        break;
+    case fun_CAL:
+        out << step << "        goto dispatch;\n";
+        break;
+    case fun_DBG:
+        out << step << "        if (debugging_pal_code) {\n"
+            << "            trace_stack(program_counter, base_register, top_of_stack);\n"
+            << "            goto interpret;\n"
+            << "        }\n";
+        break;
+    case fun_OPR: {
+        static const char *const operators[] = {
+            nullptr, nullptr, nullptr, "+", "-", "*", "/", nullptr, nullptr, nullptr,
+            "==", "!=", "<", ">=", ">", "<="
+        };
+        if ((ins.a == 0) or (ins.a == 1)) {
+            out << step << "        goto dispatch;\n";
+        } else if ((ins.a >= 3) and (ins.a <= 15) and (operators[ins.a] != nullptr)) {
+            string x = "data_store[t - 1].get_int()";
+            string y = "data_store[t].get_int()";
+            out << "        if (data_store[t - 1].is_int() and data_store[t].is_int()"
+                << ((ins.a == 6) ? " and (" + y + " != 0)" : "") << ") {\n"
+                << "            data_store[t - 1]." << ((ins.a >= 10) ? "set_boolean(" : "set_int(")
+                << x << " " << operators[ins.a] << " " << y << ");\n"
+                << "            t--;\n"
+                << "        } else {\n"
+                << "    " << step
+                << "        }\n";
+        } else {
+            out << step;
+        }
+        break;
+    }
+    default:
+        out << step;
+        break;
+    }
+}
+
+
+void translate(ostream &out, const string &code_file_name)
+// Write the C++ program for the code now in code_store.
+{
+    out << "// Translated from the PAL code file " << code_file_name << " by pal2cpp.\n"
+        << "// Build with pal_machine.cpp and Memory_cell.cpp; see pal2cpp.cpp.\n\n"
+        << "#include \"pal_machine.h\"\n\n";
+
+    out << "static const instruction program[] {    // Addresses 1 onwards\n";
+    for (int p = 1; p <= last_instruction; p++)
+        out << "    { fun_code(" << int(code_store[p].f) << "), fused_none, " << code_store[p].l
+            << ", " << code_store[p].a << " },    // " << p << ": " << insttostr(code_store[p]) << "\n";
+    out << "};\n\n";
+
+    out << "static const vector<float> program_reals {\n";
+    for (float r : real_constants)
+        out << "    " << hexfloat << r << defaultfloat << "f,\n";
+    out << "};\n\n";
+
+    out << "static const vector<string> program_strings {\n";
+    for (const string &s : string_constants)
+        out << "    " << string_literal(s) << ",\n";
+    out << "};\n\n";
+
+    out << "// The stack and base registers live in t and b, and are copied to and from the machine\n"
+        << "// whenever pal_machine.cpp executes an instruction.\n"
+        << "#define STEP(p)  (top_of_stack = t, base_register = b, program_counter = (p), \\\n"
+        << "                  execute_instruction(), t = top_of_stack, b = base_register)\n\n";
+
+    out << "int main() {\n"
+        << "    buffer_output();\n"
+        << "    establish_function_mapping();    // used in run-time error messages\n"
+        << "    for (size_t i = 0; i < sizeof(program) / sizeof(program[0]); i++)\n"
+        << "        code_store[i + 1] = program[i];\n"
+        << "    last_instruction = " << last_instruction << ";\n"
+        << "    real_constants = program_reals;\n"
+        << "    string_constants = program_strings;\n"
+        << "    reset_machine();\n\n"
+        << "    int t = top_of_stack;\n"
+        << "    int b = base_register;\n"
+        << "    goto L1;\n\n";
+
+    // Control reaches dispatch when the next address is only known at run time.
+    out << "dispatch:\n"
+        << "    switch (program_counter) {\n"
+        << "    case 0:\n"
+        << "        goto halt;\n";
+    for (int p = 1; p <= last_instruction; p++)
+        out << "    case " << p << ":\n        goto " << label(p) << ";\n";
+    out << "    default:    // outside the code; execute whatever is there as pal would\n"
+        << "        STEP(program_counter);\n"
+        << "        goto dispatch;\n"
+        << "    }\n\n";
+
+    // A listing is produced by executing one instruction at a time, as pal does.
+    out << "interpret:\n"
+        << "    while (debugging_pal_code and (program_counter != 0))\n"
+        << "        step_instruction();\n"
+        << "    t = top_of_stack;\n"
+        << "    b = base_register;\n"
+        << "    goto dispatch;\n\n";
+
+    for (int p = 1; p <= last_instruction; p++)
+        translate_instruction(out, p);
+    out << "    // Falling off the end of the code\n"
+        << "    program_counter = " << last_instruction + 1 << ";\n"
+        << "    goto dispatch;\n\n"
+        << "halt:\n"
+        << "    return 0;\n"
+        << "}\n";
+}
+
+
+int main(int argc, char *argv[]) {
+    if ((argc < 2) or (argc > 3)) {
+        cerr << "usage: pal2cpp code_file [output_file]" << endl;
+        return 1;
+    }
+    string code_file_name = argv[1];
+    if (!filesystem::exists(code_file_name)) {
+        cerr << "File named \"" << code_file_name << "\" does not exist." << endl;
+        return 1;
+    }
+    establish_function_mapping();
+    if (is_object_file(code_file_name)) {
+        try {
+            load_object(code_file_name);
+        } catch (const string &msg) {
+            cerr << "EXCEPTION: " << msg << endl;
+            return 1;
+        }
+    } else {
+        load(code_file_name);
+    }
+
+    if (argc == 3) {
+        ofstream out(argv[2]);
+        if (!out) {
+            cerr << "Cannot write " << argv[2] << endl;
+            return 1;
+        }
+        translate(out, code_file_name);
+    } else {
+        translate(cout, code_file_name);
+    }
+    return 0;
+}
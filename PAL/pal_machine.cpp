@@ -0,0 +1,2723 @@
+/*
+ * pal_machine.cpp
+ *
+ * The state of the PAL machine, the loader and the reference implementation of the instruction set.
+ * See pal.cpp for a description of the PAL machine.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cctype>
+#include <utility>
+#include <string_view>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <climits>
+#include <limits>
+#include <csignal>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pal_machine.h"
+#include "pal_object.h"
+#include "pal_trace.h"
+#include "pal_snapshot.h"
+
+// Global variables follow.
+
+// flags
+bool debugging_pal_code { false };
+bool profiling_pal_code { false };
+bool checking_bounds { false };
+bool tracking_calls { false };
+bool recording_trace { false };
+int snapshot_address { 0 };
+bool snapshotting_on_signal { false };
+string snapshot_file_name;
+int snapshots_written { 0 };
+long long instruction_budget { 0 };
+flush_policy output_flushing { isatty(STDOUT_FILENO) ? flush_line : flush_full };
+
+
+long long instructions_executed { 0 };     // Instructions executed by the most recent run
+
+// set up mapping from string to function codes;
+map<string, fun_code> fun_code_map;
+
+// The stores are reserved as address space rather than defined as arrays. The kernel commits their
+// pages when they are first touched, so a store grows as far as the program uses it and nothing is
+// constructed at startup: a page of zeros holds undefined Memory_cells and "MST 0 0" instructions.
+// A guard page after the data and code stores turns running off their ends into a fatal error.
+
+namespace {
+
+struct guarded_store    // A store that ends in a guard page, and the error reported on reaching it
+{
+    const char *guard;
+    const char *guard_end;
+    string message;        // The whole first line of the report, formatted in advance
+};
+
+guarded_store guarded_stores[2];
+int guarded_store_count { 0 };
+struct sigaction previous_fault_action;    // SIGSEGV action replaced by guard_page_fault
+char fault_stack[1 << 16];                 // Alternate stack for guard_page_fault
+
+void write_pending_output();
+
+void write_all(const char *text, size_t length)
+// Write text to standard error with write(2), which is safe in a signal handler.
+{
+    while (length > 0) {
+        ssize_t written = ::write(STDERR_FILENO, text, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        text += written;
+        length -= size_t(written);
+    }
+}
+
+void guard_page_fault(int signal, siginfo_t *info, void *context)
+// SIGSEGV handler, run on fault_stack. A fault in a guard page is an access by the PAL machine
+// itself, so it is reported as fatal_error() does, but without the stack dump, which would list the
+// whole store. Only async-signal-safe calls are made: the program's buffered output and the report
+// are written with write(2). Any other fault is not ours and goes to the action there was before.
+{
+    const char *address = static_cast<const char *>(info->si_addr);
+    for (int i = 0; i < guarded_store_count; i++) {
+        const guarded_store &store = guarded_stores[i];
+        if ((address >= store.guard) and (address < store.guard_end)) {
+            write_pending_output();
+            write_all(store.message.data(), store.message.size());
+            char line[48] = "     At address: ";
+            char *end = to_chars(line + strlen(line), line + sizeof(line) - 2, program_counter - 1).ptr;
+            *end++ = '.';
+            *end++ = '\n';
+            write_all(line, size_t(end - line));
+            abort();
+        }
+    }
+    if ((previous_fault_action.sa_flags & SA_SIGINFO) != 0) {
+        previous_fault_action.sa_sigaction(signal, info, context);
+    } else if ((previous_fault_action.sa_handler != SIG_DFL) and (previous_fault_action.sa_handler != SIG_IGN)) {
+        previous_fault_action.sa_handler(signal);
+    } else {
+        // Restore the default action and raise the signal again. It is delivered, and ends the
+        // program, when the handler returns, even if it was sent rather than caused by an access.
+        sigaction(signal, &previous_fault_action, nullptr);
+        raise(signal);
+    }
+}
+
+template<typename T>
+T *reserve_store(size_t size, const char *overflow_message = nullptr)
+// Reserve a zero-filled store of size elements, with one page before element 0. If overflow_message
+// is given, the page after the store is a guard page.
+{
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t bytes = (size * sizeof(T) + page - 1) / page * page;
+    char *start = static_cast<char *>(mmap(nullptr, page + bytes + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (start == MAP_FAILED) {
+        cerr << "*** FATAL: Cannot reserve memory for the PAL machine." << endl;
+        exit(1);
+    }
+    if (overflow_message != nullptr) {
+        char *guard = start + page + bytes;
+        mprotect(guard, page, PROT_NONE);
+        guarded_stores[guarded_store_count++] = { guard, guard + page,
+                string("*** FATAL Run-time error: ") + overflow_message + "\n" };
+        if (guarded_store_count == 1) {
+            // The alternate stack lets the handler run even when the fault is in the thread's own
+            // stack. It serves the thread that reserves the stores, which is the main thread.
+            stack_t alternate {};
+            alternate.ss_sp = fault_stack;
+            alternate.ss_size = sizeof(fault_stack);
+            sigaltstack(&alternate, nullptr);
+            struct sigaction action {};
+            action.sa_sigaction = guard_page_fault;
+            action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigaction(SIGSEGV, &action, &previous_fault_action);
+        }
+    }
+    return reinterpret_cast<T *>(start + page);
+}
+
+}
+
+// Define data memory (RAM). The page before data_store[0] is readable, so that following the static
+// link of the main program finds an undefined cell.
+Memory_cell *data_store { reserve_store<Memory_cell>(store_size, "Data store overflow.") };
+
+instruction *code_store { reserve_store<instruction>(code_size, "Program counter is outside the code store.") };
+// Note that the data store and instruction store are separated for convenience.
+
+long long *address_counts { reserve_store<long long>(code_size) };    // Executions of each address while profiling
+call_graph calls_made;
+
+vector<float> real_constants;             // Operands of LCR instructions
+vector<string> string_constants;          // Operands of LCS instructions
+vector<uint32_t> source_lines;            // Source line of each address, if an object file gave them
+
+int pal_exception { program_abort_exception };  // Name of the current exception
+vector<int> handler_at;                    // Handler in effect at each address, if handlers_tabled
+bool handlers_tabled { false };
+bool eliminating_tail_calls { true };
+vector<bool> tail_call_at;                 // CAL at each address is a tail call
+
+int last_instruction { 0 };      // Index of last instruction loaded into code_store
+
+// registers
+int program_counter { 0 };
+int base_register { 0 };
+int top_of_stack { 0 };
+instruction *instruction_register;
+
+// The display holds the base of the current frame and the bases of its static ancestors, indexed by
+// static nesting depth (the main program is at depth 0), so that base(l) is a single load.
+int *display { reserve_store<int>(store_size) };
+int display_depth { -1 };        // Depth of the current frame; -1 while the display is not known
+
+struct display_link    // What a CAL changed in the display, so that its return can undo it
+{
+    int replaced { 0 };        // Previous display entry at the depth of the called frame
+    int caller_depth { -1 };   // Depth of the calling frame
+    int generation { -1 };     // display_generation when the call was made
+};
+
+display_link *display_links { reserve_store<display_link>(store_size) };    // Indexed by the base of the called frame
+int display_generation { 0 };              // Incremented each time the display is rebuilt
+
+namespace {
+
+class output_buffer : public streambuf
+// Buffer for standard output, written out with write(2) when it fills and whenever cout is flushed
+{
+public:
+    output_buffer()
+    {
+        setp(characters, characters + sizeof(characters));
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (sync() != 0)
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        bool written = write_pending();
+        setp(characters, characters + sizeof(characters));    // If not written, output is lost, as with cout
+        return written ? 0 : -1;
+    }
+
+public:
+    bool write_pending()
+    // Write out the characters buffered, with nothing but write(2), so that a signal handler can
+    // use it. The buffer is left as it is. Returns false if they could not all be written.
+    {
+        const char *next = pbase();
+        while (next < pptr()) {
+            ssize_t written = ::write(STDOUT_FILENO, next, pptr() - next);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            next += written;
+        }
+        return true;
+    }
+
+private:
+    char characters[1 << 16];
+};
+
+output_buffer *standard_output { nullptr };    // The buffer given to cout, once it has one
+
+
+void write_pending_output()
+// Write out what the program has written to cout and is still in its buffer. Used by
+// guard_page_fault(), so it leaves cout alone if it has no output_buffer.
+{
+    if (standard_output != nullptr)
+        standard_output->write_pending();
+}
+
+}
+
+void buffer_output()
+// Send cout through an output_buffer. cerr is tied to cout, so the buffer is written out before any
+// error message; cin is too, but that is only needed when the user sees the output before typing.
+// The buffer is never destroyed, so that cout can still be flushed at exit.
+{
+    static output_buffer *buffer = new output_buffer;
+    cout.flush();
+    cout.rdbuf(buffer);
+    standard_output = buffer;
+    if (!isatty(STDOUT_FILENO))
+        cin.tie(nullptr);
+}
+
+bool write_value(Memory_cell &cell)
+// Write cell as cout << would, formatting numbers with to_chars. Return false if cell holds neither
+// a number nor a string.
+{
+    char digits[32];
+    to_chars_result end;
+    switch (cell.get_type()) {
+    case Memory_cell::types_REAL:
+        end = to_chars(digits, digits + sizeof(digits), cell.get_real(), chars_format::general, 6);
+        break;
+    case Memory_cell::types_INT:
+        end = to_chars(digits, digits + sizeof(digits), cell.get_int());
+        break;
+    case Memory_cell::types_STRING:
+        cout << cell.get_string();
+        return true;
+    default:
+        return false;
+    }
+    cout.write(digits, end.ptr - digits);
+    return true;
+}
+
+void write_newline()
+{
+    cout.put('\n');
+    if (output_flushing == flush_line)
+        cout.flush();
+}
+
+namespace {
+
+// Input read by PAL programs. Standard input is mapped if it is a regular file and otherwise read in
+// large blocks, and numbers are converted where they lie with from_chars. The values read, and the
+// points at which end of file is seen, are those of cin >> value and cin.eof().
+
+constexpr size_t input_block_size { 1 << 20 };
+
+struct input_source
+{
+    bool open { false };             // Standard input has been looked at
+    const char *next { nullptr };    // The characters read but not yet used
+    const char *limit { nullptr };
+    bool exhausted { false };        // There are no characters beyond limit
+    vector<char> block;              // Characters read from a pipe or terminal
+    bool ended { false };            // As cin.eof()
+    bool failed { false };           // As cin.fail(): nothing more is read
+    long long limit_position { 0 };  // Bytes of standard input up to limit, from where it was opened
+};
+
+input_source input;
+
+inline bool is_space(char c)
+{
+    return isspace(static_cast<unsigned char>(c));
+}
+
+void open_input()
+// Map standard input if it is a regular file, otherwise prepare to read it in blocks.
+{
+    input.open = true;
+    struct stat status;
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if ((fstat(STDIN_FILENO, &status) == 0) and S_ISREG(status.st_mode) and (offset >= 0)) {
+        if (status.st_size <= offset) {
+            input.exhausted = true;
+            return;
+        }
+        off_t start = offset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+        size_t bytes = size_t(status.st_size - start);
+        void *mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, STDIN_FILENO, start);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, bytes, MADV_SEQUENTIAL);
+            input.next = static_cast<const char *>(mapping) + (offset - start);
+            input.limit = static_cast<const char *>(mapping) + bytes;
+            input.limit_position = status.st_size - offset;
+            input.exhausted = true;
+            return;
+        }
+    }
+    input.block.resize(input_block_size);
+    input.next = input.limit = input.block.data();
+}
+
+bool refill_input()
+// Read more of standard input, keeping the characters from input.next on. Return false if there is
+// no more. If standard output is a terminal, cout is flushed first, as cin's tie to it would: the
+// read may wait for the user, who should see any prompt written without a newline.
+{
+    static const bool output_to_terminal { isatty(STDOUT_FILENO) != 0 };
+    if (input.exhausted)
+        return false;
+    if (output_to_terminal)
+        cout.flush();
+    size_t kept = input.limit - input.next;
+    memmove(input.block.data(), input.next, kept);
+    if (kept == input.block.size())
+        input.block.resize(2 * input.block.size());
+    char *data = input.block.data();
+    ssize_t bytes;
+    do
+        bytes = read(STDIN_FILENO, data + kept, input.block.size() - kept);
+    while ((bytes < 0) and (errno == EINTR));
+    input.next = data;
+    input.limit = data + kept + max(bytes, ssize_t(0));
+    input.limit_position += max(bytes, ssize_t(0));
+    if (bytes <= 0)
+        input.exhausted = true;
+    return bytes > 0;
+}
+
+bool start_reading()
+// As the sentry of cin >>: skip white space, and fail at end of file or after an earlier failure.
+{
+    if (!input.open)
+        open_input();
+    if (input.failed or input.ended) {
+        input.failed = true;
+        return false;
+    }
+    for (;;) {
+        while ((input.next < input.limit) and is_space(*input.next))
+            input.next++;
+        if (input.next < input.limit)
+            return true;
+        if (!refill_input()) {
+            input.ended = input.failed = true;
+            return false;
+        }
+    }
+}
+
+const char *scan_integer(const char *p, const char *limit)
+// End of the characters cin >> takes for an integer starting at p
+{
+    if ((p < limit) and ((*p == '+') or (*p == '-')))
+        p++;
+    while ((p < limit) and (*p >= '0') and (*p <= '9'))
+        p++;
+    return p;
+}
+
+const char *scan_real(const char *p, const char *limit)
+// End of the characters cin >> takes for a real starting at p: digits with at most one decimal
+// point, then an exponent if there were digits.
+{
+    bool point { false };
+    bool digits { false };
+    bool exponent { false };
+    if ((p < limit) and ((*p == '+') or (*p == '-')))
+        p++;
+    for (; p < limit; p++) {
+        if ((*p >= '0') and (*p <= '9')) {
+            digits = true;
+        } else if ((*p == '.') and !point and !exponent) {
+            point = true;
+        } else if (((*p == 'e') or (*p == 'E')) and digits and !exponent) {
+            exponent = true;
+            if ((p + 1 < limit) and ((p[1] == '+') or (p[1] == '-')))
+                p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+long long input_position()
+// Bytes of standard input read so far
+{
+    return input.limit_position - (input.limit - input.next);
+}
+
+void resume_input(long long position, bool ended, bool failed)
+// Continue reading standard input as if position bytes had been read, with the given state.
+{
+    input = input_source();
+    open_input();
+    for (long long skipped = 0; skipped < position;) {
+        if ((input.next == input.limit) and !refill_input())
+            break;
+        long long step = min<long long>(input.limit - input.next, position - skipped);
+        input.next += step;
+        skipped += step;
+    }
+    input.ended = ended;
+    input.failed = failed;
+}
+
+string_view next_number(const char *(*scan)(const char *, const char *))
+// The characters of the number at input.next, as found by scan. A number that runs to the end of
+// the block is scanned again once more has been read, and one that runs to the end of the input sets
+// input.ended.
+{
+    const char *end = scan(input.next, input.limit);
+    while (end == input.limit) {
+        if (!refill_input()) {
+            end = input.limit;    // refill_input() may have moved the characters
+            input.ended = true;
+            break;
+        }
+        end = scan(input.next, input.limit);
+    }
+    string_view number(input.next, end - input.next);
+    input.next = end;
+    if ((number.size() > 0) and (number[0] == '+'))    // Accepted by cin >>, but not by from_chars
+        number.remove_prefix(1);
+    return number;
+}
+
+}
+
+int read_int()
+// Read an integer as cin >> would. A value that does not fit is clamped, and ends the input.
+{
+    if (!start_reading())
+        return 0;
+    string_view number = next_number(scan_integer);
+    int value { 0 };
+    auto [end, fault] = from_chars(number.data(), number.data() + number.size(), value);
+    if (fault == errc::result_out_of_range) {
+        value = (number[0] == '-') ? INT_MIN : INT_MAX;
+        input.failed = true;
+    } else if ((fault != errc()) or (end != number.data() + number.size())) {
+        value = 0;
+        input.failed = true;
+    }
+    return value;
+}
+
+float read_real()
+// Read a real as cin >> would. A value too large for a float is clamped, and ends the input.
+{
+    if (!start_reading())
+        return 0;
+    string_view number = next_number(scan_real);
+    float value { 0 };
+    auto [end, fault] = from_chars(number.data(), number.data() + number.size(), value);
+    if (fault == errc::result_out_of_range) {
+        // from_chars does not say whether the value was too large or too small; strtof does.
+        value = strtof(string(number).c_str(), nullptr);
+        if (isinf(value)) {
+            value = copysign(numeric_limits<float>::max(), value);
+            input.failed = true;
+        }
+    } else if ((fault != errc()) or (end != number.data() + number.size())) {
+        value = 0;
+        input.failed = true;
+    }
+    return value;
+}
+
+bool input_ended()
+{
+    return input.ended;
+}
+
+void replay_input(const string &text)
+{
+    input = input_source();
+    input.open = true;
+    input.next = text.data();
+    input.limit = text.data() + text.size();
+    input.limit_position = text.size();
+    input.exhausted = true;
+}
+
+void establish_function_mapping()
+{
+    // Set up mapping of strings onto function codes.
+    // insert elements into the map
+    fun_code_map.insert(pair<string, fun_code>("MST", fun_MST)); // Mark the stack
+    fun_code_map.insert(pair<string, fun_code>("CAL", fun_CAL)); // Procedure call
+    fun_code_map.insert(pair<string, fun_code>("INC", fun_INC)); // Increment top-of-stack pointer
+    fun_code_map.insert(pair<string, fun_code>("JIF", fun_JIF)); // Jump if false
+    fun_code_map.insert(pair<string, fun_code>("JMP", fun_JMP)); // Unconditional jump
+    fun_code_map.insert(pair<string, fun_code>("LCI", fun_LCI)); // Load integer constant onto stack
+    fun_code_map.insert(pair<string, fun_code>("LCR", fun_LCR)); // Load real constant onto stack
+    fun_code_map.insert(pair<string, fun_code>("LCS", fun_LCS)); // Load string literal onto stack
+    fun_code_map.insert(pair<string, fun_code>("LDA", fun_LDA)); // Load the absolute address of a variable onto the stack
+    fun_code_map.insert(pair<string, fun_code>("LDI", fun_LDI)); // Load the value stored at specified address onto the stack
+    fun_code_map.insert(pair<string, fun_code>("LDV", fun_LDV)), // Load the value of a variable onto the stack
+    fun_code_map.insert(pair<string, fun_code>("LDU", fun_LDU)); // Load an undefined or void value
+    fun_code_map.insert(pair<string, fun_code>("OPR", fun_OPR)); // Execute operation - there are 32 of them
+    fun_code_map.insert(pair<string, fun_code>("RDI", fun_RDI)); // Read a value into an integer variable
+    fun_code_map.insert(pair<string, fun_code>("RDR", fun_RDR)); // Read a value into a real variable
+    fun_code_map.insert(pair<string, fun_code>("STI", fun_STI)); // Load top-of-stack - 1 into a variable at address top-of-stack
+    fun_code_map.insert(pair<string, fun_code>("STO", fun_STO)); // Store into a variable
+    fun_code_map.insert(pair<string, fun_code>("SIG", fun_SIG)); // Raise signal
+    fun_code_map.insert(pair<string, fun_code>("REH", fun_REH)); // Register exception handler
+    fun_code_map.insert(pair<string, fun_code>("DBG", fun_DBG)); // Turn debugging status on/off
+}
+
+
+fun_code strtofun(string s)
+// return the function code associated with string
+{
+    return fun_code_map.find(s)->second;
+}
+
+string funtostr(fun_code f)
+{
+    string key = "";
+    for (auto &i : fun_code_map) {
+        if (i.second == f) {
+            key = i.first;
+            break; // to stop searching
+        }
+    }
+    return key;
+}
+
+
+Memory_cell operand(const instruction &i)
+// Recover the tagged value of the third field of an instruction as it appeared in the code file
+{
+    switch (i.f) {
+    case fun_LCR:
+        return Memory_cell(real_constants[i.a]);
+    case fun_LCS:
+        return Memory_cell(string_constants[i.a]);
+    default:
+        return Memory_cell(int(i.a));
+    }
+}
+
+
+string insttostr(instruction i)
+// Convert an instruction to a string
+{
+    return funtostr(i.f) + " " + to_string(i.l) + " " + operand(i).to_string();
+}
+
+namespace {
+
+int frame_handler(int lp, int lb)
+// The handler registered in the frame based at lb, which is executing the instruction before lp
+{
+    if (handlers_tabled)
+        return ((lp >= 2) and (lp - 1 <= last_instruction)) ? handler_at[lp - 1] : 0;
+    if (!data_store[lb - 1].is_int())
+        fatal_error("Exception handler address has the wrong type!");
+    return data_store[lb - 1].get_int();
+}
+
+map<int, int> tabled_handlers(int t)
+// The handlers that REH would have stored in the frames on the stack up to t, by the cell they
+// would be in. Without a listing REH leaves them to handler_at, but stack dumps still show them.
+{
+    map<int, int> handlers;
+    if (!handlers_tabled or debugging_pal_code)
+        return handlers;
+    int lp = program_counter;
+    int lb = base_register;
+    while ((lb >= 5) and (lb - 1 <= t) and data_store[lb - 2].is_int() and data_store[lb - 3].is_int()) {
+        if (data_store[lb - 1].is_int() and (data_store[lb - 1].get_int() == 0))
+            handlers[lb - 1] = frame_handler(lp, lb);
+        if (data_store[lb - 3].get_int() >= lb)
+            break;
+        lp = data_store[lb - 2].get_int();
+        lb = data_store[lb - 3].get_int();
+    }
+    return handlers;
+}
+
+}
+
+void trace_stack(int p, int b, int t)
+// Trace the stack and create a stack dump
+{
+    cout << endl << "*** Run-time stack:" << endl;
+    cout << "     Base of activation record: " << b << "." << endl;
+    cout << "     Current top of stack: " << t << "." << endl;
+    cout << "     Instruction register contains: '"
+            << insttostr(*instruction_register) << "'." << endl;
+    cout << endl;
+    cout << "Contents of stack:" << endl;
+    cout << "------------------" << endl << endl;
+    const map<int, int> handlers = tabled_handlers(t);
+    for (int i = 1; i <= t; i++) {
+        auto handler = handlers.find(i);
+        Memory_cell cell = (handler == handlers.end()) ? data_store[i] : Memory_cell(handler->second);
+        cout << "   " << i << ": '" << cell.to_string() << "'."
+                << endl;
+    }
+    cout << endl << endl;
+}
+
+
+void trace_instruction(int p)
+// Show the instruction at address p before it is executed
+{
+    Memory_cell a { operand(code_store[p]) };
+
+    cout << endl << "Instruction at " << p << ": "
+            << funtostr(code_store[p].f) << " "
+            << code_store[p].l << " ";
+    switch (a.get_type()) {
+    case Memory_cell::types_UNDEF:
+        cout << "UNDEFINED" << endl;
+        break;
+    case Memory_cell::types_BOOLEAN:
+        cout << a.get_boolean() << endl;
+        break;
+    case Memory_cell::types_INT:
+        cout << a.get_int() << endl;
+        break;
+    case Memory_cell::types_REAL:
+        cout << a.get_real() << endl;
+        break;
+    case Memory_cell::types_STRING:
+        cout << a.get_string() << endl;
+        break;
+    default:   // should never arise since all cases are addressed above
+        break;
+    }
+}
+
+
+void report_source_line(int p)
+// Name the source line of address p, if it is known.
+{
+    if ((p >= 1) and (p < int(source_lines.size())) and (source_lines[p] != 0))
+        cerr << "     At source line: " << source_lines[p] << "." << endl;
+}
+
+
+void error(string message, int exc)
+// Non-fatal error detected. Provide stack dump.
+{
+    cerr << "*** Run-time error: " << message << endl;
+    cerr << "     At address: " << (program_counter - 1) << "." << endl;
+    report_source_line(program_counter - 1);
+    trace_stack(base_register, program_counter, top_of_stack);
+    cerr << endl << endl;
+    unwind(exc, program_counter, base_register, top_of_stack);
+    ;
+}
+
+
+void fatal_error(string message)
+// Fatal run-time error detected
+        {
+    cerr << "*** FATAL Run-time error: " << message << endl;
+    cerr << "     At address: " << (program_counter - 1) << "." << endl;
+    report_source_line(program_counter - 1);
+    trace_stack(base_register, program_counter, top_of_stack);
+    cerr << endl;
+    abort();
+}
+
+
+int base(int l)
+// Find base l levels down
+        {
+    if (l <= 0)
+        return base_register;
+    if (l <= display_depth)
+        return display[display_depth - l];
+    int lev { l };
+    int b1 = { base_register };
+    while (lev > 0) {
+        if (data_store[b1 - 4].is_int())
+            b1 = data_store[b1 - 4].get_int();
+        else
+            error("Static link is not an integer.");
+        lev--;
+    }
+    return b1;
+}
+
+
+void rebuild_display()
+// Set up the display for the current frame by walking its static links. If they do not lead back
+// to the main program the display is left unknown and base() walks the links itself.
+{
+    display_generation++;
+    display_depth = -1;
+    int depth { 0 };
+    for (int b = base_register; b != 0; depth++) {
+        if ((b < 4) or (b >= store_size) or !data_store[b - 4].is_int())
+            return;
+        int link = data_store[b - 4].get_int();
+        if ((link < 0) or (link >= b))
+            return;
+        b = link;
+    }
+    display_depth = depth - 1;
+    for (int b = base_register; b != 0; b = data_store[b - 4].get_int())
+        display[--depth] = b;
+}
+
+
+void display_call()
+// CAL has just set base_register to the base of a new frame. Its static link is normally one of the
+// frames in the display, so only the entry one level below that changes.
+{
+    if (data_store[base_register - 4].is_int()) {
+        int link = data_store[base_register - 4].get_int();
+        for (int depth = display_depth; depth >= 0; depth--) {
+            if (display[depth] == link) {
+                display_links[base_register] = { display[depth + 1], display_depth, display_generation };
+                display[depth + 1] = base_register;
+                display_depth = depth + 1;
+                return;
+            }
+        }
+    }
+    rebuild_display();
+}
+
+
+bool tail_call(int p)
+// CAL at p, with program_counter at p + 1, is about to be executed. If the loader has marked it as a
+// tail call and the caller's frame is not needed by the callee, move the frame MST and the arguments
+// have built over the caller's, keeping its return address and dynamic link, and enter the callee.
+{
+    if ((size_t(p) >= tail_call_at.size()) or !tail_call_at[p])
+        return false;
+    int arguments = code_store[p].l;
+    int frame = top_of_stack - arguments + 1;    // Base of the new frame
+    if ((frame - 4 <= base_register) or !data_store[frame - 4].is_int()
+            or (data_store[frame - 4].get_int() >= base_register))
+        return false;    // Malformed, or the callee is nested in the caller and uses its variables
+    for (int i = frame; i <= top_of_stack; i++)
+        if (data_store[i].is_int() and (data_store[i].get_int() >= base_register - 4)
+                and (data_store[i].get_int() <= top_of_stack))
+            return false;    // The argument may be the address of a variable in the caller's frame
+    data_store[base_register - 4] = data_store[frame - 4];
+    data_store[base_register - 1].set_int(0);
+    for (int i = 0; i < arguments; i++)
+        data_store[base_register + i] = data_store[frame + i];
+    top_of_stack = base_register + arguments - 1;
+    program_counter = code_store[p].a;
+    rebuild_display();    // The static link has changed
+    return true;
+}
+
+
+void display_return(int callee)
+// OPR 0 or OPR 1 has just returned from the frame based at callee to base_register.
+{
+    const display_link &link = display_links[callee];
+    if ((display_depth >= 0) and (display[display_depth] == callee)
+            and (link.generation == display_generation)) {
+        display[display_depth] = link.replaced;
+        display_depth = link.caller_depth;
+    } else {
+        rebuild_display();
+    }
+}
+
+
+void unwind(int exc, int lp, int lb, int &lt)
+// Exception exc has occurred. Look for an exception handler and discard stack frames
+// until one is found.
+// lp, lb, lt are the corresponding program counter, base and top of the target handler (if found).
+        {
+    while (true) {
+        if (debugging_pal_code) {
+            cout << "Unwinding" << endl;
+            trace_stack(lp, lb, lt);
+            cout << endl;
+        }
+        int handler = frame_handler(lp, lb);
+        if (handler != 0) {
+            if ((handler < 0) or (handler >= last_instruction))
+                fatal_error("Exception handler address is invalid");
+            // A valid handler has been found!
+            if (debugging_pal_code)
+                cout << "Exception handler found." << endl;
+            lp = handler;
+            break;
+        }
+        // No handler in this frame: discard it.
+        if (debugging_pal_code)
+            cout << "No handler in this frame." << endl;
+        lt = lb - 5;
+        lp = data_store[lt + 3].get_int();
+        lb = data_store[lt + 2].get_int();
+        if (lb == 0)
+            fatal_error("Exception never handled.");
+    }
+    top_of_stack = lt;
+    rebuild_display();
+    if (debugging_pal_code) {
+        cout << "Unwinding" << endl;
+        trace_stack(lp, lb, lt);
+    }
+}
+
+
+void build_handler_table()
+{
+    // Follow control through each procedure from its entry, where MST has cleared the handler, to
+    // find the handler in effect at each address. A return leaves the procedure and a call comes
+    // back to the next address, so only jumps and falling through are followed. The table can only
+    // be used if no address is reached with two different handlers, and control never leaves the
+    // code except by halting.
+    constexpr int unreached { INT_MIN };
+    handlers_tabled = false;
+    handler_at.assign(last_instruction + 1, unreached);
+    vector<pair<int, int>> reached { { 1, 0 } };    // Address and the handler in effect there
+    for (int p = 1; p <= last_instruction; p++)
+        if ((code_store[p].f == fun_CAL) and (code_store[p].a >= 1) and (code_store[p].a <= last_instruction))
+            reached.push_back({ code_store[p].a, 0 });
+    while (!reached.empty()) {
+        auto [p, handler] = reached.back();
+        reached.pop_back();
+        if ((p < 1) or (p > last_instruction))
+            return;
+        if (handler_at[p] != unreached) {
+            if (handler_at[p] != handler)
+                return;
+            continue;
+        }
+        handler_at[p] = handler;
+        const instruction &i = code_store[p];
+        switch (i.f) {
+        case fun_JMP:
+            if (i.a != 0)    // JMP 0 0 halts
+                reached.push_back({ i.a, handler });
+            break;
+        case fun_JIF:
+            reached.push_back({ i.a, handler });
+            reached.push_back({ p + 1, handler });
+            break;
+        case fun_REH:    // The handler belongs to the procedure that registers it.
+            if (i.a != 0)
+                reached.push_back({ i.a, i.a });
+            reached.push_back({ p + 1, i.a });
+            break;
+        case fun_OPR:
+            if ((i.a != 0) and (i.a != 1))
+                reached.push_back({ p + 1, handler });
+            break;
+        default:
+            reached.push_back({ p + 1, handler });
+            break;
+        }
+    }
+    for (int &handler : handler_at)
+        if (handler == unreached)
+            handler = 0;
+    handlers_tabled = true;
+}
+
+
+namespace {
+
+enum procedure_returns : uint8_t
+{
+    returns_procedure = 1,    // By OPR 0
+    returns_function = 2,     // By OPR 1
+    returns_unknown = 4       // Control can leave the code
+};
+
+struct procedure_body
+{
+    int entry;
+    vector<int> addresses;    // Reached from the entry
+    uint8_t returns { 0 };    // procedure_returns: how the procedure can end
+};
+
+bool calls_into_code(const instruction &i)
+{
+    return (i.f == fun_CAL) and (i.a >= 1) and (i.a <= last_instruction);
+}
+
+vector<procedure_body> find_procedures()
+// The main program (address 1) and each procedure called, in order of their entries. The body of
+// each is found by following control from its entry as build_handler_table() does: a return leaves
+// the procedure and a call comes back to the next address.
+{
+    vector<int> entries { 1 };
+    for (int p = 1; p <= last_instruction; p++)
+        if (calls_into_code(code_store[p]))
+            entries.push_back(code_store[p].a);
+    sort(entries.begin(), entries.end());
+    entries.erase(unique(entries.begin(), entries.end()), entries.end());
+
+    vector<procedure_body> procedures(entries.size());
+    vector<size_t> visited(last_instruction + 1, entries.size());    // Procedure last followed through each address
+    for (size_t e = 0; e < entries.size(); e++) {
+        procedure_body &body = procedures[e];
+        body.entry = entries[e];
+        vector<int> reached { body.entry };
+        while (!reached.empty()) {
+            int p = reached.back();
+            reached.pop_back();
+            if ((p < 1) or (p > last_instruction)) {
+                body.returns |= returns_unknown;
+                continue;
+            }
+            if (visited[p] == e)
+                continue;
+            visited[p] = e;
+            body.addresses.push_back(p);
+            const instruction &i = code_store[p];
+            switch (i.f) {
+            case fun_JMP:
+                if (i.a != 0)    // JMP 0 0 halts
+                    reached.push_back(i.a);
+                break;
+            case fun_JIF:
+            case fun_REH:
+                if (i.a != 0)
+                    reached.push_back(i.a);
+                reached.push_back(p + 1);
+                break;
+            case fun_OPR:
+                if (i.a == 0)
+                    body.returns |= returns_procedure;
+                else if (i.a == 1)
+                    body.returns |= returns_function;
+                else
+                    reached.push_back(p + 1);
+                break;
+            default:
+                reached.push_back(p + 1);
+                break;
+            }
+        }
+    }
+    return procedures;
+}
+
+size_t procedure_at(const vector<procedure_body> &procedures, int entry)
+// Index of the procedure with the given entry
+{
+    return size_t(lower_bound(procedures.begin(), procedures.end(), entry,
+            [](const procedure_body &body, int e) { return body.entry < e; }) - procedures.begin());
+}
+
+}
+
+void find_tail_calls()
+{
+    // A CAL followed by OPR 0 or OPR 1 can reuse the caller's frame if the callee only returns in
+    // the same way, so that the stack is left as two returns would leave it, and no handler is in
+    // effect in the caller or any frame below it. (Once unwind() finds a handler, the frame that
+    // raised the exception carries on and returns through the frames below it, which must be as
+    // they would have been.) So calls in procedures that can run while a handler is in effect,
+    // those called where one is and everything they call, are never tail calls.
+    tail_call_at.assign(last_instruction + 1, false);
+    if (!eliminating_tail_calls or !handlers_tabled)
+        return;
+    vector<procedure_body> procedures = find_procedures();
+
+    vector<bool> exposed(procedures.size(), false);    // Procedure can run while a handler is in effect
+    vector<size_t> exposing;
+    auto expose = [&](int entry) {
+        size_t e = procedure_at(procedures, entry);
+        if (!exposed[e]) {
+            exposed[e] = true;
+            exposing.push_back(e);
+        }
+    };
+    for (int p = 1; p <= last_instruction; p++)
+        if (calls_into_code(code_store[p]) and (handler_at[p] != 0))
+            expose(code_store[p].a);
+    while (!exposing.empty()) {
+        size_t e = exposing.back();
+        exposing.pop_back();
+        for (int p : procedures[e].addresses)
+            if (calls_into_code(code_store[p]))
+                expose(code_store[p].a);
+    }
+    vector<bool> safe(last_instruction + 1, true);    // No exposed procedure reaches the address
+    for (size_t e = 0; e < procedures.size(); e++)
+        if (exposed[e])
+            for (int p : procedures[e].addresses)
+                safe[p] = false;
+
+    for (int p = 1; p < last_instruction; p++) {
+        const instruction &next = code_store[p + 1];
+        if (!calls_into_code(code_store[p]) or !safe[p] or (handler_at[p] != 0) or (next.f != fun_OPR)
+                or ((next.a != 0) and (next.a != 1)))
+            continue;
+        uint8_t wanted = (next.a == 0) ? returns_procedure : returns_function;
+        tail_call_at[p] = ((procedures[procedure_at(procedures, code_store[p].a)].returns & ~wanted) == 0);
+    }
+}
+
+
+namespace {
+
+constexpr size_t problems_kept { 20 };    // Reasons for failing verification that are reported
+
+void stack_effect(const instruction &i, int &needs, int &change)
+// Cells the instruction takes from the stack, and the change in its depth (for CAL, once the callee
+// has returned by OPR 0)
+{
+    needs = 0;
+    change = 0;
+    switch (i.f) {
+    case fun_MST:
+        change = 4;
+        break;
+    case fun_CAL:
+        needs = i.l + 4;
+        change = -needs;
+        break;
+    case fun_INC:
+        needs = max(-i.a, 0);
+        change = i.a;
+        break;
+    case fun_LCI:
+    case fun_LCR:
+    case fun_LCS:
+    case fun_LDA:
+    case fun_LDV:
+    case fun_LDU:
+        change = 1;
+        break;
+    case fun_JIF:
+    case fun_LDI:
+        needs = 1;
+        break;
+    case fun_STI:
+        needs = 2;
+        change = -2;
+        break;
+    case fun_STO:
+        needs = 1;
+        change = -1;
+        break;
+    case fun_OPR:
+        switch (i.a) {
+        case 1: case 2: case 9: case 16: case 25: case 26: case 27: case 28: case 31:
+            needs = 1;
+            break;
+        case 3: case 4: case 5: case 6: case 7: case 8: case 10: case 11: case 12: case 13: case 14:
+        case 15: case 29: case 30:
+            needs = 2;
+            change = -1;
+            break;
+        case 17: case 18: case 19:
+            change = 1;
+            break;
+        case 20: case 24:
+            needs = 1;
+            change = -1;
+            break;
+        case 22:
+            needs = 2;
+            break;
+        case 23:
+            needs = 1;
+            change = 1;
+            break;
+        default:    // Returns, OPR 21 and undefined operations
+            break;
+        }
+        break;
+    default:    // JMP, RDI, RDR, SIG, REH and DBG
+        break;
+    }
+}
+
+}
+
+code_verification verification;
+
+void verify_code()
+{
+    // The depth of the stack is counted in cells from the base of the frame: 0 on entry to the main
+    // program, and the number of arguments on entry to a procedure. Each procedure is followed from
+    // its entry as find_procedures() does, and a call continues at the next address with the stack as
+    // the callee's return leaves it.
+    verification = code_verification();
+    auto problem = [](int p, const string &message) {
+        if (verification.problems.size() < problems_kept)
+            verification.problems.push_back("Address " + to_string(p) + ": " + message);
+        verification.problem_count++;
+    };
+
+    for (int p = 1; p <= last_instruction; p++) {
+        const instruction &i = code_store[p];
+        if (((i.f == fun_JMP) or (i.f == fun_JIF)) and ((i.a < 0) or (i.a > last_instruction)))
+            problem(p, "jump to " + to_string(i.a) + ", outside the code.");
+        else if ((i.f == fun_REH) and ((i.a < 0) or (i.a > last_instruction)))
+            problem(p, "handler at " + to_string(i.a) + ", outside the code.");
+        else if ((i.f == fun_CAL) and !calls_into_code(i))
+            problem(p, "call of " + to_string(i.a) + ", outside the code.");
+    }
+
+    vector<procedure_body> procedures = find_procedures();
+    vector<int> arguments(procedures.size(), -1);    // Depth of the stack on entry to each procedure
+    vector<int> caller(procedures.size(), 0);
+    arguments[0] = 0;
+    for (int p = 1; p <= last_instruction; p++) {
+        if (!calls_into_code(code_store[p]))
+            continue;
+        size_t e = procedure_at(procedures, code_store[p].a);
+        if (arguments[e] < 0) {
+            arguments[e] = code_store[p].l;
+            caller[e] = p;
+        } else if (arguments[e] != code_store[p].l) {
+            problem(p, "call of " + to_string(code_store[p].a) + " with " + to_string(code_store[p].l)
+                    + " arguments, but " + (caller[e] == 0 ? string("it is the main program")
+                            : "address " + to_string(caller[e]) + " gives it " + to_string(arguments[e])) + ".");
+        }
+    }
+
+    constexpr int unknown { INT_MIN };
+    vector<int> depth_at(last_instruction + 1, unknown);
+    vector<bool> reported(last_instruction + 1, false);    // Inconsistent depths at the address
+    for (size_t e = 0; e < procedures.size(); e++) {
+        int deepest = max(arguments[e], 0);
+        vector<pair<int, int>> reached { { procedures[e].entry, deepest } };    // Address and depth there
+        while (!reached.empty()) {
+            auto [p, depth] = reached.back();
+            reached.pop_back();
+            if (depth_at[p] != unknown) {
+                if ((depth_at[p] != depth) and !reported[p]) {
+                    reported[p] = true;
+                    problem(p, "reached with stack depths " + to_string(depth_at[p]) + " and "
+                            + to_string(depth) + ".");
+                }
+                continue;
+            }
+            depth_at[p] = depth;
+            const instruction &i = code_store[p];
+            int needs, change;
+            stack_effect(i, needs, change);
+            if (depth < needs) {
+                problem(p, funtostr(i.f) + " takes " + to_string(needs) + " cells from a stack of depth "
+                        + to_string(depth) + ".");
+                continue;
+            }
+            deepest = max(deepest, depth + change);
+            int next = depth + change;
+            switch (i.f) {
+            case fun_JMP:
+                if ((i.a > 0) and (i.a <= last_instruction))
+                    reached.push_back({ i.a, depth });
+                continue;
+            case fun_JIF:
+                if ((i.a > 0) and (i.a <= last_instruction))
+                    reached.push_back({ i.a, depth });
+                break;
+            case fun_CAL: {
+                uint8_t returns = calls_into_code(i) ? procedures[procedure_at(procedures, i.a)].returns : 0;
+                if (returns == returns_function)
+                    next++;
+                else if ((returns & returns_unknown) != 0)
+                    continue;    // Reported as a jump outside the code
+                else if (returns == (returns_procedure | returns_function))
+                    problem(p, "call of " + to_string(i.a) + ", which returns both with and without a value.");
+                if ((returns != returns_procedure) and (returns != returns_function))
+                    continue;    // The callee never returns, or how it does is not known
+                break;
+            }
+            case fun_OPR:
+                if ((i.a == 0) or (i.a == 1))
+                    continue;
+                break;
+            default:
+                break;
+            }
+            if (p == last_instruction)
+                problem(p, "control runs past the end of the code.");
+            else
+                reached.push_back({ p + 1, next });
+        }
+        verification.max_depths.push_back({ procedures[e].entry, deepest });
+    }
+    verification.passed = (verification.problem_count == 0);
+}
+
+void write_verification(ostream &out)
+{
+    out << "Verification " << (verification.passed ? "passed" : "failed") << ": " << last_instruction
+        << " instructions, " << verification.max_depths.size()
+        << (verification.max_depths.size() == 1 ? " procedure." : " procedures.") << endl;
+    for (const string &message : verification.problems)
+        out << "    " << message << endl;
+    if (verification.problem_count > static_cast<long long>(verification.problems.size()))
+        out << "    ... and " << verification.problem_count - verification.problems.size() << " more." << endl;
+    out << endl << "    Entry  Maximum stack depth" << endl;
+    for (auto [entry, depth] : verification.max_depths)
+        out << setw(9) << entry << setw(21) << depth << ((entry == 1) ? "    (main program)" : "") << endl;
+}
+
+
+namespace {
+
+volatile sig_atomic_t snapshot_requested { 0 };    // SIGUSR1 has arrived
+bool machine_restored { false };                   // restore_snapshot() has set up the next run
+
+void request_snapshot(int)
+{
+    snapshot_requested = 1;
+}
+
+}
+
+void snapshot_on_signal()
+{
+    snapshotting_on_signal = true;
+    signal(SIGUSR1, request_snapshot);
+}
+
+
+void reset_machine()
+// Initialise the registers and the activation record of the main program before a run.
+{
+    if (machine_restored) {    // Resume the snapshot instead
+        machine_restored = false;
+        return;
+    }
+
+    // initialize registers
+    top_of_stack = 4;
+    base_register = 5;
+    program_counter = 1;
+    instructions_executed = 0;
+
+    // set up the main program activation record
+    for (int i = 1; i <= 4; i++) {
+        data_store[i] = Memory_cell(0);
+    }
+    rebuild_display();
+}
+
+
+template<unsigned features>
+[[gnu::always_inline]] inline bool decode_and_execute()
+// Execute the single instruction at program_counter. This is the reference definition of every
+// instruction. It is inline so that the loops in this file do not pay for a call per instruction;
+// other engines use it through execute_instruction(). features says which instrumentation is
+// compiled in (see machine_feature). Returns true after a DBG instruction, which may require a
+// different instantiation of the loop.
+{
+    instruction_register = &code_store[program_counter]; // note the instruction we are about to execute
+    program_counter++;
+    instructions_executed++;
+
+    // large switch statement (ugly) to go through each instruction....
+    switch (instruction_register->f) {
+    case fun_MST:    // Mark the stack
+        data_store[top_of_stack + 1].set_int(base(instruction_register->l));
+        data_store[top_of_stack + 2].set_int(base_register);
+        data_store[top_of_stack + 3].set_int(0);
+        data_store[top_of_stack + 4].set_int(0);
+        top_of_stack = top_of_stack + 4;
+
+        break;
+    case fun_CAL:    // Procedure or function call
+        if (tail_call(program_counter - 1))
+            break;
+        base_register = top_of_stack - instruction_register->l + 1;
+        data_store[base_register - 2].set_int(program_counter);
+        program_counter = instruction_register->a;
+        display_call();
+        break;
+    case fun_INC:    // Increment top-of-stack pointer
+        if (instruction_register->a > 0)
+            for (int i = top_of_stack + 1;
+                    i <= top_of_stack + instruction_register->a;
+                    i++)
+                data_store[i].set_undef();
+        top_of_stack += instruction_register->a;
+        break;
+    case fun_JIF:    // Jump if false
+        if (data_store[top_of_stack].is_boolean()) {
+            if (!data_store[top_of_stack].get_boolean()) {
+                program_counter = instruction_register->a;
+                if ((program_counter < 0)
+                        || (program_counter > last_instruction))
+                    error("Attempt to jump outside code.");
+            }
+            // else nothing to do
+        } else
+            error("JIF - top of stack not a boolean.");
+        break;
+    case fun_JMP:    // Inconditinoal jump
+        program_counter = instruction_register->a;
+        if ((program_counter < 0) || (program_counter > last_instruction))
+            error("Attempt to jump outside code.");
+        break;
+    case fun_LCI:    // Load integer constant onto stack
+        top_of_stack++;
+        data_store[top_of_stack].set_int(instruction_register->a);
+        break;
+    case fun_LCR:    // Load real constant onto stack
+        top_of_stack++;
+        data_store[top_of_stack].set_real(
+                real_constants[instruction_register->a]);
+        break;
+    case fun_LCS:    // Load string literal onto stack
+        top_of_stack++;
+        data_store[top_of_stack].set_string(
+                string_constants[instruction_register->a]);
+        break;
+    case fun_LDA:  // Load the absolute address of a variable onto the stack
+        top_of_stack++;
+        data_store[top_of_stack].set_int(
+                base(instruction_register->l)
+                        + instruction_register->a);
+        break;
+    case fun_LDI: // Load the value stored at specifed address onto the stack
+        data_store[top_of_stack] =
+                data_store[data_store[top_of_stack].get_int()];
+        break;
+    case fun_LDV:    // Load the value of a variable onto the stack
+        top_of_stack++;
+        data_store[top_of_stack] = data_store[base(instruction_register->l)
+                + instruction_register->a];
+        break;
+    case fun_LDU:    // Load an undefined or void value
+        top_of_stack++;
+        data_store[top_of_stack].set_undef();
+        break;
+    case fun_RDI:    // Read a value into an integer variable
+    {
+        int temp = read_int();
+        data_store[base(instruction_register->l)
+                + instruction_register->a].set_int(temp);
+    }
+        break;
+    case fun_RDR:    // Read a value into a real variable
+    {
+        float temp = read_real();
+        data_store[base(instruction_register->l)
+                + instruction_register->a].set_real(temp);
+    }
+        break;
+    case fun_STI: // Load top-of-stack - 1 into a variable at address top-of-stack
+        data_store[data_store[top_of_stack].get_int()] =
+                data_store[top_of_stack - 1];
+        top_of_stack -= 2;
+        break;
+    case fun_STO:    // Store into a variable
+        data_store[base(instruction_register->l)
+                + instruction_register->a] =
+                data_store[top_of_stack];
+        top_of_stack--;
+        break;
+    case fun_SIG:    // Raise signal
+        if (instruction_register->a != 0)
+            pal_exception = instruction_register->a;
+        break;
+    case fun_REH:    // Register exeception handler
+        // unwind() finds the handler in handler_at if it can; listings still show it in the frame.
+        if (!handlers_tabled or debugging_pal_code)
+            data_store[base_register - 1].set_int(
+                    instruction_register->a);
+        break;
+    case fun_DBG:    // Turn debugging status on/off
+        debugging_pal_code = (instruction_register->a == 1);
+        return true;
+    case fun_OPR:    // Execute operation - there are 32 of them
+        // There are 32 operations that need to be handled
+        switch (instruction_register->a) {
+        case 0:    // procedure return
+            if ((features & feature_trace) and debugging_pal_code)
+                trace_stack(program_counter, base_register, top_of_stack);
+            top_of_stack = base_register - 5;
+            program_counter = data_store[top_of_stack + 3].get_int();
+            base_register = data_store[top_of_stack + 2].get_int();
+            display_return(top_of_stack + 5);
+            break;
+        case 1:     // function return
+            if ((features & feature_trace) and debugging_pal_code)
+                trace_stack(program_counter, base_register, top_of_stack);
+        {
+            Memory_cell temp;
+            temp = data_store[top_of_stack];
+            top_of_stack = base_register - 5;
+            program_counter = data_store[top_of_stack + 3].get_int();
+            base_register = data_store[top_of_stack + 2].get_int();
+            display_return(top_of_stack + 5);
+            data_store[++top_of_stack] = temp;
+        }
+            break;
+        case 2:    // negate
+            if (data_store[top_of_stack].is_real()) {
+                data_store[top_of_stack].set_real(
+                        -data_store[top_of_stack].get_real());
+            } else if (data_store[top_of_stack].is_int()) {
+                data_store[top_of_stack].set_int(
+                        -data_store[top_of_stack].get_int());
+            } else {
+                error("Cannot negate boolean or string value.");
+            }
+            break;
+        case 3:    // addition
+        case 4:    // subtraction
+        case 5:    // multiplication
+        case 6:    // division
+            // deal with all the mathematical operators at once.
+            top_of_stack--;
+            if (data_store[top_of_stack].get_type()
+                    != data_store[top_of_stack + 1].get_type()) {
+                error("Operands must be of the same type.");
+            } else {
+                switch (data_store[top_of_stack].get_type()) {
+                case Memory_cell::types_INT:
+                    switch (instruction_register->a) {
+                    case 3:        // addition
+                        data_store[top_of_stack].set_int(
+                                data_store[top_of_stack].get_int()
+                                        + data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 4:        // subtraction
+                        data_store[top_of_stack].set_int(
+                                data_store[top_of_stack].get_int()
+                                        - data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 5:        // multiplication
+                        data_store[top_of_stack].set_int(
+                                data_store[top_of_stack].get_int()
+                                        * data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 6:        // division
+                        if (data_store[top_of_stack + 1].get_int() != 0) {
+                            data_store[top_of_stack].set_int(
+                                    data_store[top_of_stack].get_int()
+                                            / data_store[top_of_stack + 1].get_int());
+                        } else {
+                            error("Divide by integer 0.");
+                        }
+                        break;
+                    default:    // should never be selected
+                        break;
+                    } // end switch
+                    break;
+                case Memory_cell::types_REAL:
+                    switch (instruction_register->a) {
+                    case 3:        // addition
+                        data_store[top_of_stack].set_real(
+                                data_store[top_of_stack].get_real()
+                                        + data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 4:        // subtraction
+                        data_store[top_of_stack].set_real(
+                                data_store[top_of_stack].get_real()
+                                        - data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 5:        // multiplication
+                        data_store[top_of_stack].set_real(
+                                data_store[top_of_stack].get_real()
+                                        * data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 6:        // division
+                        if (data_store[top_of_stack + 1].get_real()
+                                != 0.0) {
+                            data_store[top_of_stack].set_real(
+                                    data_store[top_of_stack].get_real()
+                                            / data_store[top_of_stack + 1].get_real());
+                        } else {
+                            error("Divide by floating point 0.0.");
+                        }
+                        break;
+                    default:    // should never be selected
+                        break;
+                    } // end switch
+                    break;
+                default:
+                    error("Operands must be integer or real");
+                    break;
+                } // end switch
+            } // end if
+            break;
+        case 7:    // exponentiation
+            top_of_stack--;
+            if (data_store[top_of_stack + 1].get_type()
+                    != Memory_cell::types_INT) {
+                error("Exponent must be an integer.");
+            } else {
+                switch (data_store[top_of_stack].get_type()) {
+                case Memory_cell::types_INT: {
+                    int temp;
+
+                    temp = data_store[top_of_stack].get_int();
+                    if (data_store[top_of_stack + 1].get_int() == 0) {
+                        temp = 1;
+                    } else {
+                        for (int j = 1;
+                                j
+                                        <= data_store[top_of_stack + 1].get_int()
+                                                - 1; j++) {
+                            temp *= data_store[top_of_stack].get_int();
+                        }
+                    }
+                    data_store[top_of_stack].set_int(temp);
+                }
+                    break;
+                case Memory_cell::types_REAL: {
+                    float temp;
+
+                    temp = data_store[top_of_stack].get_real();
+                    if (data_store[top_of_stack + 1].get_int() == 0) {
+                        temp = 1;
+                    } else {
+                        for (int j = 1;
+                                j
+                                        <= data_store[top_of_stack + 1].get_int()
+                                                - 1; j++) {
+                            temp *= data_store[top_of_stack].get_real();
+                        }
+                    }
+                    data_store[top_of_stack].set_real(temp);
+                }
+                    break;
+                default:
+                    error("Operand must be an integer or a floating point");
+                    break;
+                } // end switch
+            } // end if
+            break;
+        case 8:    // string concatenation
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_STRING) {
+                error(
+                        "String concatenation requires String on top of stack.");
+            } else if (data_store[top_of_stack - 1].get_type()
+                    != Memory_cell::types_STRING) {
+                error(
+                        "String concatenation requires String on top of stack - 1.");
+            } else {
+                data_store[top_of_stack - 1].concatenate(data_store[top_of_stack]);
+            }
+            top_of_stack--;
+            break;
+        case 9:    // odd
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_INT) {
+                error("Odd instruction expects integer value.");
+            } else {
+                data_store[top_of_stack].set_boolean(
+                        data_store[top_of_stack].get_int() % 2 == 1);
+            }
+            break;
+        case 10:    // =
+        case 11:    // !=
+        case 12:    // <
+        case 13:    // >=
+        case 14:    // >
+        case 15:    // <=        Handle comparators together
+            top_of_stack--;
+            if (data_store[top_of_stack].get_type()
+                    != data_store[top_of_stack + 1].get_type()) {
+                error("operands must be of the same type.");
+            } else {
+                switch (data_store[top_of_stack].get_type()) {
+                case Memory_cell::types_BOOLEAN:
+                    switch (instruction_register->a) {
+                    case 10:      // =
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        == data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    case 11:    // !=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        != data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    case 12:    // <
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        < data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    case 13:    // >=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        >= data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    case 14:    // >
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        > data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    case 15:    // <=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_boolean()
+                                        <= data_store[top_of_stack + 1].get_boolean());
+                        break;
+                    default:    // Should never be invoked
+                        break;
+                    }
+                    break;
+                case Memory_cell::types_INT:
+                    switch (instruction_register->a) {
+                    case 10:      // =
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        == data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 11:    // !=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        != data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 12:    // <
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        < data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 13:    // >=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        >= data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 14:    // >
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        > data_store[top_of_stack + 1].get_int());
+                        break;
+                    case 15:    // <=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_int()
+                                        <= data_store[top_of_stack + 1].get_int());
+                        break;
+                    default:    // Should never be invoked
+                        break;
+                    }
+                    break;
+                case Memory_cell::types_REAL:
+                    switch (instruction_register->a) {
+                    case 10:      // =
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        == data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 11:    // !=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        != data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 12:    // <
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        < data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 13:    // >=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        >= data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 14:    // >
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        > data_store[top_of_stack + 1].get_real());
+                        break;
+                    case 15:    // <=
+                        data_store[top_of_stack].set_boolean(
+                                data_store[top_of_stack].get_real()
+                                        <= data_store[top_of_stack + 1].get_real());
+                        break;
+                    default:    // Should never be invoked
+                        break;
+                    }
+                    break;
+                default:
+                    error(
+                            "Operands must in integer, floating point, or boolean.");
+                    break;
+                }
+            }
+            break;
+        case 16:     // logical complement (not)
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_BOOLEAN) {
+                error(
+                        "not operation expects boolean value on top of stack.");
+            } else {
+                data_store[top_of_stack].set_boolean(
+                        !data_store[top_of_stack].get_boolean());
+            }
+            break;
+        case 17:    // true
+            top_of_stack++;
+            data_store[top_of_stack].set_boolean(true);
+            break;
+        case 18:    // false
+            top_of_stack++;
+            data_store[top_of_stack].set_boolean(false);
+            break;
+        case 19:    // eof
+            top_of_stack++;
+            data_store[top_of_stack].set_boolean(input_ended());
+            break;
+        case 20: // write the integer ! float ! string of top of stack to output
+            if (!write_value(data_store[top_of_stack]))
+                error("Can only write integer, floating point, and string values.");
+            top_of_stack--;
+            break;
+        case 21:    // terminate the current line of output
+            write_newline();
+            break;
+        case 22:     // swap the top two elements on the stack
+        {
+            Memory_cell temp;
+            temp = data_store[top_of_stack];
+            data_store[top_of_stack] = data_store[top_of_stack - 1];
+            data_store[top_of_stack - 1] = temp;
+        }
+            break;
+        case 23:    // duplicate the element on the top of the stack
+            top_of_stack++;
+            data_store[top_of_stack] = data_store[top_of_stack - 1];
+            break;
+        case 24:    // drop the element on th etop of the stack
+            top_of_stack--;
+            break;
+        case 25:    // integer-to-real conversion
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_INT) {
+                error(
+                        "int-to-real conversion expects integer on top of stack.");
+            } else {
+                data_store[top_of_stack].set_real(
+                        float(data_store[top_of_stack].get_int()));
+            }
+            break;
+        case 26:    // real-to-integer conversion
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_REAL) {
+                error(
+                        "real-to_int conversion expects real number on top of stack.");
+            } else {
+                data_store[top_of_stack].set_int(
+                        int(data_store[top_of_stack].get_real()));
+            }
+            break;
+        case 27:    // integer-to-string conversion
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_INT) {
+                error(
+                        "int-to-string conversion expects integer on top of stack.");
+            } else {
+                data_store[top_of_stack].set_string(
+                        to_string(data_store[top_of_stack].get_int()));
+            }
+            break;
+        case 28:    // real-to-string conversion
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_REAL) {
+                error(
+                        "real-to-string conversion expects integer on top of stack.");
+            } else {
+                data_store[top_of_stack].set_string(
+                        to_string(data_store[top_of_stack].get_real()));
+            }
+            break;
+        case 29:    // logical and
+            if ((data_store[top_of_stack].get_type()
+                    != Memory_cell::types_BOOLEAN)
+                    && data_store[top_of_stack - 1].get_type()
+                            != Memory_cell::types_BOOLEAN) {
+                error(
+                        "Logical and expects boolean values at top of stack, and top of stack-1");
+            } else {
+                data_store[top_of_stack - 1].set_boolean(
+                        data_store[top_of_stack - 1].get_boolean()
+                                && data_store[top_of_stack].get_boolean());
+                top_of_stack--;
+            }
+            break;
+        case 30:    // logical or
+            if ((data_store[top_of_stack].get_type()
+                    != Memory_cell::types_BOOLEAN)
+                    && data_store[top_of_stack - 1].get_type()
+                            != Memory_cell::types_BOOLEAN) {
+                error(
+                        "Logical or expects boolean values at top of stack, and top of stack-1");
+            } else {
+                data_store[top_of_stack - 1].set_boolean(
+                        data_store[top_of_stack - 1].get_boolean()
+                                || data_store[top_of_stack].get_boolean());
+                top_of_stack--;
+            }
+            break;
+        case 31:    // is(exception)
+            if (data_store[top_of_stack].get_type()
+                    != Memory_cell::types_INT) {
+                error(
+                        "is operations expects an integer value on top of stack");
+            } else {
+                data_store[top_of_stack].set_boolean(
+                        data_store[top_of_stack].get_int()
+                                == pal_exception);
+            }
+            break;
+        default: // should not be called since all cases have been enumerated
+            break;
+        }
+        break;
+    default:    // Should not occur. All possible cases are identified above
+        break;
+    }
+    return false;
+}
+
+
+void execute_instruction()
+// Execute the instruction at program_counter. Used by the engines that fall back on the reference
+// implementation for anything they do not handle themselves.
+{
+    decode_and_execute<feature_trace>();
+}
+
+
+void step_instruction()
+// Execute the instruction at program_counter, listing it first if required.
+{
+    if (debugging_pal_code)
+        trace_instruction(program_counter);
+    decode_and_execute<feature_trace>();
+    if (debugging_pal_code)
+        trace_stack(program_counter, base_register, top_of_stack);
+}
+
+
+void check_bounds()
+// Stop the program if the program counter or the stack have left their stores.
+{
+    if ((program_counter < 1) or (program_counter > last_instruction))
+        fatal_error("Program counter is outside the code store.");
+    if ((top_of_stack < 0) or (top_of_stack >= store_size - 5))
+        fatal_error("Stack is outside the data store.");
+}
+
+
+namespace {
+
+struct call_frame    // A procedure being executed, while tracking calls
+{
+    int entry;
+    int base;                           // base_register in the procedure
+    int call_site;                      // Address of the CAL that entered it
+    long long instructions_at_entry;    // instructions_executed when it was entered
+    long long nanoseconds_at_entry;     // run_nanoseconds when it was entered
+};
+
+vector<call_frame> call_frames;         // The main program's frame, then one per active call
+long long run_nanoseconds { 0 };        // Time taken by the run so far, if timing calls
+chrono::steady_clock::time_point last_instruction_time;
+
+void leave_frame()
+// Pop the frame on top of call_frames, and charge the call to its arc.
+{
+    const call_frame &callee = call_frames.back();
+    call_arc &arc = calls_made.arcs[{ call_frames[call_frames.size() - 2].entry, callee.call_site, callee.entry }];
+    arc.calls++;
+    arc.instructions += instructions_executed - callee.instructions_at_entry;
+    arc.nanoseconds += run_nanoseconds - callee.nanoseconds_at_entry;
+    call_frames.pop_back();
+}
+
+void track_call(int p)
+// Note the procedure in which the instruction at p was executed, then push the frame a CAL entered or
+// pop those that have been left.
+{
+    if (call_frames.empty())    // The first instruction of the run; the main program is never left
+        call_frames.push_back({ 1, 0, 0, 0, 0 });
+    if (calls_made.timing) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        long long elapsed = chrono::duration_cast<chrono::nanoseconds>(now - last_instruction_time).count();
+        last_instruction_time = now;
+        run_nanoseconds += elapsed;
+        if ((p >= 0) and (p < int(calls_made.nanoseconds.size())))
+            calls_made.nanoseconds[p] += elapsed;
+    }
+    if ((p >= 0) and (p < int(calls_made.procedures.size())))
+        calls_made.procedures[p] = call_frames.back().entry;
+    if ((code_store[p].f == fun_CAL) and (program_counter == code_store[p].a)) {
+        while ((call_frames.size() > 1) and (call_frames.back().base >= base_register))
+            leave_frame();    // A tail call has reused the caller's frame
+        call_frames.push_back({ program_counter, base_register, p, instructions_executed, run_nanoseconds });
+    } else {
+        while ((call_frames.size() > 1) and (call_frames.back().base > base_register))
+            leave_frame();
+    }
+}
+
+}
+
+void start_call_tracking(bool timing)
+{
+    tracking_calls = true;
+    calls_made = call_graph();
+    calls_made.procedures.assign(last_instruction + 2, 0);
+    calls_made.timing = timing;
+    if (timing)
+        calls_made.nanoseconds.assign(last_instruction + 2, 0);
+    call_frames.clear();
+    run_nanoseconds = 0;
+    last_instruction_time = chrono::steady_clock::now();
+}
+
+void finish_call_tracking()
+{
+    while (call_frames.size() > 1)
+        leave_frame();
+    tracking_calls = false;
+}
+
+
+namespace {
+
+palt_header *trace_header { nullptr };    // The mapped trace file, while recording
+palt_event *trace_events { nullptr };     // Its ring of events
+uint64_t trace_mask { 0 };                // capacity - 1
+size_t trace_bytes { 0 };                 // Size of the mapping
+
+inline void record_event(int p)
+// Record the instruction at p, which has just been executed, in the next slot of the ring.
+{
+    uint64_t n = trace_header->events;
+    palt_event &event = trace_events[n & trace_mask];
+    event.address = p;
+    event.a = code_store[p].a;
+    event.base = base_register;
+    event.top = top_of_stack;
+    event.f = code_store[p].f;
+    event.l = code_store[p].l;
+    Memory_cell &top = data_store[max(top_of_stack, 0)];
+    event.type = top.get_type();
+    switch (top.get_type()) {
+    case Memory_cell::types_BOOLEAN:
+        event.value = top.get_boolean();
+        break;
+    case Memory_cell::types_INT:
+        event.value = uint32_t(top.get_int());
+        break;
+    case Memory_cell::types_REAL:
+        event.value = bit_cast<uint32_t>(top.get_real());
+        break;
+    default:    // A string is only a handle into the string heap, which the trace does not keep.
+        event.value = 0;
+        break;
+    }
+    trace_header->events = n + 1;
+}
+
+}
+
+void start_trace(const string &file_name, uint32_t capacity)
+{
+    trace_bytes = sizeof(palt_header) + size_t(capacity) * sizeof(palt_event);
+    int fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw "Cannot create trace file " + file_name + ".";
+    if (ftruncate(fd, trace_bytes) != 0) {
+        close(fd);
+        throw "Cannot extend trace file " + file_name + ".";
+    }
+    void *mapping = mmap(nullptr, trace_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw "Cannot map trace file " + file_name + ".";
+    trace_header = static_cast<palt_header *>(mapping);
+    memcpy(trace_header->magic, palt_magic, sizeof(palt_magic));
+    trace_header->version = palt_version;
+    trace_header->capacity = capacity;
+    trace_header->events = 0;
+    trace_events = reinterpret_cast<palt_event *>(trace_header + 1);
+    trace_mask = capacity - 1;
+    recording_trace = true;
+}
+
+void stop_trace()
+{
+    if (trace_header != nullptr)
+        munmap(trace_header, trace_bytes);
+    trace_header = nullptr;
+    trace_events = nullptr;
+    recording_trace = false;
+}
+
+
+namespace {
+
+void take_snapshot()
+// The reference engine has reached snapshot_address, or SIGUSR1 has asked for a snapshot.
+{
+    if (program_counter == snapshot_address)
+        snapshot_address = 0;    // Only the first time it is reached
+    snapshot_requested = 0;
+    try {
+        write_snapshot(snapshot_file_name);
+        snapshots_written++;
+    } catch (const string &message) {
+        cerr << "*** " << message << endl;
+    }
+}
+
+}
+
+
+template<unsigned features, unsigned feature>
+[[gnu::always_inline]] inline bool in_use(unsigned on)
+// Is feature in use in the loop for features? Only the loop for feature_all needs to look at on.
+{
+    if constexpr ((features & feature) == 0)
+        return false;
+    else if constexpr (features != feature_all)
+        return true;
+    else
+        return (on & feature) != 0;
+}
+
+
+template<unsigned features>
+void run_code(unsigned on)
+// Execute instructions until the program halts or a DBG instruction has been executed. features
+// names the instrumentation compiled in and on that in use (see execute_code()).
+{
+    do {
+        if (in_use<features, feature_budget>(on)) {
+            if (instructions_executed >= instruction_budget) {
+                cerr << "*** Instruction budget of " << instruction_budget << " exhausted at address "
+                        << program_counter << "." << endl;
+                program_counter = 0;
+                return;
+            }
+        }
+        if (in_use<features, feature_bounds>(on))
+            check_bounds();
+        if (in_use<features, feature_snapshot>(on))
+            if ((program_counter == snapshot_address) or (snapshot_requested != 0))
+                take_snapshot();
+        if (in_use<features, feature_profile>(on))
+            address_counts[program_counter]++;
+        if (in_use<features, feature_trace>(on))
+            trace_instruction(program_counter);
+        int p = program_counter;
+        bool dbg = decode_and_execute<features>();
+        if (in_use<features, feature_calls>(on))
+            track_call(p);
+        if (in_use<features, feature_record>(on))
+            record_event(p);
+        if (in_use<features, feature_trace>(on))
+            if (debugging_pal_code)
+                trace_stack(program_counter, base_register, top_of_stack);
+        if (dbg)
+            return;
+    } while (program_counter != 0);
+}
+
+
+unsigned machine_features()
+// The instrumentation currently asked for
+{
+    return (debugging_pal_code ? feature_trace : 0) | (profiling_pal_code ? feature_profile : 0)
+            | ((instruction_budget > 0) ? feature_budget : 0) | (checking_bounds ? feature_bounds : 0)
+            | (tracking_calls ? feature_calls : 0) | (recording_trace ? feature_record : 0)
+            | (((snapshot_address != 0) or snapshotting_on_signal) ? feature_snapshot : 0);
+}
+
+
+void execute_code() {
+    reset_machine();
+    bool listing { debugging_pal_code };
+    while (program_counter != 0) {    // ready to start executing the PAL code
+        // A DBG instruction that starts a listing was executed without it; list the stack after it.
+        if (debugging_pal_code and !listing)
+            trace_stack(program_counter, base_register, top_of_stack);
+        listing = debugging_pal_code;
+        // Running without instrumentation, and with any one flag alone, have loops of their own.
+        // A combination of flags runs the loop for feature_all, which tests them.
+        unsigned on = machine_features();
+        switch (on) {
+        case 0:
+            run_code<0>(on);
+            break;
+        case feature_trace:
+            run_code<feature_trace>(on);
+            break;
+        case feature_profile:
+            run_code<feature_profile>(on);
+            break;
+        case feature_budget:
+            run_code<feature_budget>(on);
+            break;
+        case feature_bounds:
+            run_code<feature_bounds>(on);
+            break;
+        case feature_calls:
+            run_code<feature_calls>(on);
+            break;
+        case feature_record:
+            run_code<feature_record>(on);
+            break;
+        case feature_snapshot:
+            run_code<feature_snapshot>(on);
+            break;
+        default:
+            run_code<feature_all>(on);
+            break;
+        }
+    }
+}
+
+
+namespace {
+
+// The loader reads a code file in one pass over a mapping of it. Lines, tokens and string literals
+// are string_views into the mapping, numbers are converted in place with from_chars, and function
+// codes are found with a perfect hash, so nothing is allocated except the constants kept.
+
+struct opcode_slot    // A slot of the opcode table
+{
+    char name[4];       // Mnemonic, or "" for an empty slot
+    fun_code f;
+};
+
+constexpr opcode_slot mnemonics[] {
+    { "MST", fun_MST }, { "CAL", fun_CAL }, { "INC", fun_INC }, { "JIF", fun_JIF },
+    { "JMP", fun_JMP }, { "LCI", fun_LCI }, { "LCR", fun_LCR }, { "LCS", fun_LCS },
+    { "LDA", fun_LDA }, { "LDI", fun_LDI }, { "LDV", fun_LDV }, { "LDU", fun_LDU },
+    { "OPR", fun_OPR }, { "RDI", fun_RDI }, { "RDR", fun_RDR }, { "STI", fun_STI },
+    { "STO", fun_STO }, { "SIG", fun_SIG }, { "REH", fun_REH }, { "DBG", fun_DBG }
+};
+
+constexpr unsigned opcode_hash(char c0, char c1, char c2)
+// Hash of a three letter mnemonic. Only the low five bits of each letter are used, so the hash
+// ignores case.
+{
+    return ((c0 & 31) * 24 + (c1 & 31) * 12 + (c2 & 31)) & 31;
+}
+
+constexpr array<opcode_slot, 32> make_opcode_table()
+{
+    array<opcode_slot, 32> table {};
+    for (const opcode_slot &m : mnemonics)
+        table[opcode_hash(m.name[0], m.name[1], m.name[2])] = m;
+    return table;
+}
+
+constexpr array<opcode_slot, 32> opcode_table { make_opcode_table() };
+
+constexpr bool opcode_hash_is_perfect()
+{
+    for (const opcode_slot &m : mnemonics) {
+        const opcode_slot &slot = opcode_table[opcode_hash(m.name[0], m.name[1], m.name[2])];
+        if (slot.f != m.f)
+            return false;
+    }
+    return true;
+}
+
+static_assert(opcode_hash_is_perfect(), "two mnemonics share a slot of the opcode table");
+
+string_view next_token(string_view line, size_t &pos)
+// The token at or after pos; pos is left just after it.
+{
+    while ((pos < line.size()) and is_space(line[pos]))
+        pos++;
+    size_t start = pos;
+    while ((pos < line.size()) and !is_space(line[pos]))
+        pos++;
+    return line.substr(start, pos - start);
+}
+
+fun_code mnemonic_code(string_view token)
+// Function code named by token, in either case
+{
+    if (token.size() == 3) {
+        const opcode_slot &slot = opcode_table[opcode_hash(token[0], token[1], token[2])];
+        if ((slot.name[0] == toupper(token[0])) and (slot.name[1] == toupper(token[1]))
+                and (slot.name[2] == toupper(token[2])))
+            return slot.f;
+    }
+    string name { token };
+    for (auto &c : name)
+        c = toupper(c);
+    throw("Illegal instruction: " + name);
+}
+
+template<typename T>
+T number(string_view token, string_view line)
+// The number at the start of token. As with stoi and stof, a leading + is allowed and anything
+// after the number is ignored.
+{
+    const char *first = token.data();
+    const char *last = token.data() + token.size();
+    if ((first != last) and (*first == '+'))
+        first++;
+    T value {};
+    auto [end, fault] = from_chars(first, last, value);
+    if ((fault != errc()) or (end == first))
+        throw("Malformed number: " + string(line));
+    return value;
+}
+
+void load_instruction(string_view line, int top)
+// Decode line into code_store[top].
+{
+    // Every PAL instruction has 3 fields followed by comments. Comments are ignored.
+    size_t pos { 0 };
+    string_view code = next_token(line, pos);
+    string_view level = next_token(line, pos);
+    size_t operand_start = pos;
+    string_view operand = next_token(line, pos);
+    if (operand.empty())
+        throw("Instruction malformed: " + string(line));
+
+    fun_code instr = mnemonic_code(code);
+    int lev_diff = number<int>(level, line);
+    if ((lev_diff < INT16_MIN) or (lev_diff > INT16_MAX))
+        throw("Level difference out of range: " + string(line));
+    if (top >= code_size)
+        throw string("Too many instructions. Code store full.");
+    code_store[top].f = instr;            // Set function code field
+    code_store[top].l = lev_diff;       // Set level difference field
+
+    // Third field is dependent on the instruction.
+    if (instr == fun_LCR) {
+        // Reals are held in a side table; the instruction records the index.
+        real_constants.push_back(number<float>(operand, line));
+        code_store[top].a = real_constants.size() - 1;
+    } else if (instr == fun_LCS) {
+        // The string runs from the quote that starts the third field to the next quote, and may
+        // contain spaces. It must be closed, and must not be empty.
+        size_t open = line.find_first_not_of(" \t\n\v\f\r", operand_start);
+        if (line[open] != '\'')
+            throw("Malformed string: " + string(line));
+        size_t close = line.find('\'', open + 1);
+        if ((close == string_view::npos) or (close == open + 1))
+            throw("Malformed string: " + string(line));
+        string_constants.emplace_back(line.substr(open + 1, close - open - 1));
+        code_store[top].a = string_constants.size() - 1;
+    } else {
+        // Set address or integer constant field
+        code_store[top].a = number<int>(operand, line);
+    }
+}
+
+}
+
+void load(const string &file_name)
+// Load the text code file file_name into code_store. Each line holds one instruction.
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat status;
+    if ((fd < 0) or (fstat(fd, &status) != 0)) {
+        cerr << "EXCEPTION: Cannot open code file " << file_name << "." << endl;
+        abort();
+    }
+    size_t size = size_t(status.st_size);
+    void *mapping = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        cerr << "EXCEPTION: Cannot map code file " << file_name << "." << endl;
+        abort();
+    }
+    string_view text(static_cast<const char *>(mapping), size);
+
+    real_constants.clear();
+    string_constants.clear();
+    source_lines.clear();
+    int top { 0 };    // The cell in the code store being populated
+    for (size_t start = 0; start < text.size();) {
+        size_t end = text.find('\n', start);
+        if (end == string_view::npos)
+            end = text.size();
+        string_view line = text.substr(start, end - start);
+        start = end + 1;
+        top++;
+
+        // line must adhere to a strict structure otherwise raise an exception and abort
+        try {
+            if (debugging_pal_code)
+                cout << top << ":    " << line << endl;
+            load_instruction(line, top);
+        } catch (string & msg) {
+            cerr << "EXCEPTION (instruction " << top << "): " << msg << endl;
+            abort();
+        }
+    }
+    last_instruction = top;
+    if (mapping != nullptr)
+        munmap(mapping, size);
+    build_handler_table();
+    find_tail_calls();
+    verify_code();
+}
+
+
+bool is_object_file(const string &file_name)
+// Does the file start as a PAL object file does?
+{
+    ifstream file(file_name, ios::binary);
+    char magic[sizeof(palb_magic)] { };
+    file.read(magic, sizeof(magic));
+    return file and (memcmp(magic, palb_magic, sizeof(magic)) == 0);
+}
+
+
+void load_object(const string &file_name)
+// Load a PAL object file (see pal_object.h) into code_store. The file is mapped rather than read,
+// and the instructions are copied into the code store as they stand; only the operands that index
+// the constant tables need to be checked. Throws a message if the file is not a valid object file.
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat status;
+    if ((fd < 0) or (fstat(fd, &status) != 0))
+        throw "Cannot open object file " + file_name + ".";
+    size_t size = size_t(status.st_size);
+    void *mapping = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw "Cannot map object file " + file_name + ".";
+    const char *file = static_cast<const char *>(mapping);
+
+    try {
+        palb_header header;
+        if (size < sizeof(header))
+            throw string("Object file too short for its header.");
+        memcpy(&header, file, sizeof(header));
+        if (memcmp(header.magic, palb_magic, sizeof(palb_magic)) != 0)
+            throw string("Not a PAL object file.");
+        if (header.version != palb_version)
+            throw "Object file version " + to_string(header.version) + " is not supported (expected "
+                    + to_string(palb_version) + ").";
+        if (header.instruction_count >= uint32_t(code_size))
+            throw string("Too many instructions. Code store full.");
+        if ((header.line_count != 0) and (header.line_count != header.instruction_count))
+            throw string("Line table does not match the instructions.");
+        auto check_section = [size](uint64_t offset, uint64_t bytes, const char *name) {
+            if ((bytes > 0) and ((offset > size) or (bytes > size - offset)))
+                throw string(name) + " section extends beyond the end of the object file.";
+        };
+        check_section(header.instruction_offset, uint64_t(header.instruction_count) * sizeof(palb_instruction), "Instruction");
+        check_section(header.real_offset, uint64_t(header.real_count) * sizeof(float), "Real constant");
+        check_section(header.string_offset, uint64_t(header.string_count) * sizeof(palb_string), "String constant");
+        check_section(header.character_offset, header.character_bytes, "Character");
+        check_section(header.line_offset, uint64_t(header.line_count) * sizeof(uint32_t), "Line table");
+
+        static_assert(sizeof(instruction) == sizeof(palb_instruction), "object file instructions are copied as they stand");
+        memcpy(&code_store[1], file + header.instruction_offset, header.instruction_count * sizeof(instruction));
+        for (uint32_t p = 1; p <= header.instruction_count; p++) {
+            instruction &ins = code_store[p];
+            if (ins.f > fun_DBG)
+                throw "Illegal function code " + to_string(int(ins.f)) + " at address " + to_string(p) + ".";
+            ins.fused = fused_none;
+            if (((ins.f == fun_LCR) and (uint32_t(ins.a) >= header.real_count))
+                    or ((ins.f == fun_LCS) and (uint32_t(ins.a) >= header.string_count)))
+                throw "Constant index out of range at address " + to_string(p) + ".";
+        }
+
+        real_constants.resize(header.real_count);
+        memcpy(real_constants.data(), file + header.real_offset, header.real_count * sizeof(float));
+
+        string_constants.clear();
+        string_constants.reserve(header.string_count);
+        const char *characters = file + header.character_offset;
+        for (uint32_t i = 0; i < header.string_count; i++) {
+            palb_string entry;
+            memcpy(&entry, file + header.string_offset + i * sizeof(palb_string), sizeof(entry));
+            if ((entry.offset > header.character_bytes) or (entry.length > header.character_bytes - entry.offset))
+                throw "String constant " + to_string(i) + " extends beyond the characters section.";
+            string_constants.emplace_back(characters + entry.offset, entry.length);
+        }
+
+        source_lines.assign(header.line_count + 1, 0);
+        if (header.line_count > 0)
+            memcpy(&source_lines[1], file + header.line_offset, header.line_count * sizeof(uint32_t));
+
+        last_instruction = int(header.instruction_count);
+        if (debugging_pal_code)
+            for (int p = 1; p <= last_instruction; p++)
+                cout << p << ":    " << insttostr(code_store[p]) << endl;
+    } catch (...) {
+        munmap(mapping, size);
+        throw;
+    }
+    munmap(mapping, size);
+    build_handler_table();
+    find_tail_calls();
+    verify_code();
+}
+
+
+void write_object(const string &file_name)
+// Write the program in code_store as a PAL object file. The code store must not have been fused.
+{
+    palb_header header {};
+    memcpy(header.magic, palb_magic, sizeof(palb_magic));
+    header.version = palb_version;
+    header.instruction_count = uint32_t(last_instruction);
+    header.real_count = uint32_t(real_constants.size());
+    header.string_count = uint32_t(string_constants.size());
+    header.line_count = (int(source_lines.size()) == last_instruction + 1) ? uint32_t(last_instruction) : 0;
+
+    vector<palb_string> strings;
+    string characters;
+    for (const string &constant : string_constants) {
+        strings.push_back({ uint32_t(characters.size()), uint32_t(constant.size()) });
+        characters += constant;
+    }
+
+    // Each section starts on an 8 byte boundary.
+    auto place = [](uint64_t &offset, uint64_t bytes) {
+        uint64_t start = offset;
+        offset = (offset + bytes + 7) / 8 * 8;
+        return start;
+    };
+    uint64_t offset { sizeof(header) };
+    header.instruction_offset = place(offset, uint64_t(header.instruction_count) * sizeof(palb_instruction));
+    header.real_offset = place(offset, uint64_t(header.real_count) * sizeof(float));
+    header.string_offset = place(offset, uint64_t(header.string_count) * sizeof(palb_string));
+    header.character_bytes = characters.size();
+    header.character_offset = place(offset, header.character_bytes);
+    header.line_offset = place(offset, uint64_t(header.line_count) * sizeof(uint32_t));
+
+    ofstream file(file_name, ios::binary | ios::trunc);
+    if (!file)
+        throw "Cannot write object file " + file_name + ".";
+    auto write_at = [&file](uint64_t offset, const void *data, uint64_t bytes) {
+        while (uint64_t(file.tellp()) < offset)
+            file.put(0);
+        file.write(static_cast<const char *>(data), bytes);
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.instruction_offset, &code_store[1], header.instruction_count * sizeof(palb_instruction));
+    write_at(header.real_offset, real_constants.data(), header.real_count * sizeof(float));
+    write_at(header.string_offset, strings.data(), header.string_count * sizeof(palb_string));
+    write_at(header.character_offset, characters.data(), header.character_bytes);
+    if (header.line_count > 0)
+        write_at(header.line_offset, &source_lines[1], header.line_count * sizeof(uint32_t));
+    if (!file)
+        throw "Cannot write object file " + file_name + ".";
+}
+
+namespace {
+
+uint64_t page_aligned(uint64_t bytes)
+{
+    uint64_t page = uint64_t(sysconf(_SC_PAGESIZE));
+    return (bytes + page - 1) / page * page;
+}
+
+int cells_in_use()
+// One more than the last cell of the data store that is not undefined, and at least top_of_stack + 1.
+// Pages of the store never written are not resident, so only the resident pages are searched.
+{
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t pages = page_aligned(store_size * sizeof(Memory_cell)) / page;
+    vector<unsigned char> resident(pages);
+    int floor = max(top_of_stack, 0) + 1;
+    int last = store_size;
+    if (mincore(data_store, pages * page, resident.data()) == 0) {
+        size_t p = pages;
+        while ((p > 0) and ((resident[p - 1] & 1) == 0))
+            p--;
+        last = int(min<size_t>(p * page / sizeof(Memory_cell), store_size));
+    }
+    while ((last > floor) and (data_store[last - 1].get_type() == Memory_cell::types_UNDEF))
+        last--;
+    return max(last, floor);
+}
+
+}
+
+void write_snapshot(const string &file_name)
+// Write the state of the machine to a temporary file, then rename it, so that the snapshot already
+// there is only replaced by a complete one.
+{
+    cout.flush();
+    pals_header header {};
+    memcpy(header.magic, pals_magic, sizeof(pals_magic));
+    header.version = pals_version;
+    header.program_counter = program_counter;
+    header.base_register = base_register;
+    header.top_of_stack = max(top_of_stack, 0);
+    header.cell_count = uint32_t(cells_in_use());
+    header.pal_exception = pal_exception;
+    header.instruction_count = uint32_t(last_instruction);
+    header.real_count = uint32_t(real_constants.size());
+    header.string_count = uint32_t(string_constants.size());
+    header.line_count = (int(source_lines.size()) == last_instruction + 1) ? uint32_t(last_instruction) : 0;
+    header.flags = (debugging_pal_code ? pals_listing : 0) | (input.ended ? pals_input_ended : 0)
+            | (input.failed ? pals_input_failed : 0);
+    header.instructions_executed = uint64_t(instructions_executed);
+    header.input_position = input_position();
+    header.page_size = uint64_t(sysconf(_SC_PAGESIZE));
+
+    string temporary_name = file_name + ".tmp";
+    ofstream file(temporary_name, ios::binary | ios::trunc);
+    if (!file)
+        throw "Cannot write snapshot " + file_name + ".";
+    auto pad_to = [&file](uint64_t offset) {
+        static const char zeros[4096] { };
+        for (uint64_t at = file.tellp(); at < offset; at = file.tellp())
+            file.write(zeros, min<uint64_t>(offset - at, sizeof(zeros)));
+        return offset;
+    };
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    header.code_offset = pad_to(page_aligned(file.tellp()));
+    for (int p = 0; p <= last_instruction; p++) {
+        palb_instruction i { uint8_t(code_store[p].f), 0, code_store[p].l, code_store[p].a };
+        file.write(reinterpret_cast<const char *>(&i), sizeof(i));
+    }
+    header.data_offset = pad_to(page_aligned(file.tellp()));
+    vector<string> cell_strings;
+    Memory_cell::save_cells(file, data_store, header.cell_count, cell_strings);
+    header.cell_string_count = uint32_t(cell_strings.size());
+
+    header.real_offset = pad_to(page_aligned(file.tellp()));
+    file.write(reinterpret_cast<const char *>(real_constants.data()), real_constants.size() * sizeof(float));
+    vector<palb_string> strings;
+    string characters;
+    for (const vector<string> *table : { &string_constants, &cell_strings }) {
+        for (const string &s : *table) {
+            strings.push_back({ uint32_t(characters.size()), uint32_t(s.size()) });
+            characters += s;
+        }
+    }
+    header.string_offset = file.tellp();
+    file.write(reinterpret_cast<const char *>(strings.data()), strings.size() * sizeof(palb_string));
+    header.character_offset = file.tellp();
+    header.character_bytes = characters.size();
+    file.write(characters.data(), characters.size());
+    header.line_offset = file.tellp();
+    if (header.line_count > 0)
+        file.write(reinterpret_cast<const char *>(&source_lines[1]), header.line_count * sizeof(uint32_t));
+    pad_to(page_aligned(file.tellp()));    // The mapped sections end within the file
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    if (!file or (rename(temporary_name.c_str(), file_name.c_str()) != 0))
+        throw "Cannot write snapshot " + file_name + ".";
+}
+
+
+void restore_snapshot(const string &file_name)
+// Map the code and data sections of the snapshot over the stores, and set the rest of the machine
+// from the snapshot.
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat status;
+    if ((fd < 0) or (fstat(fd, &status) != 0))
+        throw "Cannot open snapshot " + file_name + ".";
+    size_t size = size_t(status.st_size);
+    void *mapping = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        throw "Cannot map snapshot " + file_name + ".";
+    }
+    const char *file = static_cast<const char *>(mapping);
+
+    try {
+        pals_header header;
+        if (size < sizeof(header))
+            throw string("Snapshot too short for its header.");
+        memcpy(&header, file, sizeof(header));
+        if (memcmp(header.magic, pals_magic, sizeof(pals_magic)) != 0)
+            throw string("Not a PAL snapshot.");
+        if (header.version != pals_version)
+            throw "Snapshot version " + to_string(header.version) + " is not supported (expected "
+                    + to_string(pals_version) + ").";
+        if (header.page_size != uint64_t(sysconf(_SC_PAGESIZE)))
+            throw string("Snapshot was written with a different page size.");
+        if ((header.instruction_count >= uint32_t(code_size)) or (header.top_of_stack < 0)
+                or (header.cell_count <= uint32_t(header.top_of_stack)) or (header.cell_count > uint32_t(store_size)))
+            throw string("Snapshot does not fit the code and data stores.");
+        if ((header.line_count != 0) and (header.line_count != header.instruction_count))
+            throw string("Line table does not match the instructions.");
+        uint64_t code_bytes = page_aligned((uint64_t(header.instruction_count) + 1) * sizeof(instruction));
+        uint64_t data_bytes = page_aligned(uint64_t(header.cell_count) * sizeof(Memory_cell));
+        uint64_t string_count = uint64_t(header.string_count) + header.cell_string_count;
+        auto check_section = [size](uint64_t offset, uint64_t bytes, const char *name) {
+            if ((bytes > 0) and ((offset > size) or (bytes > size - offset)))
+                throw string(name) + " section extends beyond the end of the snapshot.";
+        };
+        check_section(header.code_offset, code_bytes, "Code");
+        check_section(header.data_offset, data_bytes, "Data");
+        check_section(header.real_offset, uint64_t(header.real_count) * sizeof(float), "Real constant");
+        check_section(header.string_offset, string_count * sizeof(palb_string), "String");
+        check_section(header.character_offset, header.character_bytes, "Character");
+        check_section(header.line_offset, uint64_t(header.line_count) * sizeof(uint32_t), "Line table");
+        if (((header.code_offset | header.data_offset) % header.page_size) != 0)
+            throw string("Snapshot sections are not aligned to pages.");
+
+        vector<string> strings;
+        strings.reserve(string_count);
+        for (uint64_t i = 0; i < string_count; i++) {
+            palb_string entry;
+            memcpy(&entry, file + header.string_offset + i * sizeof(palb_string), sizeof(entry));
+            if ((entry.offset > header.character_bytes) or (entry.length > header.character_bytes - entry.offset))
+                throw "String " + to_string(i) + " extends beyond the characters section.";
+            strings.emplace_back(file + header.character_offset + entry.offset, entry.length);
+        }
+        const instruction *code = reinterpret_cast<const instruction *>(file + header.code_offset);
+        for (uint32_t p = 1; p <= header.instruction_count; p++) {
+            if ((code[p].f > fun_DBG) or (code[p].fused != fused_none))
+                throw "Illegal function code " + to_string(int(code[p].f)) + " at address " + to_string(p) + ".";
+            if (((code[p].f == fun_LCR) and (uint32_t(code[p].a) >= header.real_count))
+                    or ((code[p].f == fun_LCS) and (uint32_t(code[p].a) >= header.string_count)))
+                throw "Constant index out of range at address " + to_string(p) + ".";
+        }
+
+        // Only now is the machine changed.
+        if ((mmap(code_store, code_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header.code_offset) == MAP_FAILED)
+                or (mmap(data_store, data_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header.data_offset) == MAP_FAILED))
+            throw "Cannot map snapshot " + file_name + ".";
+        Memory_cell::restore_strings(data_store, header.cell_count,
+                vector<string>(strings.begin() + header.string_count, strings.end()));
+        last_instruction = int(header.instruction_count);
+        real_constants.resize(header.real_count);
+        memcpy(real_constants.data(), file + header.real_offset, header.real_count * sizeof(float));
+        string_constants.assign(strings.begin(), strings.begin() + header.string_count);
+        source_lines.assign(header.line_count + 1, 0);
+        if (header.line_count > 0)
+            memcpy(&source_lines[1], file + header.line_offset, header.line_count * sizeof(uint32_t));
+        else
+            source_lines.clear();
+
+        program_counter = header.program_counter;
+        base_register = header.base_register;
+        top_of_stack = header.top_of_stack;
+        pal_exception = header.pal_exception;
+        instructions_executed = static_cast<long long>(header.instructions_executed);
+        debugging_pal_code = debugging_pal_code or ((header.flags & pals_listing) != 0);
+        resume_input(header.input_position, (header.flags & pals_input_ended) != 0,
+                (header.flags & pals_input_failed) != 0);
+        build_handler_table();
+        find_tail_calls();
+        verify_code();
+        rebuild_display();
+        machine_restored = true;
+    } catch (...) {
+        munmap(mapping, size);
+        close(fd);
+        throw;
+    }
+    munmap(mapping, size);
+    close(fd);
+}
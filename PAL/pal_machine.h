@@ -0,0 +1,262 @@
+/*
+ * pal_machine.h
+ *
+ * The state of the PAL machine, the loader and the reference implementation of the instruction set.
+ * Shared by the PAL machine (pal.cpp) and by the programs that pal2cpp translates PAL code into.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#ifndef PAL_MACHINE_H_
+#define PAL_MACHINE_H_
+
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "Memory_cell.h"
+
+using namespace std;
+
+// constexpr int data_alloc_index { 3 };     // Space for return links etc on the stack
+// constexpr int lev_max { 5 };             // Maximum depth of block nesting
+// The stores are reserved at these sizes but take memory only as they are used (see reserve_store).
+constexpr int code_size { 1 << 22 };        // Size of instruction store
+constexpr int store_size { 1 << 24 };       // Size of data store
+
+enum fun_code : uint8_t    // Function codes in the PAL instruction set
+{
+    fun_MST,    // Mark the stack
+    fun_CAL,    // Procedure call
+    fun_INC,    // Increoment top-of-stack pointer
+    fun_JIF,    // Jump if false
+    fun_JMP,    // Inconditinoal jump
+    fun_LCI,    // Load integer constant onto stack
+    fun_LCR,    // Load real constant onto stack
+    fun_LCS,    // Load string literal onto stack
+    fun_LDA,    // Load the absolute address of a variable onto the stack
+    fun_LDI,    // Load the value stored at specifed address onto the stack
+    fun_LDV,    // Load the value of a variable onto the stack
+    fun_LDU,    // Load an undefined or void value
+    fun_OPR,    // Execute operation - there are 32 of them
+    fun_RDI,    // Read a value into an integer variable
+    fun_RDR,    // Read a value into a real variable
+    fun_STI,    // Load top-of-stack - 1 into a variable at address top-of-stack
+    fun_STO,    // Store into a variable
+    fun_SIG,    // Raise signal
+    fun_REH,    // Register exception handler
+    fun_DBG     // Turn debugging status on/off
+};
+
+enum fused_code : uint8_t    // Superinstructions used by the threaded engine (see fuse_instructions)
+{
+    fused_none,               // Not the start of a fused sequence
+    fused_test_eq,            // LDV; LDV; OPR 10; JIF
+    fused_test_ne,            // LDV; LDV; OPR 11; JIF
+    fused_test_lt,            // LDV; LDV; OPR 12; JIF
+    fused_test_ge,            // LDV; LDV; OPR 13; JIF
+    fused_test_gt,            // LDV; LDV; OPR 14; JIF
+    fused_test_le,            // LDV; LDV; OPR 15; JIF
+    fused_increment,          // LDV; LCI; OPR 3; STO
+    fused_decrement,          // LDV; LCI; OPR 4; STO
+    fused_duplicate_store     // OPR 23; STO; STO
+};
+
+constexpr int instruction_size { 3 };     // Each instruction consists of 3 components.
+
+struct instruction                        // Description of a single instruction
+{
+    // Instructions are decoded when they are loaded so that the interpreter never has to check the
+    // type of an operand. Integer and address operands are held in a directly. For LCR and LCS, a
+    // is an index into real_constants or string_constants respectively.
+    fun_code f { fun_MST };                // Function code
+    fused_code fused { fused_none };    // Superinstruction starting here (threaded engine only)
+    int16_t l { 0 };                    // Level difference
+    int32_t a { 0 };                    // Offset address, constant value or constant table index
+};
+
+static_assert(sizeof(instruction) == 8, "instruction should be a compact 8 byte record");
+
+// The PAL machine has a number of predefined exceptions
+constexpr int re_raise_exception { 0 };
+constexpr int program_abort_exception { 1 };
+constexpr int no_return_in_function_exception { 2 };    // Used in compiler
+constexpr int input_error_exception { 3 };
+constexpr int end_error_exception { 4 };
+constexpr int abort_program_exception { 5 };
+constexpr int other_exception { 6 };
+
+// flags
+extern bool debugging_pal_code;               // Produce a listing while executing
+extern bool profiling_pal_code;               // Count the executions of each address
+extern bool checking_bounds;                  // Check the program counter and stack before each instruction
+extern bool tracking_calls;                   // Follow the calls and returns the program makes
+extern bool recording_trace;                  // Record each instruction in the binary trace
+extern int snapshot_address;                  // Write a snapshot when it is first reached (0 for none)
+extern bool snapshotting_on_signal;           // Write a snapshot whenever SIGUSR1 arrives
+extern long long instruction_budget;          // Stop after this many instructions (0 for no limit)
+
+// Output written by PAL programs (OPR 20 and 21) goes through cout, which buffer_output() gives a
+// large buffer. The buffer is written out when it fills, at exit, before anything is written to cerr
+// (fatal errors included), before input is read if standard output is a terminal, and at the end of
+// each line if output_flushing is flush_line.
+enum flush_policy
+{
+    flush_line,     // Write out each line as it ends
+    flush_full      // Write out only when the buffer fills
+};
+
+extern flush_policy output_flushing;          // flush_line if standard output is a terminal
+void buffer_output();                         // Give cout its buffer
+bool write_value(Memory_cell &cell);          // OPR 20: write cell, unless it holds no writable value
+void write_newline();                         // OPR 21
+
+// Input read by PAL programs (RDI, RDR and OPR 19) is parsed from standard input directly, with the
+// results of cin >>. A read that fails, at end of file or on malformed input, gives 0 and ends the
+// input, as cin >> leaves cin failed.
+int read_int();                               // RDI
+float read_real();                            // RDR
+bool input_ended();                           // OPR 19: as cin.eof()
+void replay_input(const string &text);        // Read text, from the start, instead of standard input
+
+// Instrumentation that can be compiled into the reference interpreter loop. execute_code() has loops
+// of their own for no instrumentation and for each flag alone, and runs one loop that tests the
+// flags as it goes for any combination of them. A run without any of them tests none of them.
+enum machine_feature : unsigned
+{
+    feature_trace = 1,      // List each instruction and the stack (debugging_pal_code)
+    feature_profile = 2,    // Count executions in address_counts (profiling_pal_code)
+    feature_budget = 4,     // Stop after instruction_budget instructions
+    feature_bounds = 8,     // check_bounds() before each instruction (checking_bounds)
+    feature_calls = 16,     // track_call() after each instruction (tracking_calls)
+    feature_record = 32,    // Record each instruction in the binary trace (recording_trace)
+    feature_snapshot = 64,  // Write snapshots when they are due (snapshot_address, snapshotting_on_signal)
+    feature_all = 127
+};
+
+extern long long *address_counts;             // Executions of each address while profiling
+
+// The procedures entered and left while tracking_calls is set. A frame is pushed when CAL enters a
+// procedure, and popped when base_register falls below its base, whether by OPR 0, OPR 1 or unwind().
+// Procedures are named by their entry addresses; the main program's is 1.
+struct call_arc    // The calls made from one call site to one procedure
+{
+    long long calls { 0 };
+    long long instructions { 0 };    // Executed by the calls, including those in procedures they call
+    long long nanoseconds { 0 };     // Their duration, if timing
+};
+
+struct call_graph
+{
+    vector<int> procedures;                     // Entry of the procedure that executed each address
+    vector<long long> nanoseconds;              // Time spent executing each address, if timing
+    map<array<int, 3>, call_arc> arcs;          // Indexed by caller entry, call site and callee entry
+    bool timing { false };
+};
+
+extern call_graph calls_made;
+void start_call_tracking(bool timing);    // Start following calls on the next run
+void finish_call_tracking();              // Account for the frames still active when the run ended
+
+// The binary trace (see pal_trace.h) is a ring of events in a mapped file. start_trace() throws a
+// message if the file cannot be created.
+void start_trace(const string &file_name, uint32_t capacity);    // Record the next run, capacity a power of 2
+void stop_trace();                                               // Close the trace file
+
+// Snapshots (see pal_snapshot.h) of the machine before an instruction. The reference engine writes
+// them to snapshot_file_name, and a run after restore_snapshot() resumes the snapshot instead of
+// starting the program. Both throw a message if they fail.
+extern string snapshot_file_name;
+extern int snapshots_written;                 // By the reference engine since the program started
+void snapshot_on_signal();                    // Set snapshotting_on_signal and catch SIGUSR1
+void write_snapshot(const string &file_name);
+void restore_snapshot(const string &file_name);
+
+extern long long instructions_executed;       // Instructions executed by the most recent run
+
+extern map<string, fun_code> fun_code_map;    // Mapping from strings to function codes
+
+extern Memory_cell *data_store;               // Data memory (RAM), store_size cells
+extern instruction *code_store;               // Instruction store, code_size instructions
+extern vector<float> real_constants;          // Operands of LCR instructions
+extern vector<string> string_constants;       // Operands of LCS instructions
+extern vector<uint32_t> source_lines;         // Source line of each address, if an object file gave them
+
+extern int pal_exception;                     // Name of the current exception
+
+// Exception handlers. A frame's handler is the operand of the last REH it executed. If the loader can
+// work that out for every address, handlers_tabled is set and unwind() looks it up in handler_at,
+// so REH need not store it in the frame (at base - 1) except for listings.
+extern vector<int> handler_at;                // Handler in effect at each address
+extern bool handlers_tabled;
+void build_handler_table();                   // After loading the code store
+
+// Tail calls. Unless eliminating_tail_calls is cleared, the loader marks in tail_call_at each CAL
+// that is followed by the return its callee ends with and cannot run while a handler is in effect.
+// When it is safe to, such a call moves the new frame over the caller's, so tail recursion runs in
+// constant space.
+extern bool eliminating_tail_calls;
+extern vector<bool> tail_call_at;             // CAL at each address is a tail call
+void find_tail_calls();                       // After build_handler_table()
+bool tail_call(int p);                        // Execute the CAL at p as a tail call if it is one
+
+// Verification. After loading, verify_code() checks that every jump, call and handler address is in
+// the code, and follows control through each procedure to find the depth of the stack (in cells
+// above the base of the frame) before each instruction. The code passes if no address is reached
+// with two depths and no instruction takes more cells than the stack holds. The depths are only
+// reported: a loop whose JIF leaves its condition on the stack fails, but runs as any other code.
+struct code_verification
+{
+    bool passed { false };
+    long long problem_count { 0 };
+    vector<string> problems;              // The first few reasons the code failed
+    vector<pair<int, int>> max_depths;    // Entry of each procedure and the deepest its stack gets
+};
+
+extern code_verification verification;
+void verify_code();                           // After find_tail_calls()
+void write_verification(ostream &out);        // The report of pal --verify
+extern int last_instruction;                  // Index of last instruction loaded into code_store
+
+// registers
+extern int program_counter;
+extern int base_register;
+extern int top_of_stack;
+extern instruction *instruction_register;
+
+// The display: bases of the current frame and its static ancestors, indexed by static depth
+extern int *display;
+extern int display_depth;                     // Depth of the current frame, or -1 if not known
+
+void establish_function_mapping();    // Set up fun_code_map
+fun_code strtofun(string s);
+string funtostr(fun_code f);
+Memory_cell operand(const instruction &i);
+string insttostr(instruction i);
+
+void trace_stack(int p, int b, int t);
+void trace_instruction(int p);
+void report_source_line(int p);
+void error(string message, int exc = program_abort_exception);
+void fatal_error(string message);
+int base(int l);
+void rebuild_display();             // Set up the display by walking the static links
+void display_call();                // Update the display after CAL has set base_register
+void display_return(int callee);    // Update it after returning from the frame based at callee
+void unwind(int exc, int lp, int lb, int &lt);
+
+void reset_machine();           // Initialise the registers before a run
+void execute_instruction();     // Execute the instruction at program_counter
+void step_instruction();        // The same, listing it first if required
+void execute_code();            // Run the loaded program (the reference engine)
+
+void load(const string &file_name);              // Load a text code file into code_store
+bool is_object_file(const string &file_name);    // Is it a PAL object file (see pal_object.h)?
+void load_object(const string &file_name);       // Load an object file into code_store
+void write_object(const string &file_name);      // Write code_store as an object file
+
+#endif /* PAL_MACHINE_H_ */
@@ -0,0 +1,63 @@
+/*
+ * pal_object.h
+ *
+ * The PAL object file format (.palb): a loaded code store, ready to be copied into the PAL machine.
+ * A compiler may write it directly; "pal --compile-object" writes it from a text code file.
+ *
+ * An object file holds, in the byte order of the machine that wrote it:
+ *        the header (palb_header);
+ *        the instructions for addresses 1 to instruction_count (palb_instruction);
+ *        the real constants (float), indexed by the operand of each LCR instruction;
+ *        the string constants (palb_string), indexed by the operand of each LCS instruction;
+ *        the characters of the string constants;
+ *        optionally, a line table: the source line (uint32_t) of each instruction.
+ * The sections may appear in any order, at the offsets given in the header. pal and pal2cpp take a
+ * file that starts with palb_magic to be an object file and any other file to be text.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#ifndef PAL_OBJECT_H_
+#define PAL_OBJECT_H_
+
+#include <cstdint>
+
+constexpr char palb_magic[4] { 'P', 'A', 'L', 'B' };
+constexpr uint32_t palb_version { 1 };    // Incremented whenever the layout changes
+
+struct palb_header
+{
+    char magic[4];                  // palb_magic
+    uint32_t version;               // palb_version
+    uint32_t instruction_count;     // Number of instructions
+    uint32_t real_count;            // Number of real constants
+    uint32_t string_count;          // Number of string constants
+    uint32_t line_count;            // Entries in the line table: 0 (none) or instruction_count
+    uint64_t instruction_offset;    // File offsets of the sections
+    uint64_t real_offset;
+    uint64_t string_offset;
+    uint64_t character_offset;
+    uint64_t character_bytes;       // Size of the characters section
+    uint64_t line_offset;
+};
+
+struct palb_instruction    // The layout of an instruction in the code store, before fusing
+{
+    uint8_t f;          // Function code (fun_code)
+    uint8_t unused;     // 0
+    int16_t l;          // Level difference
+    int32_t a;          // Address, integer constant, or index of a real or string constant
+};
+
+struct palb_string
+{
+    uint32_t offset;    // Of the first character, within the characters section
+    uint32_t length;
+};
+
+static_assert(sizeof(palb_header) == 72, "palb_header must not contain padding");
+static_assert(sizeof(palb_instruction) == 8, "palb_instruction must not contain padding");
+static_assert(sizeof(palb_string) == 8, "palb_string must not contain padding");
+
+#endif /* PAL_OBJECT_H_ */
@@ -0,0 +1,350 @@
+/*
+ * pal_profile.cpp
+ *
+ * Execution profile of a PAL program. See pal_profile.h.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <csignal>
+#include <sys/time.h>
+
+#include "pal_machine.h"
+#include "pal_profile.h"
+
+namespace {
+
+constexpr long sample_interval_us { 1000 };    // CPU time between samples, in microseconds (the
+                                               // kernel may take them less often)
+
+vector<long long> address_samples;    // Samples taken at each address, if timing
+bool timing_profile { false };
+
+const char *const operation_names[] {    // Indexed by the operand of OPR
+    "return", "function return", "negate", "+", "-", "*", "/", "**", "concatenate", "odd", "=",
+    "/=", "<", ">=", ">", "<=", "not", "true", "false", "eof", "write", "newline", "swap",
+    "duplicate", "drop", "integer to real", "real to integer", "integer to string",
+    "real to string", "and", "or", "is"
+};
+
+void take_sample(int)
+// SIGPROF handler. The instruction being executed is normally the one before program_counter, which
+// has already been advanced.
+{
+    int p = program_counter - 1;
+    if ((p >= 0) and (p < int(address_samples.size())))
+        address_samples[p]++;
+}
+
+struct block    // A basic block: the addresses first to last
+{
+    int first;
+    int last;
+    long long instructions { 0 };    // Instructions executed in the block
+    long long samples { 0 };
+};
+
+struct procedure    // The code reached from an entry address without calling or returning
+{
+    int entry;
+    long long calls { 0 };
+    long long instructions { 0 };
+    long long samples { 0 };
+};
+
+bool in_code(int a)
+{
+    return (a >= 1) and (a <= last_instruction);
+}
+
+vector<int> successors(int p)
+// Addresses that can be executed after p within the same procedure
+{
+    const instruction &i = code_store[p];
+    switch (i.f) {
+    case fun_JMP:
+        return in_code(i.a) ? vector<int> { i.a } : vector<int> { };
+    case fun_JIF:
+    case fun_REH:    // The handler belongs to the procedure that registers it.
+        return in_code(i.a) ? vector<int> { p + 1, i.a } : vector<int> { p + 1 };
+    case fun_OPR:
+        if ((i.a == 0) or (i.a == 1))
+            return { };
+        return { p + 1 };
+    default:
+        return { p + 1 };
+    }
+}
+
+vector<string> source_text(const string &code_file_name)
+// The line of the code file for each address, or the instruction itself for an object file
+{
+    vector<string> text(last_instruction + 1);
+    if (!is_object_file(code_file_name)) {
+        ifstream code_file(code_file_name);
+        string line;
+        for (int p = 1; (p <= last_instruction) and getline(code_file, line); p++) {
+            size_t start = line.find_first_not_of(" \t");
+            size_t end = line.find_last_not_of(" \t\r");
+            text[p] = (start == string::npos) ? "" : line.substr(start, end - start + 1);
+        }
+        return text;
+    }
+    for (int p = 1; p <= last_instruction; p++) {
+        text[p] = funtostr(code_store[p].f) + " " + to_string(code_store[p].l) + " ";
+        Memory_cell value = operand(code_store[p]);
+        text[p] += value.is_string() ? "'" + value.get_string() + "'" : value.to_string().substr(8);
+        if (size_t(p) < source_lines.size())
+            text[p] += "    (line " + to_string(source_lines[p]) + ")";
+    }
+    return text;
+}
+
+string percentage(long long part, long long whole)
+{
+    ostringstream s;
+    s << fixed << setprecision(1) << (whole > 0 ? 100.0 * part / whole : 0.0) << "%";
+    return s.str();
+}
+
+}
+
+void start_profile(bool timing)
+{
+    profiling_pal_code = true;
+    memset(address_counts, 0, (last_instruction + 2) * sizeof(address_counts[0]));
+    timing_profile = timing;
+    if (timing) {
+        address_samples.assign(last_instruction + 2, 0);
+        signal(SIGPROF, take_sample);
+        itimerval interval { { 0, sample_interval_us }, { 0, sample_interval_us } };
+        setitimer(ITIMER_PROF, &interval, nullptr);
+    }
+}
+
+void stop_profile()
+{
+    if (timing_profile) {
+        itimerval off { };
+        setitimer(ITIMER_PROF, &off, nullptr);
+        signal(SIGPROF, SIG_IGN);
+    }
+}
+
+void write_profile(ostream &out, const string &code_file_name)
+{
+    constexpr size_t hottest_instructions { 20 };
+    constexpr size_t hottest_blocks { 10 };
+    const vector<string> text = source_text(code_file_name);
+    auto samples = [](int p) { return timing_profile ? address_samples[p] : 0; };
+
+    long long total { 0 };
+    for (int p = 1; p <= last_instruction; p++)
+        total += address_counts[p];
+    long long sampled { 0 };
+    for (long long n : address_samples)
+        sampled += n;
+    out << endl << "Profile of " << code_file_name << ": " << total << " instructions executed";
+    if (timing_profile)
+        out << ", " << sampled << " time samples";
+    out << "." << endl;
+    // The share of the samples taken at an address estimates the share of the time spent there.
+    const string time_heading = timing_profile ? "    time %" : "";
+    auto time_share = [sampled](long long n) { return percentage(n, sampled); };
+
+    // Instructions
+    vector<int> addresses;
+    for (int p = 1; p <= last_instruction; p++)
+        if (address_counts[p] > 0)
+            addresses.push_back(p);
+    stable_sort(addresses.begin(), addresses.end(),
+            [](int p, int q) { return address_counts[p] > address_counts[q]; });
+    out << endl << "Hottest instructions" << endl
+        << "   address         count        %" << time_heading << "    code" << endl;
+    for (size_t i = 0; (i < addresses.size()) and (i < hottest_instructions); i++) {
+        int p = addresses[i];
+        out << setw(10) << p << setw(14) << address_counts[p] << setw(9)
+            << percentage(address_counts[p], total);
+        if (timing_profile)
+            out << setw(10) << time_share(samples(p));
+        out << "    " << text[p] << endl;
+    }
+
+    // Basic blocks start at address 1, at the targets of jumps, calls and handlers, and after
+    // instructions that transfer control.
+    vector<bool> leader(last_instruction + 2, false);
+    leader[1] = true;
+    for (int p = 1; p <= last_instruction; p++) {
+        const instruction &i = code_store[p];
+        bool transfers = (i.f == fun_JMP) or (i.f == fun_JIF) or (i.f == fun_CAL)
+                or ((i.f == fun_OPR) and ((i.a == 0) or (i.a == 1)));
+        if (transfers or (i.f == fun_REH)) {
+            if ((i.f != fun_OPR) and in_code(i.a))
+                leader[i.a] = true;
+            if (transfers)
+                leader[p + 1] = true;
+        }
+    }
+    vector<block> blocks;
+    for (int p = 1; p <= last_instruction; p++) {
+        if (leader[p])
+            blocks.push_back({ p, p });
+        blocks.back().last = p;
+        blocks.back().instructions += address_counts[p];
+        blocks.back().samples += samples(p);
+    }
+    stable_sort(blocks.begin(), blocks.end(),
+            [](const block &x, const block &y) { return x.instructions > y.instructions; });
+    out << endl << "Hottest basic blocks" << endl
+        << "   addresses       entries  instructions        %" << time_heading << "    first instruction" << endl;
+    for (size_t i = 0; (i < blocks.size()) and (i < hottest_blocks) and (blocks[i].instructions > 0); i++) {
+        const block &b = blocks[i];
+        out << setw(12) << to_string(b.first) + "-" + to_string(b.last) << setw(14)
+            << address_counts[b.first] << setw(14) << b.instructions << setw(9)
+            << percentage(b.instructions, total);
+        if (timing_profile)
+            out << setw(10) << time_share(b.samples);
+        out << "    " << text[b.first] << endl;
+    }
+
+    // Procedures are entered at address 1 and at the targets of CAL instructions. Each address
+    // belongs to the first procedure that reaches it without calling or returning.
+    vector<procedure> procedures { { 1, 1 } };
+    vector<int> owner(last_instruction + 2, -1);    // Index in procedures
+    for (int p = 1; p <= last_instruction; p++) {
+        if ((code_store[p].f == fun_CAL) and in_code(code_store[p].a)) {
+            int entry = code_store[p].a;
+            auto known = find_if(procedures.begin(), procedures.end(),
+                    [entry](const procedure &c) { return c.entry == entry; });
+            if (known == procedures.end())
+                known = procedures.insert(procedures.end(), { entry });
+            known->calls += address_counts[p];
+        }
+    }
+    sort(procedures.begin() + 1, procedures.end(),
+            [](const procedure &x, const procedure &y) { return x.entry < y.entry; });
+    for (size_t c = 0; c < procedures.size(); c++) {
+        vector<int> reached { procedures[c].entry };
+        while (!reached.empty()) {
+            int p = reached.back();
+            reached.pop_back();
+            if (!in_code(p) or (owner[p] != -1))
+                continue;
+            owner[p] = c;
+            for (int q : successors(p))
+                reached.push_back(q);
+        }
+    }
+    long long elsewhere { 0 };    // Instructions executed outside every procedure
+    for (int p = 1; p <= last_instruction; p++) {
+        if (owner[p] == -1) {
+            elsewhere += address_counts[p];
+        } else {
+            procedures[owner[p]].instructions += address_counts[p];
+            procedures[owner[p]].samples += samples(p);
+        }
+    }
+    stable_sort(procedures.begin(), procedures.end(),
+            [](const procedure &x, const procedure &y) { return x.instructions > y.instructions; });
+    out << endl << "Procedures (entered at address 1 and by CAL)" << endl
+        << "     entry         calls  instructions        %" << time_heading << "    first instruction" << endl;
+    for (const procedure &c : procedures) {
+        out << setw(10) << c.entry << setw(14) << c.calls << setw(14) << c.instructions << setw(9)
+            << percentage(c.instructions, total);
+        if (timing_profile)
+            out << setw(10) << time_share(c.samples);
+        out << "    " << text[c.entry] << endl;
+    }
+    if (elsewhere > 0)
+        out << setw(10) << "other" << setw(14) << "" << setw(14) << elsewhere << setw(9)
+            << percentage(elsewhere, total) << endl;
+
+    // Operations
+    vector<pair<string, long long>> operations;
+    map<string, long long> operation_counts;
+    for (int p = 1; p <= last_instruction; p++) {
+        const instruction &i = code_store[p];
+        if (address_counts[p] == 0)
+            continue;
+        string name = funtostr(i.f);
+        if (i.f == fun_OPR) {
+            name += " " + to_string(i.a);
+            if ((i.a >= 0) and (i.a < int(size(operation_names))))
+                name += " (" + string(operation_names[i.a]) + ")";
+        }
+        operation_counts[name] += address_counts[p];
+    }
+    operations.assign(operation_counts.begin(), operation_counts.end());
+    stable_sort(operations.begin(), operations.end(),
+            [](const auto &x, const auto &y) { return x.second > y.second; });
+    out << endl << "Instructions by operation" << endl
+        << "   operation                         count        %" << endl;
+    for (const auto &[name, count] : operations)
+        out << "   " << left << setw(26) << name << right << setw(14) << count << setw(9)
+            << percentage(count, total) << endl;
+}
+
+namespace {
+
+string procedure_name(int entry)
+{
+    return (entry == 1) ? "main" : "procedure " + to_string(entry);
+}
+
+}
+
+void write_callgrind(ostream &out, const string &code_file_name)
+{
+    bool timing = calls_made.timing;
+    auto costs = [timing](long long instructions, long long nanoseconds) {
+        return to_string(instructions) + (timing ? " " + to_string(nanoseconds) : "");
+    };
+    auto nanoseconds = [](int p) {
+        return calls_made.timing ? calls_made.nanoseconds[p] : 0;
+    };
+
+    // Group the addresses executed, and the calls made, by the procedure that executed them.
+    map<int, vector<int>> addresses;
+    long long total_instructions { 0 };
+    long long total_nanoseconds { 0 };
+    for (int p = 1; p <= last_instruction; p++) {
+        if (address_counts[p] > 0) {
+            addresses[calls_made.procedures[p]].push_back(p);
+            total_instructions += address_counts[p];
+            total_nanoseconds += nanoseconds(p);
+        }
+    }
+    for (const auto &[arc, cost] : calls_made.arcs)
+        addresses[arc[0]];
+
+    out << "# callgrind format" << endl
+        << "version: 1" << endl
+        << "creator: pal" << endl
+        << "cmd: " << code_file_name << endl
+        << "positions: line" << endl
+        << "events: Ir" << (timing ? " ns" : "") << endl
+        << "summary: " << costs(total_instructions, total_nanoseconds) << endl
+        << endl
+        << "fl=" << code_file_name << endl;
+    for (const auto &[entry, executed] : addresses) {
+        out << endl << "fn=" << procedure_name(entry) << endl;
+        for (int p : executed)
+            out << p << " " << costs(address_counts[p], nanoseconds(p)) << endl;
+        for (auto arc = calls_made.arcs.lower_bound({ entry, 0, 0 });
+                (arc != calls_made.arcs.end()) and (arc->first[0] == entry); arc++) {
+            out << "cfn=" << procedure_name(arc->first[2]) << endl
+                << "calls=" << arc->second.calls << " " << arc->first[2] << endl
+                << arc->first[1] << " " << costs(arc->second.instructions, arc->second.nanoseconds) << endl;
+        }
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * pal_profile.h
+ *
+ * Execution profile of a PAL program ("pal --profile"). The reference engine counts the executions
+ * of each address in address_counts, and a profiling timer can also sample the address being
+ * executed. The report lists the hottest instructions, basic blocks and procedures, each shown with
+ * its line from the code file, so that the comments the compiler writes there identify it.
+ *
+ * "pal --callgrind" follows the calls the program makes (see call_graph in pal_machine.h) and writes
+ * the costs in the callgrind format, for KCachegrind and callgrind_annotate. Each procedure is a
+ * function named by its entry address, and each address is a line of the code file.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#ifndef PAL_PROFILE_H_
+#define PAL_PROFILE_H_
+
+#include <iostream>
+#include <string>
+
+#include "pal_machine.h"
+
+void start_profile(bool timing);    // Clear the counts, and sample time per address if timing
+void stop_profile();
+void write_profile(ostream &out, const string &code_file_name);    // Report on the loaded program
+void write_callgrind(ostream &out, const string &code_file_name);  // Write calls_made and the counts
+
+#endif /* PAL_PROFILE_H_ */
@@ -0,0 +1,72 @@
+/*
+ * pal_snapshot.h
+ *
+ * The PAL snapshot format: the state of the PAL machine part way through a run, written by
+ * "pal --snapshot-at" and resumed by "pal --restore". The code and data sections are laid out as the
+ * code store and data store are, and aligned to pages, so that restoring maps them into place rather
+ * than reading them; runs restored from the same snapshot share its pages until they change them.
+ *
+ * A snapshot holds, in the byte order of the machine that wrote it:
+ *        the header (pals_header);
+ *        the code store, addresses 0 to instruction_count (palb_instruction), padded to a page;
+ *        the data store, cells 0 to cell_count - 1, padded to a page with undefined cells. Cells
+ *        above the top of the stack are kept too, as code may still address them. A cell is
+ *        laid out as a Memory_cell, but a string cell holds the index of its string among the cell
+ *        strings (see Memory_cell::save_cells);
+ *        the real constants (float), indexed by the operand of each LCR instruction;
+ *        the string constants and then the cell strings (palb_string);
+ *        the characters of those strings;
+ *        optionally, a line table: the source line (uint32_t) of each instruction.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#ifndef PAL_SNAPSHOT_H_
+#define PAL_SNAPSHOT_H_
+
+#include <cstdint>
+
+#include "pal_object.h"
+
+constexpr char pals_magic[4] { 'P', 'A', 'L', 'S' };
+constexpr uint32_t pals_version { 1 };    // Incremented whenever the layout changes
+
+enum pals_flag : uint32_t
+{
+    pals_listing = 1,           // debugging_pal_code was set, by -l or by DBG
+    pals_input_ended = 2,       // input_ended() was true
+    pals_input_failed = 4       // A read had failed, so that every later read fails
+};
+
+struct pals_header
+{
+    char magic[4];                  // pals_magic
+    uint32_t version;               // pals_version
+    int32_t program_counter;        // Registers, before the instruction at program_counter
+    int32_t base_register;
+    int32_t top_of_stack;
+    int32_t pal_exception;          // Name of the current exception
+    uint32_t instruction_count;     // Number of instructions
+    uint32_t real_count;            // Number of real constants
+    uint32_t string_count;          // Number of string constants
+    uint32_t cell_string_count;     // Number of strings held by cells
+    uint32_t line_count;            // Entries in the line table: 0 (none) or instruction_count
+    uint32_t flags;                 // pals_flag
+    uint32_t cell_count;            // Cells in the data section; every cell beyond is undefined
+    uint32_t unused;                // 0
+    uint64_t instructions_executed;
+    uint64_t input_position;        // Bytes of standard input read
+    uint64_t page_size;             // The code and data sections are aligned to it
+    uint64_t code_offset;           // File offsets of the sections
+    uint64_t data_offset;
+    uint64_t real_offset;
+    uint64_t string_offset;
+    uint64_t character_offset;
+    uint64_t character_bytes;       // Size of the characters section
+    uint64_t line_offset;
+};
+
+static_assert(sizeof(pals_header) == 136, "pals_header must not contain padding");
+
+#endif /* PAL_SNAPSHOT_H_ */
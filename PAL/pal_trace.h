@@ -0,0 +1,49 @@
+/*
+ * pal_trace.h
+ *
+ * The PAL binary trace format: a ring of the most recent instructions executed, written by
+ * "pal --trace=file" and read by paltrace. The file is mapped while the program runs, so that what
+ * has been recorded survives the program aborting.
+ *
+ * A trace file holds, in the byte order of the machine that wrote it:
+ *        the header (palt_header);
+ *        capacity events (palt_event). Event n of the run is at index n % capacity, so once more
+ *        than capacity events have been recorded the file holds the last capacity of them.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#ifndef PAL_TRACE_H_
+#define PAL_TRACE_H_
+
+#include <cstdint>
+
+constexpr char palt_magic[4] { 'P', 'A', 'L', 'T' };
+constexpr uint32_t palt_version { 1 };    // Incremented whenever the layout changes
+
+struct palt_header
+{
+    char magic[4];          // palt_magic
+    uint32_t version;       // palt_version
+    uint32_t capacity;      // Events the ring holds, a power of 2
+    uint32_t unused;        // 0
+    uint64_t events;        // Events recorded so far
+};
+
+struct palt_event    // An instruction executed, and the state of the machine after it
+{
+    int32_t address;    // Of the instruction
+    int32_t a;          // Its operand, as held in the code store
+    int32_t base;       // base_register
+    int32_t top;        // top_of_stack
+    uint32_t value;     // The value at the top of the stack: the bits of an integer, real or boolean
+    uint8_t f;          // Function code of the instruction (fun_code)
+    uint8_t type;       // Type of the value at the top of the stack (Memory_cell::types)
+    int16_t l;          // Level difference of the instruction
+};
+
+static_assert(sizeof(palt_header) == 24, "palt_header must not contain padding");
+static_assert(sizeof(palt_event) == 24, "palt_event must not contain padding");
+
+#endif /* PAL_TRACE_H_ */
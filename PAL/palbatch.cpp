@@ -0,0 +1,236 @@
+/*
+ * palbatch.cpp
+ *
+ * Batch runner for PAL programs.
+ *
+ * Usage
+ *        palbatch [-j jobs] [manifest]
+ *
+ * Runs the jobs listed in the manifest (default standard input), up to jobs at a time (default the
+ * number of processors), and reports the jobs completed per second and percentiles of the time each
+ * took. Each line of the manifest names a code file (text or object), the file the program reads as
+ * its standard input ("-" for none) and the file its output and run-time error reports are written
+ * to. Blank lines and lines starting with # are ignored.
+ *
+ * Each code file is loaded once, before any job runs. A job runs in a child process forked from
+ * palbatch with its program already in the code store, so it starts without exec, set up or loading,
+ * and shares the loaded program with palbatch rather than copying it. Each job has a PAL machine of
+ * its own, as the state of the machine in pal_machine.cpp is global, and a fatal run-time error ends
+ * only the job that has it. Jobs run on the switch engine.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "pal_machine.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct loaded_program    // A code file as load() left the code store
+{
+    vector<instruction> code;    // Addresses 1 to last_instruction
+    vector<float> reals;
+    vector<string> strings;
+    vector<uint32_t> lines;
+    vector<int> handlers;
+    bool tabled;
+    vector<bool> tail_calls;
+};
+
+struct job
+{
+    int line { 0 };              // In the manifest
+    string code_file_name;
+    string input_file_name;
+    string output_file_name;
+    size_t program { 0 };        // Index in programs
+};
+
+vector<loaded_program> programs;
+map<string, size_t> program_index;    // Of each code file loaded
+
+size_t load_program(const string &file_name)
+// Load the code file, unless it has been already, and return its index in programs.
+{
+    auto known = program_index.find(file_name);
+    if (known != program_index.end())
+        return known->second;
+    if (is_object_file(file_name))
+        load_object(file_name);
+    else
+        load(file_name);
+    programs.push_back({ vector<instruction>(code_store + 1, code_store + last_instruction + 1),
+            real_constants, string_constants, source_lines, handler_at, handlers_tabled,
+            tail_call_at });
+    return program_index[file_name] = programs.size() - 1;
+}
+
+void install_program(const loaded_program &program)
+// Put the program in the code store, as if it had just been loaded.
+{
+    int size = int(program.code.size());
+    copy(program.code.begin(), program.code.end(), code_store + 1);
+    if (last_instruction > size)    // Beyond the code is zero, as in a fresh code store
+        memset(static_cast<void *>(code_store + size + 1), 0, (last_instruction - size) * sizeof(instruction));
+    last_instruction = size;
+    real_constants = program.reals;
+    string_constants = program.strings;
+    source_lines = program.lines;
+    handler_at = program.handlers;
+    handlers_tabled = program.tabled;
+    tail_call_at = program.tail_calls;
+}
+
+[[noreturn]] void run_job(const job &j)
+// In the child process: run the job's program, which is in the code store, and exit.
+{
+    int input = open(j.input_file_name == "-" ? "/dev/null" : j.input_file_name.c_str(), O_RDONLY);
+    int output = open(j.output_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((input < 0) or (output < 0)) {
+        cerr << "palbatch: line " << j.line << ": cannot open "
+             << (input < 0 ? j.input_file_name : j.output_file_name) << endl;
+        _exit(2);
+    }
+    dup2(input, STDIN_FILENO);
+    dup2(output, STDOUT_FILENO);
+    dup2(output, STDERR_FILENO);
+    close(input);
+    close(output);
+    output_flushing = flush_full;
+    execute_code();
+    cout.flush();
+    _exit(0);
+}
+
+vector<job> read_manifest(istream &manifest)
+{
+    vector<job> jobs;
+    string text;
+    for (int line = 1; getline(manifest, text); line++) {
+        istringstream fields(text);
+        job j;
+        j.line = line;
+        if (!(fields >> j.code_file_name) or (j.code_file_name[0] == '#'))
+            continue;
+        string extra;
+        if (!(fields >> j.input_file_name >> j.output_file_name) or (fields >> extra))
+            throw "line " + to_string(line) + ": expected a code file, an input file and an output file";
+        jobs.push_back(j);
+    }
+    return jobs;
+}
+
+double percentile(const vector<double> &sorted, double p)
+// The nearest-rank percentile: the smallest sample with at least p% of the samples at or below it
+{
+    if (sorted.empty())
+        return 0;
+    double rank = ceil(p / 100 * sorted.size());
+    return sorted[min(sorted.size(), size_t(max(rank, 1.0))) - 1];
+}
+
+
+int main(int argc, char *argv[]) {
+    unsigned workers { max(1u, thread::hardware_concurrency()) };
+    string manifest_file_name;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-j") and (i + 1 < argc) and (atoi(argv[i + 1]) > 0))
+            workers = unsigned(atoi(argv[++i]));
+        else if (manifest_file_name.empty() and (arg[0] != '-'))
+            manifest_file_name = arg;
+        else {
+            cerr << "usage: palbatch [-j jobs] [manifest]" << endl;
+            return 1;
+        }
+    }
+
+    buffer_output();
+    establish_function_mapping();
+    vector<job> jobs;
+    try {
+        ifstream manifest_file(manifest_file_name);
+        if (!manifest_file_name.empty() and !manifest_file)
+            throw "cannot open " + manifest_file_name;
+        jobs = read_manifest(manifest_file_name.empty() ? cin : manifest_file);
+        for (job &j : jobs) {
+            if (access(j.code_file_name.c_str(), R_OK) != 0)
+                throw "line " + to_string(j.line) + ": cannot open " + j.code_file_name;
+            j.program = load_program(j.code_file_name);
+        }
+    } catch (const string &message) {
+        cerr << "palbatch: " << message << endl;
+        return 1;
+    }
+
+    struct running_job
+    {
+        size_t index;
+        steady_clock::time_point start;
+    };
+    map<pid_t, running_job> running;
+    vector<double> latencies;    // Milliseconds
+    int failed { 0 };
+    size_t installed { programs.size() };    // Program in the code store
+    size_t next { 0 };
+    steady_clock::time_point start = steady_clock::now();
+    while ((next < jobs.size()) or !running.empty()) {
+        while ((next < jobs.size()) and (running.size() < workers)) {
+            if (jobs[next].program != installed) {
+                installed = jobs[next].program;
+                install_program(programs[installed]);
+            }
+            cout.flush();    // So that the child does not write it again
+            pid_t child = fork();
+            if (child < 0) {
+                cerr << "palbatch: cannot fork: " << strerror(errno) << endl;
+                return 1;
+            }
+            if (child == 0)
+                run_job(jobs[next]);
+            running[child] = { next++, steady_clock::now() };
+        }
+        int status;
+        pid_t child = waitpid(-1, &status, 0);
+        auto finished = running.find(child);
+        if (finished == running.end())
+            continue;
+        latencies.push_back(duration<double, milli>(steady_clock::now() - finished->second.start).count());
+        if (!WIFEXITED(status) or (WEXITSTATUS(status) != 0)) {
+            const job &j = jobs[finished->second.index];
+            failed++;
+            cerr << "palbatch: line " << j.line << ": " << j.code_file_name << " failed ("
+                 << (WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "exit status " + to_string(WEXITSTATUS(status)))
+                 << "); see " << j.output_file_name << endl;
+        }
+        running.erase(finished);
+    }
+    double seconds = duration<double>(steady_clock::now() - start).count();
+
+    sort(latencies.begin(), latencies.end());
+    cout << jobs.size() << " jobs (" << programs.size() << " programs, " << failed << " failed) in "
+         << fixed << setprecision(3) << seconds << " seconds, up to " << workers << " at a time: "
+         << setprecision(0) << jobs.size() / max(seconds, 1e-9) << " jobs per second." << endl;
+    cout << setprecision(3) << "Job latency in milliseconds: 50% " << percentile(latencies, 50)
+         << ", 90% " << percentile(latencies, 90) << ", 99% " << percentile(latencies, 99) << ", max "
+         << (latencies.empty() ? 0 : latencies.back()) << "." << endl;
+    return failed > 0;
+}
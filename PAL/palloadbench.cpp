@@ -0,0 +1,116 @@
+/*
+ * palloadbench.cpp
+ *
+ * Benchmark of the PAL machine's text code file loader.
+ *
+ * Usage
+ *        palloadbench [-n instructions] [-r runs] [file...]
+ *
+ * Loads each given PAL code file runs (default 5) times with load() from pal_machine.cpp and
+ * reports the fastest run, in milliseconds and in instructions loaded per second. Given no files, it
+ * generates a code file of the given number of instructions (default 1000000) that looks like the
+ * output of the compiler: every opcode, string and real constants, and comments after many of the
+ * instructions. The generated file is removed afterwards.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#include "pal_machine.h"
+
+using namespace std;
+
+string generate_code_file(int instructions)
+// Write a code file of the given number of instructions, and return its name.
+{
+    static const char *const lines[] = {
+        "MST 0 0",
+        "LDV 0 3    ; load x",
+        "LCI 0 1",
+        "OPR 0 3    ; +",
+        "STO 0 3    ; store x",
+        "LDA 1 4",
+        "LDI 0 0",
+        "LCR 0 3.14159",
+        "LCS 0 'The quick brown fox'    ; string constant",
+        "OPR 0 20",
+        "LDV 1 4",
+        "LCI 0 100000",
+        "OPR 0 12   ; <",
+        "JIF 0 2",
+        "RDI 0 5",
+        "RDR 0 6",
+        "STI 0 0",
+        "INC 0 7",
+        "SIG 0 2",
+        "REH 0 9",
+        "CAL 1 3",
+        "JMP 0 1",
+        "LDU 0 0",
+        "DBG 0 0",
+        "OPR 0 1    ; return",
+    };
+    string file_name = (filesystem::temp_directory_path() / "palloadbench.pal").string();
+    ofstream code_file(file_name);
+    for (int i = 0; i < instructions; i++)
+        code_file << lines[i % size(lines)] << '\n';
+    return file_name;
+}
+
+
+int main(int argc, char *argv[]) {
+    int instructions { 1000000 };    // size of the generated code file
+    int runs { 5 };
+    vector<string> files;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-n") and (i + 1 < argc))
+            instructions = stoi(argv[++i]);
+        else if ((arg == "-r") and (i + 1 < argc))
+            runs = stoi(argv[++i]);
+        else
+            files.push_back(arg);
+    }
+    if ((instructions < 1) or (instructions >= code_size) or (runs < 1)) {
+        cerr << "usage: palloadbench [-n instructions] [-r runs] [file...]" << endl;
+        cerr << "instructions must be between 1 and " << code_size - 1 << endl;
+        return 1;
+    }
+
+    bool generated = files.empty();
+    if (generated)
+        files.push_back(generate_code_file(instructions));
+
+    for (const string &file_name : files) {
+        if (!filesystem::exists(file_name)) {
+            cerr << "Cannot open " << file_name << endl;
+            return 1;
+        }
+        double fastest { 0 };    // seconds
+        for (int run = 0; run < runs; run++) {
+            auto start = chrono::steady_clock::now();
+            load(file_name);
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            if ((run == 0) or (elapsed.count() < fastest))
+                fastest = elapsed.count();
+        }
+        cout << file_name << ": " << last_instruction << " instructions, "
+             << filesystem::file_size(file_name) / 1024 << " KB, fastest of " << runs << " loads "
+             << fastest * 1000 << " milliseconds, "
+             << static_cast<long long>(last_instruction / max(fastest, 1e-9))
+             << " instructions per second" << endl;
+    }
+
+    if (generated)
+        filesystem::remove(files.front());
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * palngram.cpp
+ *
+ * Opcode n-gram miner for PAL code files.
+ *
+ * Usage
+ *        palngram [-n max_length] [-t top] file...
+ *
+ * Counts how often each sequence of 2 to max_length (default 4) consecutive instructions occurs in
+ * the given PAL code files and prints the top (default 20) sequences of each length. OPR
+ * instructions are counted together with their operation number ("OPR 15"), as each operation is
+ * effectively a separate opcode. A sequence never continues past an instruction that transfers
+ * control (JMP, JIF, CAL, OPR 0 and OPR 1), since the instructions that follow it are not executed
+ * straight after it.
+ *
+ * The counts are used to choose the superinstructions fused by the PAL machine (see
+ * fuse_instructions() in pal.cpp).
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+string opcode(const string &line, bool &ends_sequence)
+// Return the opcode of the instruction on line ("" for a blank line) and note whether it transfers
+// control.
+{
+    istringstream fields(line);
+    string code;
+    string level;
+    string operand;
+
+    fields >> code >> level >> operand;
+    for (auto &c : code)
+        c = toupper(c);
+    if (code == "OPR") {
+        ends_sequence = (operand == "0") or (operand == "1");
+        return code + " " + operand;
+    }
+    ends_sequence = (code == "JMP") or (code == "JIF") or (code == "CAL");
+    return code;
+}
+
+
+int main(int argc, char *argv[]) {
+    int max_length { 4 };    // longest sequence counted
+    int top { 20 };          // number of sequences of each length reported
+    vector<string> files;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-n") and (i + 1 < argc))
+            max_length = stoi(argv[++i]);
+        else if ((arg == "-t") and (i + 1 < argc))
+            top = stoi(argv[++i]);
+        else
+            files.push_back(arg);
+    }
+    if (files.empty() or (max_length < 2)) {
+        cerr << "usage: palngram [-n max_length] [-t top] file..." << endl;
+        return 1;
+    }
+
+    vector<map<string, long>> counts(max_length + 1);   // counts[n] holds sequences of length n
+    long instructions { 0 };
+
+    for (const string &file_name : files) {
+        ifstream code_file(file_name);
+        if (!code_file) {
+            cerr << "Cannot open " << file_name << endl;
+            return 1;
+        }
+
+        vector<string> window;   // the instructions of the current sequence, most recent last
+        string line;
+        while (getline(code_file, line)) {
+            bool ends_sequence { false };
+            string code = opcode(line, ends_sequence);
+            if (code.empty())
+                continue;
+            instructions++;
+
+            window.push_back(code);
+            if (int(window.size()) > max_length)
+                window.erase(window.begin());
+            // Count every sequence that ends with this instruction.
+            string sequence = window.back();
+            for (int n = 2; n <= int(window.size()); n++) {
+                sequence = window[window.size() - n] + "; " + sequence;
+                counts[n][sequence]++;
+            }
+            if (ends_sequence)
+                window.clear();
+        }
+    }
+
+    cout << instructions << " instructions in " << files.size() << " files." << endl;
+    for (int n = 2; n <= max_length; n++) {
+        vector<pair<long, string>> ranked;
+        for (auto &entry : counts[n])
+            ranked.emplace_back(entry.second, entry.first);
+        sort(ranked.begin(), ranked.end(), [](const auto &x, const auto &y) {
+            return (x.first != y.first) ? (x.first > y.first) : (x.second < y.second);
+        });
+
+        cout << endl << "Sequences of length " << n << ":" << endl;
+        for (int i = 0; (i < top) and (i < int(ranked.size())); i++) {
+            cout.width(8);
+            cout << ranked[i].first << "  " << ranked[i].second << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * paltrace.cpp
+ *
+ * Decoder of the binary traces written by "pal --trace=file" (see pal_trace.h).
+ *
+ * Usage
+ *        paltrace [-n events] [-a address[-address]] file
+ *
+ * Lists the last events (default 20) recorded in the trace file, oldest first: each instruction
+ * executed, with the base, the top of the stack and the value there after it. With -a, only the
+ * instructions at the given address, or in the given range of addresses, are listed. -n 0 lists
+ * every event kept.
+ *
+ * Open Source - free to distribute and modify. May not be used for profit.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <bit>
+
+#include "pal_machine.h"
+#include "pal_trace.h"
+
+using namespace std;
+
+string value_text(const palt_event &event)
+// The value at the top of the stack after the event
+{
+    switch (event.type) {
+    case Memory_cell::types_UNDEF:
+        return "undefined";
+    case Memory_cell::types_BOOLEAN:
+        return event.value ? "true" : "false";
+    case Memory_cell::types_INT:
+        return to_string(int32_t(event.value));
+    case Memory_cell::types_REAL: {
+        ostringstream real;
+        real << bit_cast<float>(event.value);
+        return real.str();
+    }
+    case Memory_cell::types_STRING:
+        return "(string)";
+    default:
+        return "?";
+    }
+}
+
+string instruction_text(const palt_event &event)
+{
+    string text = funtostr(fun_code(event.f)) + " " + to_string(event.l) + " ";
+    if ((event.f == fun_LCR) or (event.f == fun_LCS))    // The operand indexes the constant tables
+        return text + "constant " + to_string(event.a);
+    return text + to_string(event.a);
+}
+
+
+int main(int argc, char *argv[]) {
+    long long shown { 20 };     // Events to list, 0 for all
+    int first { 0 };            // Addresses to list
+    int last { code_size };
+    string file_name;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if ((arg == "-n") and (i + 1 < argc)) {
+                shown = stoll(argv[++i]);
+            } else if ((arg == "-a") and (i + 1 < argc)) {
+                string range = argv[++i];
+                size_t dash = range.find('-');
+                first = stoi(range.substr(0, dash));
+                last = (dash == string::npos) ? first : stoi(range.substr(dash + 1));
+            } else if (file_name.empty() and (arg[0] != '-')) {
+                file_name = arg;
+            } else {
+                throw string("Unknown argument " + arg + ".");
+            }
+        }
+        if (file_name.empty() or (shown < 0) or (first > last))
+            throw string("Missing trace file, or bad count or addresses.");
+    } catch (...) {
+        cerr << "usage: paltrace [-n events] [-a address[-address]] file" << endl;
+        return 1;
+    }
+
+    ifstream trace(file_name, ios::binary);
+    palt_header header;
+    if (!trace or !trace.read(reinterpret_cast<char *>(&header), sizeof(header))
+            or (memcmp(header.magic, palt_magic, sizeof(palt_magic)) != 0)) {
+        cerr << file_name << " is not a PAL trace file." << endl;
+        return 1;
+    }
+    if (header.version != palt_version) {
+        cerr << file_name << " is trace file version " << header.version << " (expected "
+             << palt_version << ")." << endl;
+        return 1;
+    }
+    if (!has_single_bit(header.capacity)) {
+        cerr << file_name << " has a bad capacity." << endl;
+        return 1;
+    }
+    vector<palt_event> ring(header.capacity);
+    if (!trace.read(reinterpret_cast<char *>(ring.data()), ring.size() * sizeof(palt_event))) {
+        cerr << file_name << " is truncated." << endl;
+        return 1;
+    }
+
+    // The events kept are the last capacity recorded; event n is at n % capacity.
+    uint64_t kept = min<uint64_t>(header.events, header.capacity);
+    vector<uint64_t> selected;
+    for (uint64_t n = header.events - kept; n < header.events; n++) {
+        const palt_event &event = ring[n % header.capacity];
+        if ((event.address >= first) and (event.address <= last))
+            selected.push_back(n);
+    }
+    size_t from = ((shown > 0) and (selected.size() > size_t(shown))) ? selected.size() - shown : 0;
+
+    establish_function_mapping();
+    cout << file_name << ": " << header.events << " instructions recorded, the last " << kept
+         << " kept";
+    if ((first != 0) or (last != code_size))
+        cout << ", " << selected.size() << " of them at addresses " << first << "-" << last;
+    cout << "." << endl;
+    cout << "       event   address  instruction                  base       top  top of stack" << endl;
+    for (size_t s = from; s < selected.size(); s++) {
+        const palt_event &event = ring[selected[s] % header.capacity];
+        cout << setw(12) << selected[s] << setw(10) << event.address << "  " << left << setw(25)
+             << instruction_text(event) << right << setw(8) << event.base << setw(10) << event.top
+             << "  " << value_text(event) << endl;
+    }
+    return 0;
+}